@@ -0,0 +1,418 @@
+/*++
+
+Module Name:
+
+	counters.c
+
+Abstract:
+
+	This module implements the "Hotdog Battery" performance counter set. The
+	counter set is registered from DriverEntry with a collection callback,
+	which sums the per processor counters of every battery device into one
+	instance per device. The counter layout is described to consumers by
+	HotdogBatteryCounters.man.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "counters.tmh"
+
+//------------------------------------------------------------------ Definitions
+
+//
+// Values handed to PCW for one instance. The layout and the counter ids must
+// match HotdogBatteryCounters.man.
+//
+
+typedef struct _SURFACE_BATTERY_COUNTER_VALUES
+{
+	ULONGLONG I2cTransactions;
+	ULONGLONG I2cBytes;
+	ULONGLONG CacheHits;
+	ULONGLONG CacheLookups;
+	ULONG QueryTime;
+	ULONG Queries;
+	ULONGLONG SnapshotAge;
+	ULONGLONG LockContentions;
+	ULONGLONG ControllerBusyTime;
+	ULONGLONG ControllerWakeups;
+	ULONG TargetOpenTime;
+	ULONG TargetOpens;
+} SURFACE_BATTERY_COUNTER_VALUES, *PSURFACE_BATTERY_COUNTER_VALUES;
+
+#define COUNTER_DESCRIPTOR(Id, Field) \
+	{ (Id), \
+	  0, \
+	  FIELD_OFFSET(SURFACE_BATTERY_COUNTER_VALUES, Field), \
+	  RTL_FIELD_SIZE(SURFACE_BATTERY_COUNTER_VALUES, Field) }
+
+static PCW_COUNTER_DESCRIPTOR HotdogBatteryCounterDescriptors[] = {
+	COUNTER_DESCRIPTOR(1, I2cTransactions),
+	COUNTER_DESCRIPTOR(2, I2cBytes),
+	COUNTER_DESCRIPTOR(3, CacheHits),
+	COUNTER_DESCRIPTOR(4, CacheLookups),
+	COUNTER_DESCRIPTOR(5, QueryTime),
+	COUNTER_DESCRIPTOR(6, Queries),
+	COUNTER_DESCRIPTOR(7, SnapshotAge),
+	COUNTER_DESCRIPTOR(8, LockContentions),
+	COUNTER_DESCRIPTOR(9, ControllerBusyTime),
+	COUNTER_DESCRIPTOR(10, ControllerWakeups),
+	COUNTER_DESCRIPTOR(11, TargetOpenTime),
+	COUNTER_DESCRIPTOR(12, TargetOpens),
+};
+
+//------------------------------------------------------------------- Prototypes
+
+PCW_CALLBACK HotdogBatteryCountersCallback;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCollectCounters(
+	_In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+	_Out_ PSURFACE_BATTERY_COUNTER_VALUES Values
+);
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, HotdogBatteryCountersRegister)
+#pragma alloc_text(PAGE, HotdogBatteryCountersUnregister)
+#pragma alloc_text(PAGE, HotdogBatteryCountersAttach)
+#pragma alloc_text(PAGE, HotdogBatteryCountersDetach)
+#pragma alloc_text(PAGE, HotdogBatteryCountersCallback)
+#pragma alloc_text(PAGE, HotdogBatteryCollectCounters)
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCountersRegister(
+	PSURFACE_BATTERY_GLOBAL_DATA GlobalData
+)
+
+/*++
+
+Routine Description:
+
+	This routine registers the counter set. Failure only disables the
+	counters.
+
+Arguments:
+
+	GlobalData - Supplies a pointer to the driver global data.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	UNICODE_STRING Name = RTL_CONSTANT_STRING(L"Hotdog Battery");
+	PCW_REGISTRATION_INFORMATION RegistrationInformation;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(&RegistrationInformation, sizeof(RegistrationInformation));
+	RegistrationInformation.Version = PCW_CURRENT_VERSION;
+	RegistrationInformation.Name = &Name;
+	RegistrationInformation.CounterCount = ARRAYSIZE(HotdogBatteryCounterDescriptors);
+	RegistrationInformation.Counters = HotdogBatteryCounterDescriptors;
+	RegistrationInformation.Callback = HotdogBatteryCountersCallback;
+	RegistrationInformation.CallbackContext = GlobalData;
+	Status = PcwRegister(&GlobalData->CounterSet, &RegistrationInformation);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"PcwRegister() Failed. Status 0x%x\n",
+			Status);
+
+		GlobalData->CounterSet = NULL;
+	}
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCountersUnregister(
+	PSURFACE_BATTERY_GLOBAL_DATA GlobalData
+)
+
+/*++
+
+Routine Description:
+
+	This routine unregisters the counter set. PcwUnregister waits for
+	running collection callbacks.
+
+Arguments:
+
+	GlobalData - Supplies a pointer to the driver global data.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PAGED_CODE();
+
+	if (GlobalData->CounterSet != NULL) {
+		PcwUnregister(GlobalData->CounterSet);
+		GlobalData->CounterSet = NULL;
+	}
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCountersAttach(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine allocates the per processor counters of a device and adds
+	the device to the counter set. Without counters the device is simply
+	not reported.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_GLOBAL_DATA GlobalData;
+	ULONG Slots;
+
+	PAGED_CODE();
+
+	GlobalData = GetGlobalData(WdfGetDriver());
+	InitializeListHead(&DevExt->CounterLink);
+	Slots = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	DevExt->Counters = (PSURFACE_BATTERY_COUNTERS)ExAllocatePool2(
+		POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+		Slots * sizeof(SURFACE_BATTERY_COUNTERS),
+		SURFACE_BATTERY_TAG);
+
+	if (DevExt->Counters == NULL) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"Per processor counters not allocated\n");
+
+		return;
+	}
+
+	DevExt->CounterSlots = Slots;
+	DevExt->CounterInstanceId = (ULONG)InterlockedIncrement(&GlobalData->NextInstanceId);
+	RtlStringCchPrintfW(DevExt->CounterInstanceName,
+		ARRAYSIZE(DevExt->CounterInstanceName),
+		L"Battery %u",
+		DevExt->CounterInstanceId);
+
+	WdfWaitLockAcquire(GlobalData->DeviceListLock, NULL);
+	InsertTailList(&GlobalData->DeviceList, &DevExt->CounterLink);
+	WdfWaitLockRelease(GlobalData->DeviceListLock);
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCountersDetach(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine removes a device from the counter set and frees its
+	counters.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_GLOBAL_DATA GlobalData;
+
+	PAGED_CODE();
+
+	if (DevExt->Counters == NULL) {
+		return;
+	}
+
+	GlobalData = GetGlobalData(WdfGetDriver());
+	WdfWaitLockAcquire(GlobalData->DeviceListLock, NULL);
+	RemoveEntryList(&DevExt->CounterLink);
+	WdfWaitLockRelease(GlobalData->DeviceListLock);
+
+	ExFreePoolWithTag(DevExt->Counters, SURFACE_BATTERY_TAG);
+	DevExt->Counters = NULL;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCollectCounters(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PSURFACE_BATTERY_COUNTER_VALUES Values
+)
+
+/*++
+
+Routine Description:
+
+	This routine sums the per processor counters of a device.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Values - Supplies a pointer to the structure to fill.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_COUNTERS Counters;
+	LARGE_INTEGER Now;
+	ULONG Slot;
+	LONG64 QueryTime;
+	LONG64 Queries;
+	LONG64 Timestamp;
+
+	PAGED_CODE();
+
+	RtlZeroMemory(Values, sizeof(*Values));
+	QueryTime = 0;
+	Queries = 0;
+	for (Slot = 0; Slot < DevExt->CounterSlots; Slot += 1) {
+		Counters = &DevExt->Counters[Slot];
+		Values->I2cTransactions += ReadNoFence64(&Counters->I2cTransactions);
+		Values->I2cBytes += ReadNoFence64(&Counters->I2cBytes);
+		Values->CacheHits += ReadNoFence64(&Counters->CacheHits);
+		Values->CacheLookups += ReadNoFence64(&Counters->CacheLookups);
+		Values->LockContentions += ReadNoFence64(&Counters->LockContentions);
+		QueryTime += ReadNoFence64(&Counters->QueryTime);
+		Queries += ReadNoFence64(&Counters->Queries);
+	}
+
+	//
+	// Average timers are 32 bit, consumers only look at the difference
+	// between two collections so truncation is harmless.
+	//
+
+	Values->QueryTime = (ULONG)QueryTime;
+	Values->Queries = (ULONG)Queries;
+	Values->TargetOpenTime = (ULONG)ReadNoFence64(&DevExt->I2CContext.OpenTime);
+	Values->TargetOpens = (ULONG)ReadNoFence64(&DevExt->I2CContext.OpenCount);
+
+	Timestamp = ReadNoFence64((LONG64*)&DevExt->Snapshot.StatusTimestamp);
+	if (Timestamp != 0) {
+		KeQuerySystemTime(&Now);
+		if (Now.QuadPart > Timestamp) {
+			Values->SnapshotAge = (ULONGLONG)(Now.QuadPart - Timestamp) / SECONDS(1);
+		}
+	}
+
+	SpbBusQueryActivity(&DevExt->I2CContext,
+		&Values->ControllerBusyTime,
+		&Values->ControllerWakeups);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryCountersCallback(
+	PCW_CALLBACK_TYPE Type,
+	PPCW_CALLBACK_INFORMATION Info,
+	PVOID Context
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the PCW callback. Instances are enumerated and collected
+	the same way, one instance per battery device.
+
+Arguments:
+
+	Type - Supplies the type of the callback.
+
+	Info - Supplies the callback parameters.
+
+	Context - Supplies the driver global data.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PPCW_BUFFER Buffer;
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+	PLIST_ENTRY Entry;
+	PSURFACE_BATTERY_GLOBAL_DATA GlobalData;
+	UNICODE_STRING InstanceName;
+	PCW_DATA InstanceData;
+	NTSTATUS Status;
+	SURFACE_BATTERY_COUNTER_VALUES Values;
+
+	PAGED_CODE();
+
+	switch (Type) {
+	case PcwCallbackEnumerateInstances:
+		Buffer = Info->EnumerateInstances.Buffer;
+		break;
+
+	case PcwCallbackCollectData:
+		Buffer = Info->CollectData.Buffer;
+		break;
+
+	default:
+		return STATUS_SUCCESS;
+	}
+
+	GlobalData = (PSURFACE_BATTERY_GLOBAL_DATA)Context;
+	Status = STATUS_SUCCESS;
+	WdfWaitLockAcquire(GlobalData->DeviceListLock, NULL);
+	for (Entry = GlobalData->DeviceList.Flink;
+		Entry != &GlobalData->DeviceList;
+		Entry = Entry->Flink) {
+
+		DevExt = CONTAINING_RECORD(Entry, SURFACE_BATTERY_FDO_DATA, CounterLink);
+		HotdogBatteryCollectCounters(DevExt, &Values);
+		RtlInitUnicodeString(&InstanceName, DevExt->CounterInstanceName);
+		InstanceData.Data = &Values;
+		InstanceData.Size = sizeof(Values);
+		Status = PcwAddInstance(Buffer,
+			&InstanceName,
+			DevExt->CounterInstanceId,
+			1,
+			&InstanceData);
+
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+	}
+
+	WdfWaitLockRelease(GlobalData->DeviceListLock);
+	return Status;
+}
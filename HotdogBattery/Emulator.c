@@ -0,0 +1,650 @@
+/*++
+
+Module Name:
+
+	emulator.c
+
+Abstract:
+
+	This module implements an emulated BQ27541 fuel gauge behind the SPB
+	helpers, built when SPB_EMULATE_GAUGE is set in spb.h. Transfers are
+	answered from a register file computed from a simple charge/discharge
+	model instead of going to the bus, and are delayed by the time the same
+	transfer would take on a real I2C bus. This allows the driver to be run
+	and its bus access patterns to be measured on machines without the
+	gauge.
+
+	The register pointer behaves as on the gauge: a one byte write sets it,
+	and reads continue from it across register boundaries.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "emulator.tmh"
+
+#if SPB_EMULATE_GAUGE
+
+//------------------------------------------------------------------ Definitions
+
+//
+// Bus timing model. Every byte costs nine clocks (eight data bits and the
+// acknowledge), every transaction also carries its address byte and a
+// fixed start/stop and controller overhead. The gauge stretches the clock
+// before returning data. Every SPB_EMULATOR_NACK_INTERVAL-th transaction
+// is not acknowledged, 0 disables the injection.
+//
+
+#define SPB_EMULATOR_CLOCK_HZ                   400000
+#define SPB_EMULATOR_TRANSACTION_OVERHEAD_US    10
+#define SPB_EMULATOR_CLOCK_STRETCH_US           100
+#define SPB_EMULATOR_NACK_INTERVAL              0
+
+//
+// Opening the target goes through the resource hub and the controller
+// driver, which powers the controller up.
+//
+
+#define SPB_EMULATOR_OPEN_US                    500
+
+//
+// Battery model, capacities in mAh, currents in mA, voltages in mV. Model
+// time runs SPB_EMULATOR_TIME_SCALE times faster than real time, so full
+// cycles can be observed in a test session.
+//
+
+#define SPB_EMULATOR_TIME_SCALE                 60
+#define SPB_EMULATOR_DESIGN_CAPACITY            5000
+#define SPB_EMULATOR_FULL_CHARGE_CAPACITY       4800
+#define SPB_EMULATOR_INITIAL_PERCENT            60
+#define SPB_EMULATOR_LOAD_CURRENT               900
+#define SPB_EMULATOR_CHARGE_CURRENT             2000
+#define SPB_EMULATOR_TAPER_PERCENT              80
+#define SPB_EMULATOR_TERMINATION_CURRENT        100
+#define SPB_EMULATOR_EMPTY_VOLTAGE              3400
+#define SPB_EMULATOR_FULL_VOLTAGE               4350
+#define SPB_EMULATOR_RESISTANCE_MOHM            100
+#define SPB_EMULATOR_AMBIENT_TEMPERATURE        2982
+#define SPB_EMULATOR_SOCF_PERCENT               5
+#define SPB_EMULATOR_FC_PERCENT                 99
+
+//
+// Gauge registers only known to the emulator.
+//
+
+#define BQ27541_REG_TIME_TO_FULL                0x18
+
+#define BQ27541_FW_VERSION                      0x0117
+#define BQ27541_HW_VERSION                      0x0060
+
+#define BQ27541_REGISTER_COUNT                  32
+
+#define BQ27541_TIME_UNKNOWN                    0xFFFF
+
+#define SPB_EMULATOR_FULL_CHARGE \
+	((LONGLONG)SPB_EMULATOR_FULL_CHARGE_CAPACITY * 1000)
+
+struct _SPB_EMULATOR
+{
+	UCHAR Pointer;
+	UINT16 Subcommand;
+	BOOLEAN Charging;
+	ULONG CycleCount;
+	ULONG Transactions;
+
+	//
+	// Charge in uAh and current in mA, negative while discharging.
+	//
+
+	LONGLONG Charge;
+	LONG Current;
+	ULONGLONG LastStep;
+};
+
+//------------------------------------------------------------------- Prototypes
+
+VOID
+SpbEmulatorStep(
+	_Inout_ SPB_EMULATOR* Emulator
+);
+
+VOID
+SpbEmulatorBuildRegisters(
+	_In_ SPB_EMULATOR* Emulator,
+	_Out_writes_(BQ27541_REGISTER_COUNT) PUINT16 Registers
+);
+
+NTSTATUS
+SpbEmulatorTransfer(
+	_Inout_ SPB_EMULATOR* Emulator,
+	_In_ ULONG Bytes,
+	_In_ BOOLEAN Read
+);
+
+VOID
+SpbEmulatorFetch(
+	_Inout_ SPB_EMULATOR* Emulator,
+	_Out_writes_bytes_(Length) PUCHAR Buffer,
+	_In_ ULONG Length
+);
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+NTSTATUS
+SpbEmulatorCreate(
+	SPB_CONTEXT* SpbContext
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the emulated gauge, partially charged and
+	discharging.
+
+Arguments:
+
+	SpbContext - Supplies a pointer to the SPB context.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	SPB_EMULATOR* Emulator;
+
+	Emulator = (SPB_EMULATOR*)ExAllocatePool2(POOL_FLAG_NON_PAGED,
+		sizeof(SPB_EMULATOR),
+		SPB_POOL_TAG);
+
+	if (Emulator == NULL) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	Emulator->Charge = SPB_EMULATOR_FULL_CHARGE * SPB_EMULATOR_INITIAL_PERCENT / 100;
+	Emulator->Current = -SPB_EMULATOR_LOAD_CURRENT;
+	Emulator->LastStep = KeQueryInterruptTime();
+	SpbContext->Emulator = Emulator;
+
+	Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+		"Using the emulated gauge, %u Hz bus\n",
+		SPB_EMULATOR_CLOCK_HZ);
+
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+SpbEmulatorDestroy(
+	SPB_CONTEXT* SpbContext
+)
+
+/*++
+
+Routine Description:
+
+	This routine frees the emulated gauge.
+
+Arguments:
+
+	SpbContext - Supplies a pointer to the SPB context.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	if (SpbContext->Emulator != NULL) {
+		ExFreePoolWithTag(SpbContext->Emulator, SPB_POOL_TAG);
+		SpbContext->Emulator = NULL;
+	}
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SpbEmulatorOpen(
+	SPB_CONTEXT* SpbContext
+)
+
+/*++
+
+Routine Description:
+
+	This routine spends the time opening the I/O target takes. The gauge
+	keeps its state while the target is closed.
+
+Arguments:
+
+	SpbContext - Supplies a pointer to the SPB context.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	if (SpbContext->Emulator == NULL) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	KeStallExecutionProcessor(SPB_EMULATOR_OPEN_US);
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+SpbEmulatorStep(
+	SPB_EMULATOR* Emulator
+)
+
+/*++
+
+Routine Description:
+
+	This routine advances the battery model to the current time. The
+	current is held constant over the step.
+
+	The battery discharges at a constant load until empty, then charges at
+	constant current up to SPB_EMULATOR_TAPER_PERCENT and with a linearly
+	tapering current above it. Charging terminates, and counts a cycle,
+	once the current drops to SPB_EMULATOR_TERMINATION_CURRENT.
+
+Arguments:
+
+	Emulator - Supplies a pointer to the emulated gauge.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	LONGLONG Elapsed;
+	LONGLONG Taper;
+	ULONGLONG Now;
+
+	Now = KeQueryInterruptTime();
+	Elapsed = (LONGLONG)(Now - Emulator->LastStep) * SPB_EMULATOR_TIME_SCALE;
+	Emulator->LastStep = Now;
+
+	//
+	// mA * 100ns / 36000000 = uAh
+	//
+
+	Emulator->Charge += (LONGLONG)Emulator->Current * Elapsed / 36000000;
+	Emulator->Charge = max(0, min(Emulator->Charge, SPB_EMULATOR_FULL_CHARGE));
+
+	if (Emulator->Charging == FALSE) {
+		if (Emulator->Charge == 0) {
+			Emulator->Charging = TRUE;
+			Emulator->Current = SPB_EMULATOR_CHARGE_CURRENT;
+		}
+
+		return;
+	}
+
+	Taper = SPB_EMULATOR_FULL_CHARGE * SPB_EMULATOR_TAPER_PERCENT / 100;
+	if (Emulator->Charge <= Taper) {
+		Emulator->Current = SPB_EMULATOR_CHARGE_CURRENT;
+
+	} else {
+		Emulator->Current = (LONG)(SPB_EMULATOR_CHARGE_CURRENT *
+			(SPB_EMULATOR_FULL_CHARGE - Emulator->Charge) /
+			(SPB_EMULATOR_FULL_CHARGE - Taper));
+	}
+
+	if (Emulator->Current <= SPB_EMULATOR_TERMINATION_CURRENT) {
+		Emulator->Charging = FALSE;
+		Emulator->Current = -SPB_EMULATOR_LOAD_CURRENT;
+		Emulator->CycleCount += 1;
+	}
+}
+
+_Use_decl_annotations_
+VOID
+SpbEmulatorBuildRegisters(
+	SPB_EMULATOR* Emulator,
+	PUINT16 Registers
+)
+
+/*++
+
+Routine Description:
+
+	This routine computes the gauge register file from the battery model.
+
+Arguments:
+
+	Emulator - Supplies a pointer to the emulated gauge.
+
+	Registers - Supplies the register file to fill, indexed by address / 2.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	UINT16 Control;
+	ULONG Flags;
+	ULONG Remaining;
+
+	RtlZeroMemory(Registers, BQ27541_REGISTER_COUNT * sizeof(UINT16));
+	Remaining = (ULONG)(Emulator->Charge / 1000);
+
+	switch (Emulator->Subcommand) {
+	case BQ27XXX_CONTROL_DEVICE_TYPE:
+		Control = BQ27541_DEVICE_TYPE;
+		break;
+
+	case BQ27XXX_CONTROL_FW_VERSION:
+		Control = BQ27541_FW_VERSION;
+		break;
+
+	case BQ27XXX_CONTROL_HW_VERSION:
+		Control = BQ27541_HW_VERSION;
+		break;
+
+	case BQ27XXX_CONTROL_STATUS:
+	default:
+		Control = 0;
+		break;
+	}
+
+	Flags = 0;
+	if (Emulator->Charging == FALSE) {
+		Flags |= BQ27541_FLAGS_DSG;
+	}
+
+	if (Remaining * 100 <= SPB_EMULATOR_FULL_CHARGE_CAPACITY * SPB_EMULATOR_SOCF_PERCENT) {
+		Flags |= BQ27541_FLAGS_SOCF;
+	}
+
+	if (Remaining * 100 >= SPB_EMULATOR_FULL_CHARGE_CAPACITY * SPB_EMULATOR_FC_PERCENT) {
+		Flags |= BQ27541_FLAGS_FC;
+	}
+
+	Registers[BQ27XXX_REG_CONTROL >> 1] = Control;
+	Registers[BQ27541_REG_TEMPERATURE >> 1] = (UINT16)(SPB_EMULATOR_AMBIENT_TEMPERATURE +
+		((Emulator->Current < 0) ? -Emulator->Current : Emulator->Current) / 20);
+
+	Registers[BQ27541_REG_VOLTAGE >> 1] = (UINT16)(SPB_EMULATOR_EMPTY_VOLTAGE +
+		((SPB_EMULATOR_FULL_VOLTAGE - SPB_EMULATOR_EMPTY_VOLTAGE) * (LONG)Remaining /
+		 SPB_EMULATOR_FULL_CHARGE_CAPACITY) +
+		(Emulator->Current * SPB_EMULATOR_RESISTANCE_MOHM / 1000));
+
+	Registers[BQ27541_REG_FLAGS >> 1] = (UINT16)Flags;
+	Registers[BQ27541_REG_REMAINING_CAPACITY >> 1] = (UINT16)Remaining;
+	Registers[BQ27541_REG_FULL_CHARGE_CAPACITY >> 1] = SPB_EMULATOR_FULL_CHARGE_CAPACITY;
+	Registers[BQ27541_REG_TIME_TO_EMPTY >> 1] = (Emulator->Current < 0) ?
+		(UINT16)(Remaining * 60 / (ULONG)(-Emulator->Current)) :
+		BQ27541_TIME_UNKNOWN;
+
+	Registers[BQ27541_REG_AVERAGE_CURRENT >> 1] = (UINT16)(INT16)Emulator->Current;
+	Registers[BQ27541_REG_TIME_TO_FULL >> 1] = (Emulator->Current > 0) ?
+		(UINT16)((SPB_EMULATOR_FULL_CHARGE_CAPACITY - Remaining) * 60 /
+				 (ULONG)Emulator->Current) :
+		BQ27541_TIME_UNKNOWN;
+
+	Registers[BQ27541_REG_CYCLE_COUNT >> 1] = (UINT16)Emulator->CycleCount;
+	Registers[BQ27541_REG_DESIGN_CAPACITY >> 1] = SPB_EMULATOR_DESIGN_CAPACITY;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SpbEmulatorTransfer(
+	SPB_EMULATOR* Emulator,
+	ULONG Bytes,
+	BOOLEAN Read
+)
+
+/*++
+
+Routine Description:
+
+	This routine spends the time a transaction of Bytes data bytes takes on
+	the bus, and decides whether the gauge acknowledges it. A transaction
+	that is not acknowledged only costs its address byte.
+
+Arguments:
+
+	Emulator - Supplies a pointer to the emulated gauge.
+
+	Bytes - Supplies the number of data bytes transferred.
+
+	Read - Supplies TRUE for a read, which is subject to clock stretching.
+
+Return Value:
+
+	STATUS_NO_SUCH_DEVICE when the address was not acknowledged.
+
+--*/
+
+{
+	ULONG Microseconds;
+
+	Emulator->Transactions += 1;
+	if (SPB_EMULATOR_NACK_INTERVAL != 0 &&
+		(Emulator->Transactions % SPB_EMULATOR_NACK_INTERVAL) == 0) {
+
+		KeStallExecutionProcessor(SPB_EMULATOR_TRANSACTION_OVERHEAD_US +
+			(9 * 1000000 / SPB_EMULATOR_CLOCK_HZ));
+
+		return STATUS_NO_SUCH_DEVICE;
+	}
+
+	Microseconds = SPB_EMULATOR_TRANSACTION_OVERHEAD_US +
+		(9 * (1 + Bytes) * 1000000 / SPB_EMULATOR_CLOCK_HZ);
+
+	if (Read != FALSE) {
+		Microseconds += SPB_EMULATOR_CLOCK_STRETCH_US;
+	}
+
+	KeStallExecutionProcessor(Microseconds);
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SpbEmulatorWrite(
+	SPB_CONTEXT* SpbContext,
+	PUCHAR Buffer,
+	ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+	This routine emulates a write transaction. The first byte sets the
+	register pointer, a two byte write to the Control register selects the
+	subcommand returned by later Control reads. Writes to any other
+	register are ignored, as the gauge does for its read-only registers.
+
+	The caller must hold the SPB lock.
+
+Arguments:
+
+	SpbContext - Supplies a pointer to the SPB context.
+
+	Buffer - Supplies the register address followed by the data.
+
+	Length - Supplies the length of Buffer in bytes.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	SPB_EMULATOR* Emulator;
+	NTSTATUS Status;
+
+	Emulator = SpbContext->Emulator;
+	Status = SpbEmulatorTransfer(Emulator, Length, FALSE);
+	if (!NT_SUCCESS(Status) || Length == 0) {
+		return Status;
+	}
+
+	Emulator->Pointer = Buffer[0];
+	if (Emulator->Pointer == BQ27XXX_REG_CONTROL && Length >= 3) {
+		Emulator->Subcommand = (UINT16)(Buffer[1] | (Buffer[2] << 8));
+	}
+
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SpbEmulatorRead(
+	SPB_CONTEXT* SpbContext,
+	PUCHAR Buffer,
+	ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+	This routine emulates a read transaction from the register pointer.
+
+	The caller must hold the SPB lock.
+
+Arguments:
+
+	SpbContext - Supplies a pointer to the SPB context.
+
+	Buffer - Supplies the buffer receiving the data.
+
+	Length - Supplies the number of bytes to read.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	SPB_EMULATOR* Emulator;
+	NTSTATUS Status;
+
+	Emulator = SpbContext->Emulator;
+	Status = SpbEmulatorTransfer(Emulator, Length, TRUE);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	SpbEmulatorFetch(Emulator, Buffer, Length);
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+SpbEmulatorWriteRead(
+	SPB_CONTEXT* SpbContext,
+	UCHAR Address,
+	PUCHAR Buffer,
+	ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+	This routine emulates a register write followed by a read with a
+	repeated start. The whole sequence is one transaction, the repeated
+	start only adds a second address byte.
+
+	The caller must hold the SPB lock.
+
+Arguments:
+
+	SpbContext - Supplies a pointer to the SPB context.
+
+	Address - Supplies the register to read from.
+
+	Buffer - Supplies the buffer receiving the data.
+
+	Length - Supplies the number of bytes to read.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	SPB_EMULATOR* Emulator;
+	NTSTATUS Status;
+
+	Emulator = SpbContext->Emulator;
+	Status = SpbEmulatorTransfer(Emulator, 2 + Length, TRUE);
+	if (!NT_SUCCESS(Status)) {
+		return Status;
+	}
+
+	Emulator->Pointer = Address;
+	SpbEmulatorFetch(Emulator, Buffer, Length);
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID
+SpbEmulatorFetch(
+	SPB_EMULATOR* Emulator,
+	PUCHAR Buffer,
+	ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the registers from the register pointer on and
+	advances the pointer past them. Bytes past the last register read as
+	zero.
+
+Arguments:
+
+	Emulator - Supplies a pointer to the emulated gauge.
+
+	Buffer - Supplies the buffer receiving the data.
+
+	Length - Supplies the number of bytes to read.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONG Index;
+	ULONG Offset;
+	UINT16 Registers[BQ27541_REGISTER_COUNT];
+
+	SpbEmulatorStep(Emulator);
+	SpbEmulatorBuildRegisters(Emulator, Registers);
+	for (Index = 0; Index < Length; Index += 1) {
+		Offset = (ULONG)Emulator->Pointer + Index;
+		Buffer[Index] = (Offset < sizeof(Registers)) ?
+			((PUCHAR)Registers)[Offset] :
+			0;
+	}
+
+	Emulator->Pointer = (UCHAR)(Emulator->Pointer + Length);
+}
+
+#endif
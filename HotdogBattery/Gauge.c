@@ -0,0 +1,461 @@
+/*++
+
+Module Name:
+
+	gauge.c
+
+Abstract:
+
+	This module implements the gauge profiles. Every supported gauge type is
+	described by a static profile built at compile time from its register
+	map: the register of each function, the status burst window, the Flags
+	bits and the registers each information level is computed from. The
+	profile is selected once at prepare hardware, by hardware id or by the
+	DEVICE_TYPE the gauge reports, and the rest of the driver only indexes
+	into it. The Control subcommands identifying the gauge are read in one
+	bus sequence.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "gauge.tmh"
+
+//------------------------------------------------------------------ Definitions
+
+//
+// BQ27541, registers in HotdogBattery.h.
+//
+
+#define BQ27541_STATUS_BURST_START          BQ27541_REG_TEMPERATURE
+#define BQ27541_STATUS_BURST_END            (BQ27541_REG_AVERAGE_CURRENT + sizeof(UINT16))
+
+//
+// BQ27742
+//
+
+#define BQ27742_REG_TEMPERATURE             0x06
+#define BQ27742_REG_VOLTAGE                 0x08
+#define BQ27742_REG_FLAGS                   0x0A
+#define BQ27742_REG_REMAINING_CAPACITY      0x10
+#define BQ27742_REG_FULL_CHARGE_CAPACITY    0x12
+#define BQ27742_REG_AVERAGE_CURRENT         0x14
+#define BQ27742_REG_TIME_TO_EMPTY           0x16
+#define BQ27742_REG_CYCLE_COUNT             0x2A
+#define BQ27742_REG_DESIGN_CAPACITY         0x3C
+
+#define BQ27742_FLAGS_DSG                   (1 << 0)
+#define BQ27742_FLAGS_SOCF                  (1 << 1)
+#define BQ27742_FLAGS_FC                    (1 << 9)
+
+#define BQ27742_DEVICE_TYPE                 0x0742
+
+#define BQ27742_STATUS_BURST_START          BQ27742_REG_TEMPERATURE
+#define BQ27742_STATUS_BURST_END            (BQ27742_REG_TIME_TO_EMPTY + sizeof(UINT16))
+
+//
+// BQ27Z561. The Flags register is BatteryStatus, which has its own bit
+// layout. The gauge is only selected by hardware id.
+//
+
+#define BQ27Z561_REG_TEMPERATURE            0x06
+#define BQ27Z561_REG_VOLTAGE                0x08
+#define BQ27Z561_REG_FLAGS                  0x0A
+#define BQ27Z561_REG_REMAINING_CAPACITY     0x10
+#define BQ27Z561_REG_FULL_CHARGE_CAPACITY   0x12
+#define BQ27Z561_REG_AVERAGE_CURRENT        0x14
+#define BQ27Z561_REG_TIME_TO_EMPTY          0x16
+#define BQ27Z561_REG_CYCLE_COUNT            0x2A
+#define BQ27Z561_REG_DESIGN_CAPACITY        0x3C
+
+#define BQ27Z561_FLAGS_DSG                  (1 << 6)
+#define BQ27Z561_FLAGS_SOCF                 (1 << 4)
+#define BQ27Z561_FLAGS_FC                   (1 << 5)
+
+#define BQ27Z561_DEVICE_TYPE                0
+
+#define BQ27Z561_STATUS_BURST_START         BQ27Z561_REG_TEMPERATURE
+#define BQ27Z561_STATUS_BURST_END           (BQ27Z561_REG_TIME_TO_EMPTY + sizeof(UINT16))
+
+//
+// Every register must be tracked by the register cache and the status
+// registers must lie in the status burst window.
+//
+
+#define GAUGE_IN_BURST(Chip, Register) \
+	((Chip##_REG_##Register) >= Chip##_STATUS_BURST_START && \
+	 (Chip##_REG_##Register) + sizeof(UINT16) <= Chip##_STATUS_BURST_END)
+
+#define GAUGE_PROFILE_CHECK(Chip) \
+	C_ASSERT(Chip##_STATUS_BURST_END - Chip##_STATUS_BURST_START <= \
+		SURFACE_BATTERY_STATUS_BURST_MAX); \
+	C_ASSERT(GAUGE_IN_BURST(Chip, TEMPERATURE) && \
+		GAUGE_IN_BURST(Chip, VOLTAGE) && \
+		GAUGE_IN_BURST(Chip, FLAGS) && \
+		GAUGE_IN_BURST(Chip, REMAINING_CAPACITY) && \
+		GAUGE_IN_BURST(Chip, FULL_CHARGE_CAPACITY) && \
+		GAUGE_IN_BURST(Chip, TIME_TO_EMPTY) && \
+		GAUGE_IN_BURST(Chip, AVERAGE_CURRENT)); \
+	C_ASSERT((Chip##_REG_CYCLE_COUNT >> 1) < SURFACE_BATTERY_CACHE_REGISTERS && \
+		(Chip##_REG_DESIGN_CAPACITY >> 1) < SURFACE_BATTERY_CACHE_REGISTERS)
+
+#define GAUGE_PROFILE(Chip, Id) \
+	{ \
+		.Name = #Chip, \
+		.HardwareId = (Id), \
+		.DeviceType = Chip##_DEVICE_TYPE, \
+		.Registers = { \
+			[SURFACE_BATTERY_GAUGE_TEMPERATURE] = Chip##_REG_TEMPERATURE, \
+			[SURFACE_BATTERY_GAUGE_VOLTAGE] = Chip##_REG_VOLTAGE, \
+			[SURFACE_BATTERY_GAUGE_FLAGS] = Chip##_REG_FLAGS, \
+			[SURFACE_BATTERY_GAUGE_REMAINING_CAPACITY] = Chip##_REG_REMAINING_CAPACITY, \
+			[SURFACE_BATTERY_GAUGE_FULL_CHARGE_CAPACITY] = Chip##_REG_FULL_CHARGE_CAPACITY, \
+			[SURFACE_BATTERY_GAUGE_TIME_TO_EMPTY] = Chip##_REG_TIME_TO_EMPTY, \
+			[SURFACE_BATTERY_GAUGE_AVERAGE_CURRENT] = Chip##_REG_AVERAGE_CURRENT, \
+			[SURFACE_BATTERY_GAUGE_CYCLE_COUNT] = Chip##_REG_CYCLE_COUNT, \
+			[SURFACE_BATTERY_GAUGE_DESIGN_CAPACITY] = Chip##_REG_DESIGN_CAPACITY, \
+		}, \
+		.StatusBurstStart = Chip##_STATUS_BURST_START, \
+		.StatusBurstLength = Chip##_STATUS_BURST_END - Chip##_STATUS_BURST_START, \
+		.FlagsFull = Chip##_FLAGS_FC, \
+		.FlagsDischarging = Chip##_FLAGS_DSG, \
+		.FlagsCritical = Chip##_FLAGS_SOCF, \
+		.FlagsNotifyMask = Chip##_FLAGS_DSG | Chip##_FLAGS_SOCF | Chip##_FLAGS_FC, \
+		.LevelRegisters = { \
+			[BatteryInformation] = \
+				SURFACE_BATTERY_CACHE_BIT(Chip##_REG_FULL_CHARGE_CAPACITY) | \
+				SURFACE_BATTERY_CACHE_BIT(Chip##_REG_CYCLE_COUNT) | \
+				SURFACE_BATTERY_CACHE_BIT(Chip##_REG_DESIGN_CAPACITY), \
+			[BatteryGranularityInformation] = \
+				SURFACE_BATTERY_CACHE_BIT(Chip##_REG_FULL_CHARGE_CAPACITY), \
+			[BatteryTemperature] = \
+				SURFACE_BATTERY_CACHE_BIT(Chip##_REG_TEMPERATURE), \
+			[BatteryEstimatedTime] = \
+				SURFACE_BATTERY_CACHE_BIT(Chip##_REG_FLAGS) | \
+				SURFACE_BATTERY_CACHE_BIT(Chip##_REG_TIME_TO_EMPTY), \
+		}, \
+	}
+
+GAUGE_PROFILE_CHECK(BQ27541);
+GAUGE_PROFILE_CHECK(BQ27742);
+GAUGE_PROFILE_CHECK(BQ27Z561);
+
+//
+// The first profile is the default, used when neither the hardware id nor
+// the DEVICE_TYPE of the gauge matches a profile.
+//
+
+static const SURFACE_BATTERY_GAUGE_PROFILE HotdogBatteryGaugeProfiles[] = {
+	GAUGE_PROFILE(BQ27541, L"ACPI\\BQ27541"),
+	GAUGE_PROFILE(BQ27742, L"ACPI\\BQ27742"),
+	GAUGE_PROFILE(BQ27Z561, L"ACPI\\BQ27Z561"),
+};
+
+//
+// Control subcommands read when the gauge is identified, in the order of
+// the SURFACE_BATTERY_GAUGE_IDENTITY fields.
+//
+
+static const UINT16 HotdogBatteryIdentitySubcommands[] = {
+	BQ27XXX_CONTROL_STATUS,
+	BQ27XXX_CONTROL_DEVICE_TYPE,
+	BQ27XXX_CONTROL_FW_VERSION,
+	BQ27XXX_CONTROL_HW_VERSION,
+};
+
+C_ASSERT(ARRAYSIZE(HotdogBatteryIdentitySubcommands) <= SPB_MAX_COMMANDS);
+
+//------------------------------------------------------------------- Prototypes
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PCSURFACE_BATTERY_GAUGE_PROFILE
+HotdogBatteryGaugeFromHardwareId(
+	_In_ WDFDEVICE Device
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+PCSURFACE_BATTERY_GAUGE_PROFILE
+HotdogBatteryGaugeFromDeviceType(
+	_In_ UINT16 DeviceType
+);
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, HotdogBatterySelectGauge)
+#pragma alloc_text(PAGE, HotdogBatteryIdentifyGauge)
+#pragma alloc_text(PAGE, HotdogBatteryGaugeFromHardwareId)
+#pragma alloc_text(PAGE, HotdogBatteryGaugeFromDeviceType)
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySelectGauge(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine selects the gauge profile. Hardware ids are matched first.
+	The Control() identification sequence is only sent when no hardware id
+	matched or the matched profile is a BQ27xxx part that answers it; the
+	DEVICE_TYPE it reports picks the profile when no hardware id matched.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PCSURFACE_BATTERY_GAUGE_PROFILE Profile;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	Profile = HotdogBatteryGaugeFromHardwareId(DevExt->Device);
+	if (Profile != NULL && Profile->DeviceType == 0) {
+		goto SelectGaugeEnd;
+	}
+
+	Status = HotdogBatteryIdentifyGauge(DevExt);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"HotdogBatteryIdentifyGauge failed with Status = 0x%08lX\n",
+			Status);
+	}
+
+	if (DevExt->GaugeIdentity.Valid != FALSE) {
+		if (Profile == NULL) {
+			Profile = HotdogBatteryGaugeFromDeviceType(DevExt->GaugeIdentity.DeviceType);
+
+		} else if (Profile->DeviceType != DevExt->GaugeIdentity.DeviceType) {
+			Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+				"Gauge reported DEVICE_TYPE 0x%04x, keeping the %s profile\n",
+				DevExt->GaugeIdentity.DeviceType,
+				Profile->Name);
+		}
+	}
+
+SelectGaugeEnd:
+	if (Profile == NULL) {
+		Profile = &HotdogBatteryGaugeProfiles[0];
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"Unknown gauge, using the %s profile\n",
+			Profile->Name);
+	}
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
+		"Gauge profile %s\n",
+		Profile->Name);
+
+	DevExt->Gauge = Profile;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryIdentifyGauge(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads the Control status, device type, firmware and
+	hardware version of the gauge in a single bus sequence. The results are
+	kept for the current battery tag, later calls for the same tag do not
+	touch the bus.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PSURFACE_BATTERY_GAUGE_IDENTITY Identity;
+	UINT16 Results[ARRAYSIZE(HotdogBatteryIdentitySubcommands)];
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	Identity = &DevExt->GaugeIdentity;
+	if (Identity->Valid != FALSE &&
+		Identity->BatteryTag == DevExt->BatteryTag) {
+
+		return STATUS_SUCCESS;
+	}
+
+	Identity->Valid = FALSE;
+	Status = SpbReadCommandsSynchronously(&DevExt->I2CContext,
+		BQ27XXX_REG_CONTROL,
+		HotdogBatteryIdentitySubcommands,
+		ARRAYSIZE(HotdogBatteryIdentitySubcommands),
+		BQ27XXX_CONTROL_DELAY_US,
+		Results);
+
+	if (!NT_SUCCESS(Status)) {
+		goto IdentifyGaugeEnd;
+	}
+
+	Identity->ControlStatus = Results[0];
+	Identity->DeviceType = Results[1];
+	Identity->FirmwareVersion = Results[2];
+	Identity->HardwareVersion = Results[3];
+	Identity->BatteryTag = DevExt->BatteryTag;
+	Identity->Valid = TRUE;
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
+		"Gauge DEVICE_TYPE 0x%04x, FW_VERSION 0x%04x, HW_VERSION 0x%04x, "
+		"CONTROL_STATUS 0x%04x\n",
+		Identity->DeviceType,
+		Identity->FirmwareVersion,
+		Identity->HardwareVersion,
+		Identity->ControlStatus);
+
+IdentifyGaugeEnd:
+	return Status;
+}
+
+_Use_decl_annotations_
+PCSURFACE_BATTERY_GAUGE_PROFILE
+HotdogBatteryGaugeFromHardwareId(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine looks up the hardware ids of the device in the profiles.
+
+Arguments:
+
+	Device - Supplies a handle to the battery device.
+
+Return Value:
+
+	The matching profile, NULL if none matched.
+
+--*/
+
+{
+	size_t Count;
+	UNICODE_STRING HardwareId;
+	WDFMEMORY HardwareIds;
+	PCWSTR Id;
+	ULONG Index;
+	size_t Length;
+	UNICODE_STRING ProfileId;
+	PCSURFACE_BATTERY_GAUGE_PROFILE Profile;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	Profile = NULL;
+	Status = WdfDeviceAllocAndQueryProperty(Device,
+		DevicePropertyHardwareID,
+		PagedPool,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&HardwareIds);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"WdfDeviceAllocAndQueryProperty(HardwareID) Failed. Status 0x%x\n",
+			Status);
+
+		goto GaugeFromHardwareIdEnd;
+	}
+
+	//
+	// The hardware ids are a REG_MULTI_SZ, walk it without trusting the
+	// terminators.
+	//
+
+	Id = (PCWSTR)WdfMemoryGetBuffer(HardwareIds, &Length);
+	Count = Length / sizeof(WCHAR);
+	while (Profile == NULL && Count != 0 && *Id != UNICODE_NULL) {
+		Status = RtlStringCchLengthW(Id, Count, &Length);
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+
+		RtlInitUnicodeString(&HardwareId, Id);
+		for (Index = 0; Index < ARRAYSIZE(HotdogBatteryGaugeProfiles); Index += 1) {
+			RtlInitUnicodeString(&ProfileId, HotdogBatteryGaugeProfiles[Index].HardwareId);
+			if (RtlEqualUnicodeString(&HardwareId, &ProfileId, TRUE) != FALSE) {
+				Profile = &HotdogBatteryGaugeProfiles[Index];
+				break;
+			}
+		}
+
+		Id += Length + 1;
+		Count -= Length + 1;
+	}
+
+	WdfObjectDelete(HardwareIds);
+
+GaugeFromHardwareIdEnd:
+	return Profile;
+}
+
+_Use_decl_annotations_
+PCSURFACE_BATTERY_GAUGE_PROFILE
+HotdogBatteryGaugeFromDeviceType(
+	UINT16 DeviceType
+)
+
+/*++
+
+Routine Description:
+
+	This routine looks up the DEVICE_TYPE reported by the gauge in the
+	profiles.
+
+Arguments:
+
+	DeviceType - Supplies the DEVICE_TYPE reported by the gauge.
+
+Return Value:
+
+	The matching profile, NULL if none matched.
+
+--*/
+
+{
+	ULONG Index;
+
+	PAGED_CODE();
+
+	for (Index = 0; Index < ARRAYSIZE(HotdogBatteryGaugeProfiles); Index += 1) {
+		if (HotdogBatteryGaugeProfiles[Index].DeviceType != 0 &&
+			HotdogBatteryGaugeProfiles[Index].DeviceType == DeviceType) {
+
+			return &HotdogBatteryGaugeProfiles[Index];
+		}
+	}
+
+	Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+		"No profile for DEVICE_TYPE 0x%04x\n",
+		DeviceType);
+
+	return NULL;
+}
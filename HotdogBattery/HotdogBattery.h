@@ -26,10 +26,14 @@ Abstract:
 #include <wmistr.h>
 #include <wmilib.h>
 #include <ntstrsafe.h>
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
 #include "trace.h"
 #define RESHUB_USE_HELPER_ROUTINES
 #include <reshub.h>
 #include "spb.h"
+#include "HotdogBatteryIoctl.h"
+#include "HotdogBatteryLogic.h"
 
 //--------------------------------------------------------------------- Literals
 
@@ -74,6 +78,189 @@ Abstract:
 
 //------------------------------------------------------------------ Definitions
 
+//
+// Control register and subcommands, at the same place on every supported
+// gauge, which is what makes probing the gauge type possible.
+//
+
+#define BQ27XXX_REG_CONTROL                 0x00
+#define BQ27XXX_CONTROL_STATUS              0x0000
+#define BQ27XXX_CONTROL_DEVICE_TYPE         0x0001
+#define BQ27XXX_CONTROL_FW_VERSION          0x0002
+#define BQ27XXX_CONTROL_HW_VERSION          0x0003
+
+//
+// Time the gauge needs after a Control subcommand before its result can be
+// read back.
+//
+
+#define BQ27XXX_CONTROL_DELAY_US            66
+
+//
+// BQ27541 registers. All registers are 16 bits wide and little endian. The
+// register maps of the other supported gauges are in gauge.c.
+//
+
+#define BQ27541_REG_TEMPERATURE             0x02
+#define BQ27541_REG_VOLTAGE                 0x04
+#define BQ27541_REG_FLAGS                   0x06
+#define BQ27541_REG_REMAINING_CAPACITY      0x08
+#define BQ27541_REG_FULL_CHARGE_CAPACITY    0x0A
+#define BQ27541_REG_TIME_TO_EMPTY           0x0C
+#define BQ27541_REG_AVERAGE_CURRENT         0x10
+#define BQ27541_REG_CYCLE_COUNT             0x2A
+#define BQ27541_REG_DESIGN_CAPACITY         0x3C
+
+#define BQ27541_FLAGS_DSG                   (1 << 0)
+#define BQ27541_FLAGS_SOCF                  (1 << 1)
+#define BQ27541_FLAGS_FC                    (1 << 9)
+
+#define BQ27541_DEVICE_TYPE                 0x0541
+
+//
+// Registers the driver reads, by function. A gauge profile maps each of them
+// to the register address of one gauge type.
+//
+
+#define SURFACE_BATTERY_GAUGE_TEMPERATURE           0
+#define SURFACE_BATTERY_GAUGE_VOLTAGE               1
+#define SURFACE_BATTERY_GAUGE_FLAGS                 2
+#define SURFACE_BATTERY_GAUGE_REMAINING_CAPACITY    3
+#define SURFACE_BATTERY_GAUGE_FULL_CHARGE_CAPACITY  4
+#define SURFACE_BATTERY_GAUGE_TIME_TO_EMPTY         5
+#define SURFACE_BATTERY_GAUGE_AVERAGE_CURRENT       6
+#define SURFACE_BATTERY_GAUGE_CYCLE_COUNT           7
+#define SURFACE_BATTERY_GAUGE_DESIGN_CAPACITY       8
+#define SURFACE_BATTERY_GAUGE_REGISTERS             9
+
+//
+// Tiered sampling: the Flags word is polled on a short period to catch
+// charger, discharge and critical transitions, a full status burst is only
+// read when Flags changed or every SURFACE_BATTERY_FULL_SAMPLE_PERIOD polls.
+//
+
+#define SURFACE_BATTERY_FLAGS_POLL_INTERVAL_MS  2000
+#define SURFACE_BATTERY_FULL_SAMPLE_PERIOD      150
+
+//
+// Between two bursts the remaining capacity is extrapolated by integrating
+// AverageCurrent from the last burst. The sampler reads a new burst once
+// the integrated charge reaches SURFACE_BATTERY_ESTIMATE_MAX_DRIFT per mille
+// of the full charge capacity, so the extrapolation error stays within the
+// charge that moved since the anchor. Status queries are answered from the
+// extrapolation for SURFACE_BATTERY_STATUS_DEFAULT_MAX_AGE_MS by default.
+//
+
+#define SURFACE_BATTERY_ESTIMATE_MAX_DRIFT      10
+#define SURFACE_BATTERY_STATUS_DEFAULT_MAX_AGE_MS 10000
+
+C_ASSERT(SURFACE_BATTERY_STALENESS_MAXIMUM ==
+    SURFACE_BATTERY_FULL_SAMPLE_PERIOD * SURFACE_BATTERY_FLAGS_POLL_INTERVAL_MS);
+
+#define HotdogBatteryConvertToWatts(Value) ((Value) * 3870) / 1000
+
+//
+// Energy accounting integrates Voltage * AverageCurrent of every burst over
+// the time until the next one. The sampler reads a burst at least every
+// SURFACE_BATTERY_FULL_SAMPLE_PERIOD polls, a longer interval means the
+// device was stopped or the system slept and is not integrated.
+//
+
+#define SURFACE_BATTERY_ENERGY_MAX_INTERVAL_MS \
+    (2 * SURFACE_BATTERY_FULL_SAMPLE_PERIOD * SURFACE_BATTERY_FLAGS_POLL_INTERVAL_MS)
+
+//
+// Periodic timers are started on a multiple of their period from the
+// driver-wide tick epoch, so the timers of every battery expire together,
+// and may be delayed by the tolerable delay so the kernel can coalesce the
+// expiration with other wakeups of the system.
+//
+
+#define SURFACE_BATTERY_TIMER_TOLERABLE_DELAY_MS 500
+
+//
+// Register cache. The 16-bit registers 0x00..0x3F are tracked by index
+// (address / 2), sets of registers as a bitmask of those indices.
+//
+
+#define SURFACE_BATTERY_CACHE_REGISTERS     32
+#define SURFACE_BATTERY_CACHE_BIT(Address)  (1UL << ((Address) >> 1))
+
+//
+// Level prefetch. The per-device level sequence is learned as the last
+// observed successor of each information level with a saturating
+// confidence counter. Once confident, the registers of up to
+// SURFACE_BATTERY_PREFETCH_DEPTH predicted levels are read in the same bus
+// burst as the current level and served from the register cache for
+// SURFACE_BATTERY_PREFETCH_LIFETIME_MS. Registers closer than
+// SURFACE_BATTERY_PREFETCH_MAX_GAP bytes are merged into one transfer.
+//
+
+#define SURFACE_BATTERY_LEVEL_COUNT             16
+
+//
+// Register reads that do not serve one class level, such as a telemetry
+// sample of every level, pass SURFACE_BATTERY_LEVEL_NONE. They use the
+// default staleness bound and neither consult nor train the predictor.
+//
+
+#define SURFACE_BATTERY_LEVEL_NONE              ((BATTERY_QUERY_INFORMATION_LEVEL)SURFACE_BATTERY_LEVEL_COUNT)
+
+C_ASSERT(SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION_LEVELS == SURFACE_BATTERY_LEVEL_COUNT);
+#define SURFACE_BATTERY_PREFETCH_LIFETIME_MS    SURFACE_BATTERY_STALENESS_MINIMUM
+#define SURFACE_BATTERY_PREFETCH_DEPTH          3
+#define SURFACE_BATTERY_PREFETCH_MAX_GAP        4
+#define SURFACE_BATTERY_PREFETCH_CONFIDENT      2
+#define SURFACE_BATTERY_PREFETCH_CONFIDENCE_MAX 3
+
+//
+// Gauge profile. Profiles are static tables built from the register map of
+// one gauge type, including the register set of every information level, so
+// nothing is derived from the map at run time. The profile is picked by
+// hardware id, or failing that by the DEVICE_TYPE the gauge reports.
+//
+
+typedef struct _SURFACE_BATTERY_GAUGE_PROFILE
+{
+    PCSTR Name;
+    PCWSTR HardwareId;
+    UINT16 DeviceType;
+
+    UCHAR Registers[SURFACE_BATTERY_GAUGE_REGISTERS];
+    UCHAR StatusBurstStart;
+    UCHAR StatusBurstLength;
+
+    //
+    // Flags bits mapped to battery power states. Transitions of
+    // FlagsNotifyMask are reported to the battery class as soon as the fast
+    // sampler sees them.
+    //
+
+    UINT16 FlagsFull;
+    UINT16 FlagsDischarging;
+    UINT16 FlagsCritical;
+    UINT16 FlagsNotifyMask;
+
+    ULONG LevelRegisters[SURFACE_BATTERY_LEVEL_COUNT];
+} SURFACE_BATTERY_GAUGE_PROFILE, *PSURFACE_BATTERY_GAUGE_PROFILE;
+
+typedef const SURFACE_BATTERY_GAUGE_PROFILE *PCSURFACE_BATTERY_GAUGE_PROFILE;
+
+//
+// Control subcommand results read when the gauge is identified. They stay
+// valid as long as the battery tag they were read for.
+//
+
+typedef struct _SURFACE_BATTERY_GAUGE_IDENTITY
+{
+    BOOLEAN Valid;
+    ULONG BatteryTag;
+    UINT16 ControlStatus;
+    UINT16 DeviceType;
+    UINT16 FirmwareVersion;
+    UINT16 HardwareVersion;
+} SURFACE_BATTERY_GAUGE_IDENTITY, *PSURFACE_BATTERY_GAUGE_IDENTITY;
+
 #define MFG_NAME_SIZE  0x3
 #define DEVICE_NAME_SIZE 0x8
 #define CHEM_SIZE 0x4
@@ -89,9 +276,68 @@ Abstract:
 //} BQ27742_MANUF_INFO_TYPE, * PBQ27742_MANUF_INFO_TYPE;
 #pragma pack(pop)
 
+//
+// The last-known-good snapshot, laid out in HotdogBatteryLogic.h, is
+// persisted as a binary value under the device hardware key.
+//
+
+#define SURFACE_BATTERY_SNAPSHOT_VALUE_NAME     L"LastKnownGoodSnapshot"
+
+//
+// Static information is trusted for a week. The last capacity and voltage
+// are only trusted for five minutes, about as long as a reboot takes, since
+// they are reported next to a live power state and an unknown rate. Older
+// snapshots are ignored and the first queries go to the bus. The power
+// state is never taken from the snapshot.
+//
+
+#define SURFACE_BATTERY_SNAPSHOT_INFORMATION_MAX_AGE    SECONDS(7 * 24 * 60 * 60)
+#define SURFACE_BATTERY_SNAPSHOT_STATUS_MAX_AGE         SECONDS(5 * 60)
+
+//
+// Dirty snapshots are written back at most this often outside of power
+// transitions.
+//
+
+#define SURFACE_BATTERY_SNAPSHOT_WRITE_INTERVAL         SECONDS(15 * 60)
+
+//
+// Performance counters. Hot path counters are kept per processor to avoid
+// bouncing a shared cache line between CPUs, and are only summed when the
+// counter set is collected. Slots are updated interlocked since a passive
+// level thread may migrate between picking its slot and updating it.
+//
+
+#define SURFACE_BATTERY_COUNTER_NAME_SIZE   32
+
+typedef struct DECLSPEC_CACHEALIGN _SURFACE_BATTERY_COUNTERS
+{
+    LONG64 I2cTransactions;
+    LONG64 I2cBytes;
+    LONG64 CacheHits;
+    LONG64 CacheLookups;
+    LONG64 QueryTime;
+    LONG64 Queries;
+    LONG64 LockContentions;
+} SURFACE_BATTERY_COUNTERS, *PSURFACE_BATTERY_COUNTERS;
 
 typedef struct {
     UNICODE_STRING                  RegistryPath;
+
+    //
+    // Performance counter set and the devices it reports on.
+    //
+
+    PPCW_REGISTRATION               CounterSet;
+    WDFWAITLOCK                     DeviceListLock;
+    LIST_ENTRY                      DeviceList;
+    LONG                            NextInstanceId;
+
+    //
+    // Performance counter value every periodic timer is aligned to.
+    //
+
+    LONGLONG                        TickEpoch;
 } SURFACE_BATTERY_GLOBAL_DATA, *PSURFACE_BATTERY_GLOBAL_DATA;
 
 typedef struct {
@@ -103,9 +349,14 @@ typedef struct {
     //
     // Battery class registration
     //
+    // ClassInitLock only serializes registration against unload. IOCTL and
+    // WMI dispatch use ClassHandle under ClassRundown, which is run down
+    // while the device is not registered with the battery class.
+    //
 
     PVOID                           ClassHandle;
     WDFWAITLOCK                     ClassInitLock;
+    EX_RUNDOWN_REF                  ClassRundown;
     WMILIB_CONTEXT                  WmiLibContext;
 
     //
@@ -113,18 +364,301 @@ typedef struct {
     //
     SPB_CONTEXT I2CContext;
 
+    //
+    // Profile of the gauge behind I2CContext, selected at prepare hardware,
+    // and its identity, guarded by StateLock.
+    //
+
+    PCSURFACE_BATTERY_GAUGE_PROFILE Gauge;
+    SURFACE_BATTERY_GAUGE_IDENTITY  GaugeIdentity;
+
     //
     // Battery state
     //
 
     WDFWAITLOCK                     StateLock;
     ULONG                           BatteryTag;
+
+    //
+    // Last-known-good snapshot, guarded by StateLock. The primed flags are
+    // set when a fresh snapshot was loaded at start and are cleared once the
+    // corresponding query has been answered from it.
+    //
+
+    SURFACE_BATTERY_SNAPSHOT        Snapshot;
+    BOOLEAN                         InformationPrimed;
+    BOOLEAN                         StatusPrimed;
+    BOOLEAN                         SnapshotDirty;
+    LARGE_INTEGER                   SnapshotLastWrite;
+
+    //
+    // Tiered sampler state, guarded by StateLock. LastBurst holds the most
+    // recent full status burst, read at LastBurstTime (interrupt time).
+    //
+
+    WDFTIMER                        SamplerTimer;
+    UINT16                          SampledFlags;
+    BOOLEAN                         SampledFlagsValid;
+    ULONG                           PollsSinceBurst;
+    SURFACE_BATTERY_STATUS_BURST    LastBurst;
+    ULONGLONG                       LastBurstTime;
+
+    //
+    // Power state machine, guarded by StateLock.
+    //
+
+    SURFACE_BATTERY_POWER_FILTER    PowerFilter;
+
+    //
+    // Energy accounting, guarded by StateLock. See
+    // IOCTL_SURFACE_BATTERY_QUERY_ENERGY.
+    //
+
+    SURFACE_BATTERY_ENERGY_ACCOUNT  Energy;
+
+    //
+    // Register cache and level predictor, guarded by StateLock. Cache times
+    // are interrupt times. PrefetchedMask holds registers read speculatively
+    // and not consumed yet.
+    //
+
+    UINT16                          RegisterCache[SURFACE_BATTERY_CACHE_REGISTERS];
+    ULONGLONG                       RegisterCacheTime[SURFACE_BATTERY_CACHE_REGISTERS];
+    ULONG                           PrefetchedMask;
+    UCHAR                           LevelSuccessor[SURFACE_BATTERY_LEVEL_COUNT];
+    UCHAR                           LevelConfidence[SURFACE_BATTERY_LEVEL_COUNT];
+    ULONG                           PreviousLevel;
+    ULONGLONG                       PreviousLevelTime;
+    ULONG                           PrefetchHits;
+    ULONG                           PrefetchMisses;
+
+    //
+    // Staleness bounds in milliseconds, guarded by StateLock. Zero stands
+    // for SURFACE_BATTERY_STATUS_DEFAULT_MAX_AGE_MS for the status and for
+    // SURFACE_BATTERY_STALENESS_MINIMUM for the levels.
+    //
+
+    ULONG                           StatusMaxAge;
+    ULONG                           LevelMaxAge[SURFACE_BATTERY_LEVEL_COUNT];
+
+    //
+    // Telemetry section shared with user mode readers, guarded by StateLock.
+    // SharedTelemetry is the system view, SharedSequence the last sequence
+    // published. The driver never reads the section back.
+    //
+
+    HANDLE                          SharedSection;
+    PVOID                           SharedSectionObject;
+    PSURFACE_BATTERY_SHARED_TELEMETRY SharedTelemetry;
+    LONG                            SharedSequence;
+
+    //
+    // Manual queue of pending IOCTL_SURFACE_BATTERY_WAIT_FOR_CHANGE requests.
+    // ChangeSample is the last sample fanned out to the queue, guarded by
+    // StateLock. ChangeSampleValid is cleared when a request is parked
+    // against a different sample.
+    //
+
+    WDFQUEUE                        ChangeQueue;
+    SURFACE_BATTERY_CHANGE_SAMPLE   ChangeSample;
+    BOOLEAN                         ChangeSampleValid;
+
+    //
+    // Performance counter instance, linked into the global device list.
+    // Counters is NULL when the per processor slots could not be allocated.
+    //
+
+    LIST_ENTRY                      CounterLink;
+    PSURFACE_BATTERY_COUNTERS       Counters;
+    ULONG                           CounterSlots;
+    ULONG                           CounterInstanceId;
+    WCHAR                           CounterInstanceName[SURFACE_BATTERY_COUNTER_NAME_SIZE];
+
+    //
+    // Battery class callback statistics. ActiveCall is the entry of the
+    // callback holding StateLock, SPB transfers are charged to it.
+    //
+
+    SURFACE_BATTERY_CALLBACK_STAT   CallStats[SURFACE_BATTERY_CALLBACK_COUNT];
+    PSURFACE_BATTERY_CALLBACK_STAT  ActiveCall;
 } SURFACE_BATTERY_FDO_DATA, *PSURFACE_BATTERY_FDO_DATA;
 
+//
+// Per handle state, guarded by StateLock of the device. TelemetryView is
+// the view of the telemetry section mapped into TelemetryProcess for this
+// handle, which holds a reference on the process until the handle goes.
+//
+
+typedef struct {
+    PVOID                           TelemetryView;
+    SIZE_T                          TelemetryViewSize;
+    PEPROCESS                       TelemetryProcess;
+} SURFACE_BATTERY_FILE_DATA, *PSURFACE_BATTERY_FILE_DATA;
+
+//
+// TraceLogging activities. Battery class callbacks and SPB transfers are each
+// wrapped in a start/stop event pair, the stop event carries the elapsed
+// performance counter ticks. A callback's activity is made the current
+// activity of the thread, so the SPB transfers it issues are logged as its
+// children.
+//
+
+TRACELOGGING_DECLARE_PROVIDER(HotdogBatteryTraceProvider);
+
+#define SURFACE_BATTERY_KEYWORD_CLASS       0x00000001
+#define SURFACE_BATTERY_KEYWORD_SPB         0x00000002
+
+typedef struct _SURFACE_BATTERY_ACTIVITY
+{
+    GUID Id;
+    GUID ParentId;
+    LONGLONG Start;
+    BOOLEAN Enabled;
+} SURFACE_BATTERY_ACTIVITY, *PSURFACE_BATTERY_ACTIVITY;
+
 //------------------------------------------------------ WDF Context Declaration
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(SURFACE_BATTERY_GLOBAL_DATA, GetGlobalData);
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(SURFACE_BATTERY_FDO_DATA, GetDeviceExtension);
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(SURFACE_BATTERY_FILE_DATA, GetFileData);
+
+//------------------------------------------------------------ Inline Functions
+
+#define HotdogBatteryCount(DevExt, Counter, Value)                          \
+    do {                                                                    \
+        if ((DevExt)->Counters != NULL) {                                   \
+            InterlockedAdd64(&(DevExt)->Counters[                           \
+                KeGetCurrentProcessorIndex() % (DevExt)->CounterSlots].Counter, \
+                (Value));                                                   \
+        }                                                                   \
+    } while (0)
+
+FORCEINLINE
+VOID
+HotdogBatteryAcquireStateLock(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt
+)
+{
+    LONGLONG Timeout;
+
+    //
+    // Try first without waiting, so contended acquisitions can be counted.
+    //
+
+    Timeout = 0;
+    if (WdfWaitLockAcquire(DevExt->StateLock, &Timeout) == STATUS_TIMEOUT) {
+        HotdogBatteryCount(DevExt, LockContentions, 1);
+        WdfWaitLockAcquire(DevExt->StateLock, NULL);
+    }
+}
+
+FORCEINLINE
+VOID
+HotdogBatteryActivityBegin(
+    _Out_ PSURFACE_BATTERY_ACTIVITY Activity,
+    _In_ UCHAR Level,
+    _In_ ULONGLONG Keyword
+)
+{
+    Activity->Enabled = TraceLoggingProviderEnabled(HotdogBatteryTraceProvider,
+                                                    Level,
+                                                    Keyword);
+
+    if (Activity->Enabled == FALSE) {
+        return;
+    }
+
+    EtwActivityIdControl(EVENT_ACTIVITY_CTRL_CREATE_ID, &Activity->Id);
+    Activity->ParentId = Activity->Id;
+    EtwActivityIdControl(EVENT_ACTIVITY_CTRL_GET_SET_ID, &Activity->ParentId);
+    Activity->Start = KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+FORCEINLINE
+VOID
+HotdogBatteryActivityEnd(
+    _In_ PSURFACE_BATTERY_ACTIVITY Activity
+)
+{
+    if (Activity->Enabled != FALSE) {
+        EtwActivityIdControl(EVENT_ACTIVITY_CTRL_SET_ID, &Activity->ParentId);
+    }
+}
+
+#define HotdogBatteryActivityStart(Activity, EventName, Level, Keyword, ...) \
+    do {                                                                    \
+        HotdogBatteryActivityBegin((Activity), (Level), (Keyword));         \
+        if ((Activity)->Enabled != FALSE) {                                 \
+            TraceLoggingWriteActivity(HotdogBatteryTraceProvider,           \
+                EventName,                                                  \
+                &(Activity)->Id,                                            \
+                &(Activity)->ParentId,                                      \
+                TraceLoggingOpcode(WINEVENT_OPCODE_START),                  \
+                TraceLoggingLevel(Level),                                   \
+                TraceLoggingKeyword(Keyword),                               \
+                __VA_ARGS__);                                               \
+        }                                                                   \
+    } while (0)
+
+#define HotdogBatteryActivityStop(Activity, EventName, Level, Keyword, ...) \
+    do {                                                                    \
+        if ((Activity)->Enabled != FALSE) {                                 \
+            TraceLoggingWriteActivity(HotdogBatteryTraceProvider,           \
+                EventName,                                                  \
+                &(Activity)->Id,                                            \
+                NULL,                                                       \
+                TraceLoggingOpcode(WINEVENT_OPCODE_STOP),                   \
+                TraceLoggingLevel(Level),                                   \
+                TraceLoggingKeyword(Keyword),                               \
+                TraceLoggingInt64(KeQueryPerformanceCounter(NULL).QuadPart - \
+                    (Activity)->Start, "ElapsedTicks"),                     \
+                __VA_ARGS__);                                               \
+        }                                                                   \
+                                                                            \
+        HotdogBatteryActivityEnd(Activity);                                 \
+    } while (0)
+
+FORCEINLINE
+VOID
+HotdogBatteryCallBegin(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ ULONG Callback
+)
+{
+    //
+    // The caller holds StateLock, which it just acquired.
+    //
+
+    if (Callback >= SURFACE_BATTERY_CALLBACK_COUNT) {
+        DevExt->ActiveCall = NULL;
+        return;
+    }
+
+    DevExt->ActiveCall = &DevExt->CallStats[Callback];
+    DevExt->ActiveCall->LockAcquisitions += 1;
+}
+
+FORCEINLINE
+VOID
+HotdogBatteryCallEnd(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ LONGLONG Start
+)
+{
+    if (DevExt->ActiveCall != NULL) {
+        DevExt->ActiveCall->Calls += 1;
+        DevExt->ActiveCall->Time += KeQueryPerformanceCounter(NULL).QuadPart - Start;
+        DevExt->ActiveCall = NULL;
+    }
+}
+
+#define HotdogBatteryClassActivityStart(Activity, EventName, ...)           \
+    HotdogBatteryActivityStart((Activity), EventName, WINEVENT_LEVEL_INFO,  \
+        SURFACE_BATTERY_KEYWORD_CLASS, __VA_ARGS__)
+
+#define HotdogBatteryClassActivityStop(Activity, EventName, ...)            \
+    HotdogBatteryActivityStop((Activity), EventName, WINEVENT_LEVEL_INFO,   \
+        SURFACE_BATTERY_KEYWORD_CLASS, __VA_ARGS__)
 
 //----------------------------------------------------- Prototypes (miniclass.c)
 
@@ -139,4 +673,291 @@ BCLASS_QUERY_INFORMATION_CALLBACK HotdogBatteryQueryInformation;
 BCLASS_SET_INFORMATION_CALLBACK HotdogBatterySetInformation;
 BCLASS_QUERY_STATUS_CALLBACK HotdogBatteryQueryStatus;
 BCLASS_SET_STATUS_NOTIFY_CALLBACK HotdogBatterySetStatusNotify;
-BCLASS_DISABLE_STATUS_NOTIFY_CALLBACK HotdogBatteryDisableStatusNotify;
\ No newline at end of file
+BCLASS_DISABLE_STATUS_NOTIFY_CALLBACK HotdogBatteryDisableStatusNotify;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryQueryLevel(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ BATTERY_QUERY_INFORMATION_LEVEL Level,
+    _In_ LONG AtRate,
+    _Out_writes_bytes_to_(BufferLength, *ReturnedLength) PVOID Buffer,
+    _In_ ULONG BufferLength,
+    _Out_ PULONG ReturnedLength
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryRefreshStatus(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Out_ PBATTERY_STATUS BatteryStatus
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryGetStatus(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Out_ PBATTERY_STATUS BatteryStatus,
+    _Out_ PBOOLEAN Sampled
+);
+
+//------------------------------------------------------- Prototypes (sampler.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatterySamplerCreate(
+    _In_ WDFDEVICE Device
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatterySamplerStart(
+    _In_ WDFDEVICE Device
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatterySamplerStop(
+    _In_ WDFDEVICE Device
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+HotdogBatteryEstimateExpired(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ ULONGLONG Now
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+HotdogBatteryEstimateStatus(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ ULONGLONG Now,
+    _Out_ PBATTERY_STATUS BatteryStatus
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+HotdogBatteryEstimateTimeToEmpty(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ ULONGLONG Now,
+    _In_ UINT16 TimeToEmpty
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+HotdogBatteryIntegrateEnergy(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ ULONGLONG Now,
+    _Inout_ PSURFACE_BATTERY_ENERGY_ACCOUNT Account
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+HotdogBatteryQueryEnergy(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Out_ PSURFACE_BATTERY_ENERGY Energy
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryNotifyClass(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+//---------------------------------------------------- Prototypes (powerstate.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryPowerStateConfigure(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+HotdogBatteryFilterPowerState(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ ULONG RawPowerState,
+    _In_ PSURFACE_BATTERY_STATUS_BURST Burst,
+    _In_ ULONGLONG Now
+);
+
+//------------------------------------------------------ Prototypes (prefetch.c)
+
+#define HotdogBatteryCachedRegister(DevExt, Register) \
+    ((DevExt)->RegisterCache[HotdogBatteryGaugeRegister((DevExt), (Register)) >> 1])
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCacheFill(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ UCHAR Address,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryObserveLevel(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ BATTERY_QUERY_INFORMATION_LEVEL Level
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryReadRegisters(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ BATTERY_QUERY_INFORMATION_LEVEL Level,
+    _In_ ULONG RegisterMask
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+ULONGLONG
+HotdogBatteryStalenessBound(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ ULONG MaxAge
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryQueryStaleness(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Out_ PSURFACE_BATTERY_STALENESS Staleness
+);
+
+//--------------------------------------------------------- Prototypes (gauge.c)
+
+#define HotdogBatteryGaugeRegister(DevExt, Register) \
+    ((DevExt)->Gauge->Registers[(Register)])
+
+#define HotdogBatteryLevelRegisters(DevExt, Level) \
+    ((DevExt)->Gauge->LevelRegisters[(Level)])
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatterySelectGauge(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryIdentifyGauge(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+//----------------------------------------------------- Prototypes (telemetry.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryTelemetryIoctl(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Inout_ PIRP Irp
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatterySharedTelemetryCreate(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatterySharedTelemetryDestroy(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryPublishTelemetry(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryMapTelemetryIoctl(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Inout_ PIRP Irp
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryBusCaptureIoctl(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Inout_ PIRP Irp
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryCallbackStatsIoctl(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Inout_ PIRP Irp
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryStalenessIoctl(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Inout_ PIRP Irp
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryEnergyIoctl(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _Inout_ PIRP Irp
+);
+
+//-------------------------------------------------- Prototypes (subscription.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatterySubscriptionCreate(
+    _In_ WDFDEVICE Device
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCompleteSubscriptions(
+    _In_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+//------------------------------------------------------ Prototypes (counters.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCountersRegister(
+    _Inout_ PSURFACE_BATTERY_GLOBAL_DATA GlobalData
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCountersUnregister(
+    _Inout_ PSURFACE_BATTERY_GLOBAL_DATA GlobalData
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCountersAttach(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCountersDetach(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+//------------------------------------------------------ Prototypes (snapshot.c)
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryLoadSnapshot(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatterySaveSnapshot(
+    _Inout_ PSURFACE_BATTERY_FDO_DATA DevExt,
+    _In_ BOOLEAN Force
+);
\ No newline at end of file
@@ -0,0 +1,465 @@
+/*++
+
+Module Name:
+
+    HotdogBatteryIoctl.h
+
+Abstract:
+
+    This header defines the driver-private IOCTLs of the Hotdog battery driver.
+    It is shared with user mode consumers, which are expected to include
+    <batclass.h> (or <poclass.h>) first.
+
+    N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma once
+
+//------------------------------------------------------------------ Definitions
+
+//
+// Private function codes start at 0x900 to stay clear of the battery class
+// IOCTLs, which are forwarded to BatteryClassIoctl unchanged.
+//
+
+#define IOCTL_SURFACE_BATTERY_QUERY_TELEMETRY \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x900, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// IOCTL_SURFACE_BATTERY_QUERY_TELEMETRY
+//
+// Input:  none
+// Output: SURFACE_BATTERY_TELEMETRY
+//
+// Returns the battery status and every information level from one coherent
+// sample: the status burst and the remaining registers are read back to
+// back under the driver state lock. Fields are only ever appended, Version
+// and Size tell the caller which of them are present.
+//
+
+#define SURFACE_BATTERY_TELEMETRY_VERSION   1
+
+typedef struct _SURFACE_BATTERY_TELEMETRY
+{
+    ULONG Version;
+    ULONG Size;
+    ULONG BatteryTag;
+    ULONG Reserved;
+
+    //
+    // System time at which the sample was taken.
+    //
+
+    LONGLONG Timestamp;
+
+    BATTERY_STATUS Status;
+    BATTERY_INFORMATION Information;
+    BATTERY_REPORTING_SCALE Granularity;
+    BATTERY_MANUFACTURE_DATE ManufactureDate;
+    ULONG Temperature;
+    ULONG EstimatedTime;
+
+    WCHAR DeviceName[MAX_BATTERY_STRING_SIZE];
+    WCHAR ManufactureName[MAX_BATTERY_STRING_SIZE];
+    WCHAR SerialNumber[MAX_BATTERY_STRING_SIZE];
+    WCHAR UniqueID[MAX_BATTERY_STRING_SIZE];
+} SURFACE_BATTERY_TELEMETRY, *PSURFACE_BATTERY_TELEMETRY;
+
+//
+// IOCTL_SURFACE_BATTERY_MAP_TELEMETRY
+//
+// Input:  none
+// Output: SURFACE_BATTERY_TELEMETRY_MAPPING
+//
+// Maps a read-only view of the driver's telemetry section into the calling
+// process. The driver republishes the section on every status sample, so
+// readers can poll it without any further IOCTL. The view stays valid
+// after the device goes away, BatteryTag then reads BATTERY_TAG_INVALID.
+// The view cannot be made writable. Every handle gets one view, repeated
+// calls on the same handle return the same view, so the caller releases it
+// with UnmapViewOfFile only once it is done with the handle as well.
+//
+// Only user mode callers are served, and the IOCTL must reach the driver in
+// the context of the calling process.
+//
+
+#define IOCTL_SURFACE_BATTERY_MAP_TELEMETRY \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x901, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+typedef struct _SURFACE_BATTERY_TELEMETRY_MAPPING
+{
+    ULONGLONG Address;
+    ULONG Size;
+    ULONG Version;
+} SURFACE_BATTERY_TELEMETRY_MAPPING, *PSURFACE_BATTERY_TELEMETRY_MAPPING;
+
+#define SURFACE_BATTERY_SHARED_TELEMETRY_VERSION    1
+
+//
+// Contents of the telemetry section. Sequence is odd while the driver is
+// updating the section and is bumped to the next even value once the update
+// is complete. Use SurfaceBatteryReadSharedTelemetry to take a consistent
+// copy instead of reading the fields directly.
+//
+
+typedef struct _SURFACE_BATTERY_SHARED_TELEMETRY
+{
+    volatile LONG Sequence;
+    ULONG Version;
+    ULONG Size;
+    ULONG BatteryTag;
+
+    //
+    // System times at which the status and the static information were
+    // last read from the gauge.
+    //
+
+    LONGLONG StatusTimestamp;
+    LONGLONG InformationTimestamp;
+
+    BATTERY_STATUS Status;
+    ULONG DesignedCapacity;
+    ULONG FullChargedCapacity;
+    ULONG CycleCount;
+    ULONG Temperature;
+    ULONG GaugeFlags;
+} SURFACE_BATTERY_SHARED_TELEMETRY, *PSURFACE_BATTERY_SHARED_TELEMETRY;
+
+#define SURFACE_BATTERY_SHARED_READ_ATTEMPTS    64
+
+FORCEINLINE
+BOOLEAN
+SurfaceBatteryReadSharedTelemetry(
+    _In_ const volatile SURFACE_BATTERY_SHARED_TELEMETRY *Shared,
+    _Out_ PSURFACE_BATTERY_SHARED_TELEMETRY Copy
+)
+
+/*++
+
+Routine Description:
+
+    This routine takes a consistent copy of the telemetry section. It retries
+    while the driver is updating the section, and gives up after
+    SURFACE_BATTERY_SHARED_READ_ATTEMPTS torn reads.
+
+Arguments:
+
+    Shared - Supplies the address returned by
+        IOCTL_SURFACE_BATTERY_MAP_TELEMETRY.
+
+    Copy - Supplies a pointer to the structure to copy the section to.
+
+Return Value:
+
+    TRUE if Copy holds a consistent sample, FALSE otherwise.
+
+--*/
+
+{
+    ULONG Attempt;
+    LONG Sequence;
+
+    for (Attempt = 0; Attempt < SURFACE_BATTERY_SHARED_READ_ATTEMPTS; Attempt += 1) {
+        Sequence = ReadAcquire(&Shared->Sequence);
+        if ((Sequence & 1) != 0) {
+            YieldProcessor();
+            continue;
+        }
+
+        RtlCopyMemory(Copy, (const VOID *)Shared, sizeof(*Copy));
+        MemoryBarrier();
+        if (ReadNoFence(&Shared->Sequence) == Sequence) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//
+// IOCTL_SURFACE_BATTERY_WAIT_FOR_CHANGE
+//
+// Input:  SURFACE_BATTERY_CHANGE_FILTER
+// Output: SURFACE_BATTERY_CHANGE
+//
+// Pends until one of the selected fields of the latest sample moved away
+// from the caller's baseline by at least the requested delta, then returns
+// the sample and the fields that changed. A change of battery tag always
+// completes the request. Callers pass the returned sample as the baseline
+// of their next request, so no change is lost between two requests.
+//
+// Deltas are only evaluated when a status burst is read: when the gauge
+// Flags change, when the extrapolated charge drifts by 1%, at least every
+// 300 s, and whenever a status or telemetry query has to refresh. A field
+// may therefore move past its delta up to 300 s before the request
+// completes.
+//
+
+#define IOCTL_SURFACE_BATTERY_WAIT_FOR_CHANGE \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x902, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define SURFACE_BATTERY_CHANGE_FILTER_VERSION   1
+
+#define SURFACE_BATTERY_CHANGE_POWER_STATE      0x00000001
+#define SURFACE_BATTERY_CHANGE_CAPACITY         0x00000002
+#define SURFACE_BATTERY_CHANGE_VOLTAGE          0x00000004
+#define SURFACE_BATTERY_CHANGE_RATE             0x00000008
+#define SURFACE_BATTERY_CHANGE_TEMPERATURE      0x00000010
+#define SURFACE_BATTERY_CHANGE_TAG              0x80000000
+
+typedef struct _SURFACE_BATTERY_CHANGE_SAMPLE
+{
+    ULONG BatteryTag;
+    ULONG PowerState;
+    ULONG Capacity;
+    ULONG Voltage;
+    LONG Rate;
+    ULONG Temperature;
+} SURFACE_BATTERY_CHANGE_SAMPLE, *PSURFACE_BATTERY_CHANGE_SAMPLE;
+
+//
+// A zero delta stands for any change of the field.
+//
+
+typedef struct _SURFACE_BATTERY_CHANGE_FILTER
+{
+    ULONG Version;
+    ULONG Fields;
+    ULONG CapacityDelta;
+    ULONG VoltageDelta;
+    ULONG RateDelta;
+    ULONG TemperatureDelta;
+    SURFACE_BATTERY_CHANGE_SAMPLE Baseline;
+} SURFACE_BATTERY_CHANGE_FILTER, *PSURFACE_BATTERY_CHANGE_FILTER;
+
+typedef struct _SURFACE_BATTERY_CHANGE
+{
+    ULONG ChangedFields;
+    SURFACE_BATTERY_CHANGE_SAMPLE Sample;
+} SURFACE_BATTERY_CHANGE, *PSURFACE_BATTERY_CHANGE;
+
+//
+// IOCTL_SURFACE_BATTERY_CONTROL_BUS_CAPTURE
+//
+// Input:  SURFACE_BATTERY_BUS_CAPTURE_CONTROL
+// Output: none
+//
+// Starts or stops recording every gauge transfer into an in-driver ring of
+// SURFACE_BATTERY_BUS_CAPTURE_RECORDS records. Starting an active capture
+// discards the records not read yet. Recording costs one record copy per
+// transfer and is off by default.
+//
+
+#define IOCTL_SURFACE_BATTERY_CONTROL_BUS_CAPTURE \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x903, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define SURFACE_BATTERY_BUS_CAPTURE_VERSION     1
+
+typedef struct _SURFACE_BATTERY_BUS_CAPTURE_CONTROL
+{
+    ULONG Version;
+    BOOLEAN Enable;
+} SURFACE_BATTERY_BUS_CAPTURE_CONTROL, *PSURFACE_BATTERY_BUS_CAPTURE_CONTROL;
+
+//
+// IOCTL_SURFACE_BATTERY_READ_BUS_CAPTURE
+//
+// Input:  none
+// Output: SURFACE_BATTERY_BUS_CAPTURE followed by records
+//
+// Moves the oldest recorded transfers out of the ring, as many as fit in
+// the output buffer. Dropped counts the records overwritten before they
+// could be read since the previous call. Appending the returned records to
+// a file as they are gives a trace that can be replayed against the gauge
+// register map offline.
+//
+
+#define IOCTL_SURFACE_BATTERY_READ_BUS_CAPTURE \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x904, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define SURFACE_BATTERY_BUS_CAPTURE_RECORDS     512
+#define SURFACE_BATTERY_BUS_RECORD_DATA_SIZE    64
+
+#define SURFACE_BATTERY_BUS_READ                0
+#define SURFACE_BATTERY_BUS_WRITE               1
+
+//
+// Timestamp and Duration are in performance counter ticks, see Frequency.
+// Length is the length of the transfer, Data holds its first
+// SURFACE_BATTERY_BUS_RECORD_DATA_SIZE bytes. Nothing is recorded in Data
+// for failed reads.
+//
+
+typedef struct _SURFACE_BATTERY_BUS_RECORD
+{
+    LONGLONG Timestamp;
+    ULONG Duration;
+    LONG Status;
+    UCHAR Address;
+    UCHAR Direction;
+    USHORT Length;
+    UCHAR Data[SURFACE_BATTERY_BUS_RECORD_DATA_SIZE];
+} SURFACE_BATTERY_BUS_RECORD, *PSURFACE_BATTERY_BUS_RECORD;
+
+typedef struct _SURFACE_BATTERY_BUS_CAPTURE
+{
+    ULONG Version;
+    ULONG RecordCount;
+    ULONG Dropped;
+    ULONG Reserved;
+    LONGLONG Frequency;
+    SURFACE_BATTERY_BUS_RECORD Records[ANYSIZE_ARRAY];
+} SURFACE_BATTERY_BUS_CAPTURE, *PSURFACE_BATTERY_BUS_CAPTURE;
+
+//
+// IOCTL_SURFACE_BATTERY_QUERY_CALLBACK_STATS
+//
+// Input:  none
+// Output: SURFACE_BATTERY_CALLBACK_STATS
+//
+// IOCTL_SURFACE_BATTERY_RESET_CALLBACK_STATS
+//
+// Input:  none
+// Output: SURFACE_BATTERY_CALLBACK_STATS
+//
+// Returns cost statistics of the battery class callbacks, one entry per
+// callback and one per information level of the query information
+// callback. Bus time, transfers and allocations are those of the SPB
+// transfers issued on behalf of the callback, so a benchmark driving the
+// battery class IOCTLs can tell what each callback costs on the bus.
+// The reset IOCTL also clears the statistics after they have been copied
+// out. Other tools depend on them, so it needs write access.
+//
+
+#define IOCTL_SURFACE_BATTERY_QUERY_CALLBACK_STATS \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x905, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_SURFACE_BATTERY_RESET_CALLBACK_STATS \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x909, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define SURFACE_BATTERY_CALLBACK_STATS_VERSION  1
+
+#define SURFACE_BATTERY_CALLBACK_QUERY_TAG                  0
+#define SURFACE_BATTERY_CALLBACK_QUERY_STATUS               1
+#define SURFACE_BATTERY_CALLBACK_SET_STATUS_NOTIFY          2
+#define SURFACE_BATTERY_CALLBACK_SET_INFORMATION            3
+#define SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION          4
+#define SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION_LEVELS   16
+#define SURFACE_BATTERY_CALLBACK_COUNT \
+    (SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION + \
+     SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION_LEVELS)
+
+//
+// Time and BusTime are in performance counter ticks, see Frequency. Time
+// includes waiting for the driver state lock, LockAcquisitions counts the
+// state lock and the SPB lock.
+//
+
+typedef struct _SURFACE_BATTERY_CALLBACK_STAT
+{
+    ULONGLONG Calls;
+    ULONGLONG Time;
+    ULONGLONG BusTime;
+    ULONGLONG Transfers;
+    ULONGLONG BusBytes;
+    ULONGLONG LockAcquisitions;
+    ULONGLONG Allocations;
+} SURFACE_BATTERY_CALLBACK_STAT, *PSURFACE_BATTERY_CALLBACK_STAT;
+
+typedef struct _SURFACE_BATTERY_CALLBACK_STATS
+{
+    ULONG Version;
+    ULONG Count;
+    LONGLONG Frequency;
+    SURFACE_BATTERY_CALLBACK_STAT Callbacks[SURFACE_BATTERY_CALLBACK_COUNT];
+} SURFACE_BATTERY_CALLBACK_STATS, *PSURFACE_BATTERY_CALLBACK_STATS;
+
+//
+// IOCTL_SURFACE_BATTERY_QUERY_STALENESS
+//
+// Input:  none
+// Output: SURFACE_BATTERY_STALENESS
+//
+// IOCTL_SURFACE_BATTERY_SET_STALENESS
+//
+// Input:  SURFACE_BATTERY_STALENESS
+// Output: none
+//
+// Battery class queries are answered from the last sample as long as it is
+// younger than the staleness bound of the status or of the information
+// level, and only go to the bus once the bound is exceeded. While the
+// controller is awake anyway, samples older than
+// SURFACE_BATTERY_STALENESS_MINIMUM are refreshed regardless of the bound.
+// Bounds are in milliseconds, bounds below the minimum are raised to it and
+// a bound above SURFACE_BATTERY_STALENESS_MAXIMUM, the slowest cadence of
+// the driver's own sampler, fails the set IOCTL with
+// STATUS_INVALID_PARAMETER without changing any bound.
+// A status bound of 0 selects the driver default. Between two samples the
+// remaining capacity and estimated time are extrapolated from the average
+// current of the last sample.
+//
+// The query also returns the age of the status sample and of the oldest
+// register of every level, SURFACE_BATTERY_STALENESS_NEVER when there is
+// no sample. The age fields are ignored by the set IOCTL. Bounds are reset
+// when the device is started.
+//
+
+#define IOCTL_SURFACE_BATTERY_QUERY_STALENESS \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x906, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_SURFACE_BATTERY_SET_STALENESS \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x907, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+#define SURFACE_BATTERY_STALENESS_VERSION       1
+#define SURFACE_BATTERY_STALENESS_MINIMUM       1000
+#define SURFACE_BATTERY_STALENESS_MAXIMUM       300000
+#define SURFACE_BATTERY_STALENESS_NEVER         MAXULONG
+
+typedef struct _SURFACE_BATTERY_STALENESS
+{
+    ULONG Version;
+    ULONG StatusMaxAge;
+    ULONG LevelMaxAge[SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION_LEVELS];
+    ULONG StatusAge;
+    ULONG LevelAge[SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION_LEVELS];
+} SURFACE_BATTERY_STALENESS, *PSURFACE_BATTERY_STALENESS;
+
+//
+// IOCTL_SURFACE_BATTERY_QUERY_ENERGY
+//
+// Input:  none
+// Output: SURFACE_BATTERY_ENERGY
+//
+// Returns the energy that flowed into and out of the battery since the
+// device was added, integrated by the driver from the voltage and average
+// current of every status sample, and the time spent on AC and on battery
+// according to the reported power state, charging counting as AC. The
+// interval since the last sample is included, extrapolated from that
+// sample.
+//
+// Energies are in mWh rounded to the nearest, times in 100ns units.
+// Intervals between two samples longer than the sampler can explain, as
+// when the device was powered down or the system slept, are not integrated
+// and are counted in GapTime instead. Samples counts the integrated intervals. The counters are not
+// reset when the device is restarted, consumers compute deltas.
+//
+
+#define IOCTL_SURFACE_BATTERY_QUERY_ENERGY \
+    CTL_CODE(FILE_DEVICE_BATTERY, 0x908, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define SURFACE_BATTERY_ENERGY_VERSION  1
+
+typedef struct _SURFACE_BATTERY_ENERGY
+{
+    ULONG Version;
+    ULONG Reserved;
+    ULONGLONG ChargedEnergy;
+    ULONGLONG DischargedEnergy;
+    ULONGLONG AcTime;
+    ULONGLONG BatteryTime;
+    ULONGLONG GapTime;
+    ULONGLONG Samples;
+} SURFACE_BATTERY_ENERGY, *PSURFACE_BATTERY_ENERGY;
@@ -0,0 +1,684 @@
+/*++
+
+Module Name:
+
+    HotdogBatteryLogic.h
+
+Abstract:
+
+    This header holds the parts of the Hotdog battery driver that do not
+    touch the kernel: the power state machine, charge and energy
+    integration, the change subscription filter, the writer side of the
+    telemetry section and the layout of the last-known-good snapshot. The driver wraps them with its locking and tracing,
+    HotdogBatteryTest runs them in user mode. Includers provide the battery
+    class types through <batclass.h> first.
+
+    N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma once
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBatteryIoctl.h"
+
+//------------------------------------------------------------------ Definitions
+
+//
+// Interrupt time units per hour, for integrating mA into mAh and uW into
+// uWh.
+//
+
+#define SURFACE_BATTERY_HOUR ((LONGLONG)3600 * 10000000)
+
+//
+// Everything needed for BATTERY_STATUS lives in one contiguous register
+// window of each gauge, which is read in a single burst of at most
+// SURFACE_BATTERY_STATUS_BURST_MAX bytes and decoded into this structure.
+//
+
+#define SURFACE_BATTERY_STATUS_BURST_MAX    32
+
+typedef struct _SURFACE_BATTERY_STATUS_BURST
+{
+    UINT16 Temperature;
+    UINT16 Voltage;
+    UINT16 Flags;
+    UINT16 RemainingCapacity;
+    UINT16 FullChargeCapacity;
+    UINT16 TimeToEmpty;
+    INT16 AverageCurrent;
+} SURFACE_BATTERY_STATUS_BURST, *PSURFACE_BATTERY_STATUS_BURST;
+
+//
+// Power state hysteresis defaults, see powerstate.c. Each can be overridden
+// from the device hardware key.
+//
+
+#define SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS         5000
+#define SURFACE_BATTERY_POWER_STATE_CURRENT_HYSTERESIS  50
+#define SURFACE_BATTERY_POWER_STATE_SOC_HYSTERESIS      2
+
+//
+// Power state machine. PowerState is the state reported to the battery
+// class, PendingPowerState a differing raw state seen continuously since
+// PendingPowerStateTime (interrupt time), 0 if none. The debounce is in ms,
+// the current hysteresis in mA and the state of charge hysteresis in
+// percent.
+//
+
+typedef struct _SURFACE_BATTERY_POWER_FILTER
+{
+    ULONG PowerState;
+    ULONG PendingPowerState;
+    ULONGLONG PendingPowerStateTime;
+    ULONG Debounce;
+    ULONG CurrentHysteresis;
+    ULONG SocHysteresis;
+    ULONG Transitions;
+} SURFACE_BATTERY_POWER_FILTER, *PSURFACE_BATTERY_POWER_FILTER;
+
+//
+// Energy account. Energies are in nWh so the truncation of every sample
+// interval does not add up, times are in 100ns units.
+//
+
+typedef struct _SURFACE_BATTERY_ENERGY_ACCOUNT
+{
+    ULONGLONG Charged;
+    ULONGLONG Discharged;
+    ULONGLONG AcTime;
+    ULONGLONG BatteryTime;
+    ULONGLONG GapTime;
+    ULONGLONG Samples;
+} SURFACE_BATTERY_ENERGY_ACCOUNT, *PSURFACE_BATTERY_ENERGY_ACCOUNT;
+
+//
+// Last-known-good snapshot persisted by the driver so the first battery
+// class queries after boot can be answered without waiting for the bus.
+// Capacities are stored already converted to mWh/mW.
+//
+
+#define SURFACE_BATTERY_SNAPSHOT_VERSION        1
+
+#pragma pack(push, 1)
+typedef struct _SURFACE_BATTERY_SNAPSHOT
+{
+    USHORT Version;
+    USHORT Size;
+    ULONG BatteryTag;
+
+    //
+    // System time at which the static information and status were last
+    // read from the gauge, zero if never.
+    //
+
+    ULONGLONG InformationTimestamp;
+    ULONGLONG StatusTimestamp;
+
+    ULONG DesignedCapacity;
+    ULONG FullChargedCapacity;
+    ULONG CycleCount;
+
+    ULONG PowerState;
+    ULONG Capacity;
+    ULONG Voltage;
+    LONG Rate;
+} SURFACE_BATTERY_SNAPSHOT, *PSURFACE_BATTERY_SNAPSHOT;
+#pragma pack(pop)
+
+//-------------------------------------------------------------------- Functions
+
+FORCEINLINE
+VOID
+HotdogBatteryPowerFilterReset(
+    _Out_ PSURFACE_BATTERY_POWER_FILTER Filter
+)
+
+/*++
+
+Routine Description:
+
+    This routine resets the power state machine to the default hysteresis.
+    The first raw state fed to it is reported as is.
+
+Arguments:
+
+    Filter - Supplies the power state machine.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    Filter->PowerState = 0;
+    Filter->PendingPowerState = 0;
+    Filter->PendingPowerStateTime = 0;
+    Filter->Debounce = SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS;
+    Filter->CurrentHysteresis = SURFACE_BATTERY_POWER_STATE_CURRENT_HYSTERESIS;
+    Filter->SocHysteresis = SURFACE_BATTERY_POWER_STATE_SOC_HYSTERESIS;
+    Filter->Transitions = 0;
+}
+
+FORCEINLINE
+VOID
+HotdogBatteryPowerFilterCommit(
+    _Inout_ PSURFACE_BATTERY_POWER_FILTER Filter,
+    _In_ ULONG PowerState
+)
+
+/*++
+
+Routine Description:
+
+    This routine makes PowerState the reported power state.
+
+Arguments:
+
+    Filter - Supplies the power state machine.
+
+    PowerState - Supplies the new power state.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    if (Filter->PowerState != 0 && Filter->PowerState != PowerState) {
+        Filter->Transitions += 1;
+    }
+
+    Filter->PowerState = PowerState;
+    Filter->PendingPowerState = 0;
+    Filter->PendingPowerStateTime = 0;
+}
+
+FORCEINLINE
+ULONG
+HotdogBatteryPowerFilterUpdate(
+    _Inout_ PSURFACE_BATTERY_POWER_FILTER Filter,
+    _In_ ULONG RawPowerState,
+    _In_ const SURFACE_BATTERY_STATUS_BURST *Burst,
+    _In_ ULONGLONG Now
+)
+
+/*++
+
+Routine Description:
+
+    This routine feeds the raw power state of a status burst to the power
+    state machine and returns the power state to report.
+
+Arguments:
+
+    Filter - Supplies the power state machine.
+
+    RawPowerState - Supplies the power state decoded from the gauge Flags.
+
+    Burst - Supplies the status burst the raw state was decoded from.
+
+    Now - Supplies the current interrupt time.
+
+Return Value:
+
+    The power state to report.
+
+--*/
+
+{
+    LONG Current;
+    LONG Hysteresis;
+
+    if (Filter->PowerState == 0 || RawPowerState == Filter->PowerState) {
+        HotdogBatteryPowerFilterCommit(Filter, RawPowerState);
+        goto PowerFilterUpdateEnd;
+    }
+
+    if ((RawPowerState & BATTERY_CRITICAL) != 0) {
+        HotdogBatteryPowerFilterCommit(Filter, RawPowerState);
+        goto PowerFilterUpdateEnd;
+    }
+
+    Current = Burst->AverageCurrent;
+    Hysteresis = (Filter->CurrentHysteresis > MAXLONG) ? MAXLONG : (LONG)Filter->CurrentHysteresis;
+    switch (RawPowerState) {
+    case BATTERY_CHARGING:
+
+        //
+        // A full battery topping off flaps between full and charging, it
+        // is only charging again once it lost some charge.
+        //
+
+        if (Filter->PowerState == BATTERY_POWER_ON_LINE) {
+            if ((ULONG)Burst->RemainingCapacity * 100 >=
+                (ULONG)Burst->FullChargeCapacity * (100 - Filter->SocHysteresis)) {
+
+                Filter->PendingPowerState = 0;
+                Filter->PendingPowerStateTime = 0;
+                goto PowerFilterUpdateEnd;
+            }
+
+        } else if (Current >= Hysteresis) {
+            HotdogBatteryPowerFilterCommit(Filter, RawPowerState);
+            goto PowerFilterUpdateEnd;
+        }
+
+        break;
+
+    case BATTERY_DISCHARGING:
+        if ((Filter->PowerState & BATTERY_CRITICAL) == 0 && -Current >= Hysteresis) {
+            HotdogBatteryPowerFilterCommit(Filter, RawPowerState);
+            goto PowerFilterUpdateEnd;
+        }
+
+        break;
+
+    default:
+        break;
+    }
+
+    if (Filter->PendingPowerState != RawPowerState) {
+        Filter->PendingPowerState = RawPowerState;
+        Filter->PendingPowerStateTime = Now;
+    }
+
+    if ((Now - Filter->PendingPowerStateTime) >=
+        (ULONGLONG)Filter->Debounce * 10000) {
+
+        HotdogBatteryPowerFilterCommit(Filter, RawPowerState);
+    }
+
+PowerFilterUpdateEnd:
+    return Filter->PowerState;
+}
+
+FORCEINLINE
+LONG
+HotdogBatteryChargeOverInterval(
+    _In_ INT16 AverageCurrent,
+    _In_ ULONGLONG Elapsed
+)
+
+/*++
+
+Routine Description:
+
+    This routine integrates an average current over an interval.
+
+Arguments:
+
+    AverageCurrent - Supplies the average current in mA, negative while
+        discharging.
+
+    Elapsed - Supplies the interval in 100ns units.
+
+Return Value:
+
+    Charge in mAh that flowed over the interval, negative while
+    discharging.
+
+--*/
+
+{
+    //
+    // A day at the largest current still fits in 64 bits, and no
+    // extrapolation lives that long.
+    //
+
+    if (Elapsed > (ULONGLONG)SURFACE_BATTERY_HOUR * 24) {
+        Elapsed = (ULONGLONG)SURFACE_BATTERY_HOUR * 24;
+    }
+
+    return (LONG)(((LONGLONG)AverageCurrent * (LONGLONG)Elapsed) /
+        SURFACE_BATTERY_HOUR);
+}
+
+FORCEINLINE
+VOID
+HotdogBatteryEnergyAccountAdd(
+    _Inout_ PSURFACE_BATTERY_ENERGY_ACCOUNT Account,
+    _In_ const SURFACE_BATTERY_STATUS_BURST *Burst,
+    _In_ ULONG PowerState,
+    _In_ ULONGLONG Elapsed,
+    _In_ ULONGLONG MaxElapsed
+)
+
+/*++
+
+Routine Description:
+
+    This routine adds an interval to an energy account. The voltage and
+    average current of Burst are taken as constant over the interval and
+    PowerState decides between AC and battery time. The gauge Flags only
+    say charging while a charger is connected, so charging counts as AC
+    time. Intervals longer than MaxElapsed are only counted as gap time.
+
+Arguments:
+
+    Account - Supplies the energy account to add the interval to.
+
+    Burst - Supplies the status burst read at the start of the interval.
+
+    PowerState - Supplies the power state reported during the interval.
+
+    Elapsed - Supplies the interval in 100ns units.
+
+    MaxElapsed - Supplies the longest interval that is integrated.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    LONG Power;
+
+    if (Elapsed > MaxElapsed) {
+        Account->GapTime += Elapsed;
+        return;
+    }
+
+    //
+    // mV * mA gives uW, uW * 100ns / (hour / 1000) gives nWh. The interval
+    // is bounded, so the product fits even at the largest register values.
+    //
+
+    Power = (LONG)Burst->Voltage * (LONG)Burst->AverageCurrent;
+    if (Power >= 0) {
+        Account->Charged += ((ULONGLONG)Power * Elapsed) / (SURFACE_BATTERY_HOUR / 1000);
+
+    } else {
+        Account->Discharged += ((ULONGLONG)(-(LONGLONG)Power) * Elapsed) / (SURFACE_BATTERY_HOUR / 1000);
+    }
+
+    if ((PowerState & (BATTERY_POWER_ON_LINE | BATTERY_CHARGING)) != 0) {
+        Account->AcTime += Elapsed;
+
+    } else {
+        Account->BatteryTime += Elapsed;
+    }
+
+    Account->Samples += 1;
+}
+
+FORCEINLINE
+BOOLEAN
+HotdogBatteryChangeExceeds(
+    _In_ LONGLONG Value,
+    _In_ LONGLONG Reference,
+    _In_ ULONG Delta
+)
+
+/*++
+
+Routine Description:
+
+    This routine decides whether a field moved away from its baseline by at
+    least Delta. A zero delta means any change, which is a delta of one.
+
+Arguments:
+
+    Value - Supplies the field of the sample.
+
+    Reference - Supplies the field of the baseline.
+
+    Delta - Supplies the threshold.
+
+Return Value:
+
+    TRUE if the field moved past the threshold.
+
+--*/
+
+{
+    LONGLONG Distance;
+
+    Distance = (Value > Reference) ? (Value - Reference) : (Reference - Value);
+    return Distance >= ((Delta != 0) ? (LONGLONG)Delta : 1);
+}
+
+FORCEINLINE
+ULONG
+HotdogBatteryChangedFields(
+    _In_ const SURFACE_BATTERY_CHANGE_FILTER *Filter,
+    _In_ const SURFACE_BATTERY_CHANGE_SAMPLE *Sample
+)
+
+/*++
+
+Routine Description:
+
+    This routine compares a sample against a subscription.
+
+Arguments:
+
+    Filter - Supplies the subscription filter and baseline.
+
+    Sample - Supplies the sample to compare.
+
+Return Value:
+
+    The SURFACE_BATTERY_CHANGE_* fields that moved past their thresholds,
+    zero if the subscription is not satisfied.
+
+--*/
+
+{
+    const SURFACE_BATTERY_CHANGE_SAMPLE *Baseline;
+    ULONG Changed;
+
+    Baseline = &Filter->Baseline;
+    Changed = 0;
+    if (Sample->BatteryTag != Baseline->BatteryTag) {
+        Changed |= SURFACE_BATTERY_CHANGE_TAG;
+    }
+
+    if ((Filter->Fields & SURFACE_BATTERY_CHANGE_POWER_STATE) != 0 &&
+        Sample->PowerState != Baseline->PowerState) {
+
+        Changed |= SURFACE_BATTERY_CHANGE_POWER_STATE;
+    }
+
+    if ((Filter->Fields & SURFACE_BATTERY_CHANGE_CAPACITY) != 0 &&
+        HotdogBatteryChangeExceeds(Sample->Capacity, Baseline->Capacity, Filter->CapacityDelta)) {
+
+        Changed |= SURFACE_BATTERY_CHANGE_CAPACITY;
+    }
+
+    if ((Filter->Fields & SURFACE_BATTERY_CHANGE_VOLTAGE) != 0 &&
+        HotdogBatteryChangeExceeds(Sample->Voltage, Baseline->Voltage, Filter->VoltageDelta)) {
+
+        Changed |= SURFACE_BATTERY_CHANGE_VOLTAGE;
+    }
+
+    if ((Filter->Fields & SURFACE_BATTERY_CHANGE_RATE) != 0 &&
+        HotdogBatteryChangeExceeds(Sample->Rate, Baseline->Rate, Filter->RateDelta)) {
+
+        Changed |= SURFACE_BATTERY_CHANGE_RATE;
+    }
+
+    if ((Filter->Fields & SURFACE_BATTERY_CHANGE_TEMPERATURE) != 0 &&
+        HotdogBatteryChangeExceeds(Sample->Temperature, Baseline->Temperature, Filter->TemperatureDelta)) {
+
+        Changed |= SURFACE_BATTERY_CHANGE_TEMPERATURE;
+    }
+
+    return Changed;
+}
+
+FORCEINLINE
+VOID
+HotdogBatterySharedTelemetryBeginUpdate(
+    _Inout_ PSURFACE_BATTERY_SHARED_TELEMETRY Shared,
+    _Inout_ PLONG Sequence
+)
+
+/*++
+
+Routine Description:
+
+    This routine marks the telemetry section as being updated by moving its
+    sequence to the next odd value. SurfaceBatteryReadSharedTelemetry
+    retries until the matching HotdogBatterySharedTelemetryEndUpdate.
+
+    Updates must be serialized by the caller.
+
+Arguments:
+
+    Shared - Supplies the telemetry section.
+
+    Sequence - Supplies the writer's copy of the sequence.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    *Sequence += 1;
+    WriteNoFence(&Shared->Sequence, *Sequence);
+    MemoryBarrier();
+}
+
+FORCEINLINE
+VOID
+HotdogBatterySharedTelemetryEndUpdate(
+    _Inout_ PSURFACE_BATTERY_SHARED_TELEMETRY Shared,
+    _Inout_ PLONG Sequence
+)
+
+/*++
+
+Routine Description:
+
+    This routine publishes an update of the telemetry section by moving its
+    sequence to the next even value.
+
+Arguments:
+
+    Shared - Supplies the telemetry section.
+
+    Sequence - Supplies the writer's copy of the sequence.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    MemoryBarrier();
+    *Sequence += 1;
+    WriteRelease(&Shared->Sequence, *Sequence);
+}
+
+FORCEINLINE
+BOOLEAN
+HotdogBatterySnapshotIsFresh(
+    _In_ ULONGLONG Timestamp,
+    _In_ LONGLONG MaxAge,
+    _In_ ULONGLONG Now
+)
+
+/*++
+
+Routine Description:
+
+    This routine decides whether a persisted timestamp is recent enough to
+    be trusted. Timestamps in the future are rejected since they indicate
+    the system clock was moved backwards after the snapshot was taken.
+
+Arguments:
+
+    Timestamp - Supplies the system time at which the data was captured.
+
+    MaxAge - Supplies the maximum tolerated age in 100ns units.
+
+    Now - Supplies the current system time.
+
+Return Value:
+
+    TRUE if the data may be reported, FALSE otherwise.
+
+--*/
+
+{
+    if (Timestamp == 0 || Timestamp > Now) {
+        return FALSE;
+    }
+
+    return (Now - Timestamp) <= (ULONGLONG)MaxAge;
+}
+
+FORCEINLINE
+VOID
+HotdogBatterySnapshotSeal(
+    _Inout_ PSURFACE_BATTERY_SNAPSHOT Snapshot,
+    _In_ ULONG BatteryTag
+)
+
+/*++
+
+Routine Description:
+
+    This routine stamps the snapshot with its version, size and the battery
+    tag before it is persisted.
+
+Arguments:
+
+    Snapshot - Supplies the snapshot to seal.
+
+    BatteryTag - Supplies the current battery tag.
+
+Return Value:
+
+    None
+
+--*/
+
+{
+    Snapshot->Version = SURFACE_BATTERY_SNAPSHOT_VERSION;
+    Snapshot->Size = sizeof(SURFACE_BATTERY_SNAPSHOT);
+    Snapshot->BatteryTag = BatteryTag;
+}
+
+FORCEINLINE
+BOOLEAN
+HotdogBatterySnapshotIsValid(
+    _In_ const SURFACE_BATTERY_SNAPSHOT* Snapshot,
+    _In_ ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+    This routine checks that a snapshot read back from storage was written
+    by this version of the driver.
+
+Arguments:
+
+    Snapshot - Supplies the snapshot read back.
+
+    Length - Supplies the number of bytes read back.
+
+Return Value:
+
+    TRUE if the snapshot may be used, FALSE otherwise.
+
+--*/
+
+{
+    return Length == sizeof(SURFACE_BATTERY_SNAPSHOT) &&
+        Snapshot->Size == sizeof(SURFACE_BATTERY_SNAPSHOT) &&
+        Snapshot->Version == SURFACE_BATTERY_SNAPSHOT_VERSION;
+}
@@ -0,0 +1,164 @@
+/*++
+
+Module Name:
+
+	powerstate.c
+
+Abstract:
+
+	This module implements the power state machine. The gauge Flags give a
+	raw power state on every status burst, which flaps when the charger
+	connection is marginal or the current hovers around zero. Every flip
+	costs the battery class, the UI and the power policy a round of work,
+	so the reported power state only follows the raw one with hysteresis:
+
+	- Critical is reported at once, leaving it takes the debounce time.
+	- Charging and discharging are reported at once when the average
+	  current agrees with them by at least the current hysteresis, and
+	  after the debounce time otherwise.
+	- Once full, charging is only reported after the state of charge fell
+	  by the state of charge hysteresis.
+
+	The reported state feeds both the status queries and the notifications
+	sent to the battery class by the sampler. The state machine itself is
+	in HotdogBatteryLogic.h, this module configures and traces it.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "powerstate.tmh"
+
+//------------------------------------------------------------------ Definitions
+
+#define SURFACE_BATTERY_POWER_STATE_DEBOUNCE_VALUE_NAME     L"PowerStateDebounceMs"
+#define SURFACE_BATTERY_POWER_STATE_CURRENT_VALUE_NAME      L"PowerStateCurrentHysteresis"
+#define SURFACE_BATTERY_POWER_STATE_SOC_VALUE_NAME          L"PowerStateSocHysteresis"
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, HotdogBatteryPowerStateConfigure)
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryPowerStateConfigure(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine resets the power state machine and loads its hysteresis
+	from the device hardware key. Missing values keep the defaults.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	WDFKEY Key;
+	NTSTATUS Status;
+	DECLARE_CONST_UNICODE_STRING(DebounceName, SURFACE_BATTERY_POWER_STATE_DEBOUNCE_VALUE_NAME);
+	DECLARE_CONST_UNICODE_STRING(CurrentName, SURFACE_BATTERY_POWER_STATE_CURRENT_VALUE_NAME);
+	DECLARE_CONST_UNICODE_STRING(SocName, SURFACE_BATTERY_POWER_STATE_SOC_VALUE_NAME);
+
+	PAGED_CODE();
+
+	HotdogBatteryPowerFilterReset(&DevExt->PowerFilter);
+
+	Status = WdfDeviceOpenRegistryKey(DevExt->Device,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&Key);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"WdfDeviceOpenRegistryKey() Failed. Status 0x%x\n",
+			Status);
+
+		return;
+	}
+
+	WdfRegistryQueryULong(Key, &DebounceName, &DevExt->PowerFilter.Debounce);
+	WdfRegistryQueryULong(Key, &CurrentName, &DevExt->PowerFilter.CurrentHysteresis);
+	WdfRegistryQueryULong(Key, &SocName, &DevExt->PowerFilter.SocHysteresis);
+	WdfRegistryClose(Key);
+
+	DevExt->PowerFilter.SocHysteresis = min(DevExt->PowerFilter.SocHysteresis, 100);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_INFO,
+		"Power state hysteresis: %u ms, %u mA, %u%%\n",
+		DevExt->PowerFilter.Debounce,
+		DevExt->PowerFilter.CurrentHysteresis,
+		DevExt->PowerFilter.SocHysteresis);
+}
+
+_Use_decl_annotations_
+ULONG
+HotdogBatteryFilterPowerState(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONG RawPowerState,
+	PSURFACE_BATTERY_STATUS_BURST Burst,
+	ULONGLONG Now
+)
+
+/*++
+
+Routine Description:
+
+	This routine feeds the raw power state of a status burst to the power
+	state machine and returns the power state to report.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	RawPowerState - Supplies the power state decoded from the gauge Flags.
+
+	Burst - Supplies the status burst the raw state was decoded from.
+
+	Now - Supplies the current interrupt time.
+
+Return Value:
+
+	The power state to report.
+
+--*/
+
+{
+	ULONG PowerState;
+	ULONG Previous;
+
+	Previous = DevExt->PowerFilter.PowerState;
+	PowerState = HotdogBatteryPowerFilterUpdate(&DevExt->PowerFilter,
+		RawPowerState,
+		Burst,
+		Now);
+
+	if (Previous != 0 && Previous != PowerState) {
+		Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
+			"Power state 0x%x -> 0x%x, %u transitions\n",
+			Previous,
+			PowerState,
+			DevExt->PowerFilter.Transitions);
+	}
+
+	return PowerState;
+}
@@ -0,0 +1,529 @@
+/*++
+
+Module Name:
+
+	prefetch.c
+
+Abstract:
+
+	This module implements the gauge register cache and the information level
+	predictor. The battery class tends to issue information levels in a fixed
+	order, e.g. BatteryInformation followed by BatteryGranularityInformation,
+	BatteryTemperature and BatteryEstimatedTime. Once that order has been
+	observed, the registers of the predicted levels are read in the same bus
+	burst as the current one and later levels are answered from the cache.
+
+	How old a cached value may be is decided by the staleness bounds of the
+	status and of every information level. Within its bound a value is
+	reported as is, unless the controller is awake anyway and refreshing it
+	costs no extra wakeup.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "prefetch.tmh"
+
+//------------------------------------------------------------------ Definitions
+
+#define SURFACE_BATTERY_PREFETCH_LIFETIME \
+	((ULONGLONG)SURFACE_BATTERY_PREFETCH_LIFETIME_MS * 10000)
+
+//------------------------------------------------------------------- Prototypes
+
+ULONG
+HotdogBatteryFreshRegisters(
+	_In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+	_In_ ULONGLONG Now,
+	_In_ ULONGLONG Lifetime
+);
+
+ULONG
+HotdogBatteryAge(
+	_In_ ULONGLONG Timestamp,
+	_In_ ULONGLONG Now
+);
+
+ULONG
+HotdogBatteryPredictRegisters(
+	_In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+	_In_ BATTERY_QUERY_INFORMATION_LEVEL Level
+);
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCacheFill(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	UCHAR Address,
+	PVOID Data,
+	ULONG Length
+)
+
+/*++
+
+Routine Description:
+
+	This routine stores registers just read from the gauge in the register
+	cache. Any speculative read of the same registers is superseded.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Address - Supplies the address of the first register, must be even.
+
+	Data - Supplies the register contents as read from the bus.
+
+	Length - Supplies the length of Data in bytes.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONG Index;
+	ULONG Last;
+	ULONGLONG Now;
+
+	NT_ASSERT((Address & 1) == 0);
+
+	Now = KeQueryInterruptTime();
+	Last = min((ULONG)(Address >> 1) + (Length / sizeof(UINT16)), SURFACE_BATTERY_CACHE_REGISTERS);
+	for (Index = Address >> 1; Index < Last; Index += 1) {
+		DevExt->RegisterCache[Index] = ((PUINT16)Data)[Index - (Address >> 1)];
+		DevExt->RegisterCacheTime[Index] = Now;
+		DevExt->PrefetchedMask &= ~(1UL << Index);
+	}
+}
+
+_Use_decl_annotations_
+ULONG
+HotdogBatteryFreshRegisters(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONGLONG Now,
+	ULONGLONG Lifetime
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the set of cached registers that were read from the
+	gauge recently enough to be reported.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Now - Supplies the current interrupt time.
+
+	Lifetime - Supplies the maximum age of a fresh register in 100ns units.
+
+Return Value:
+
+	Bitmask of fresh register indices.
+
+--*/
+
+{
+	ULONG Fresh;
+	ULONG Index;
+
+	Fresh = 0;
+	for (Index = 0; Index < SURFACE_BATTERY_CACHE_REGISTERS; Index += 1) {
+		if (DevExt->RegisterCacheTime[Index] != 0 &&
+			(Now - DevExt->RegisterCacheTime[Index]) <= Lifetime) {
+
+			Fresh |= 1UL << Index;
+		}
+	}
+
+	return Fresh;
+}
+
+_Use_decl_annotations_
+ULONG
+HotdogBatteryPredictRegisters(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	BATTERY_QUERY_INFORMATION_LEVEL Level
+)
+
+/*++
+
+Routine Description:
+
+	This routine follows the learned level sequence from Level for as long
+	as the predictor is confident, and returns the registers the predicted
+	levels will need.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Level - Supplies the level being queried now.
+
+Return Value:
+
+	Bitmask of register indices worth prefetching.
+
+--*/
+
+{
+	ULONG Current;
+	ULONG Depth;
+	ULONG Mask;
+
+	Mask = 0;
+	Current = (ULONG)Level;
+	for (Depth = 0; Depth < SURFACE_BATTERY_PREFETCH_DEPTH; Depth += 1) {
+		if (Current >= SURFACE_BATTERY_LEVEL_COUNT ||
+			DevExt->LevelConfidence[Current] < SURFACE_BATTERY_PREFETCH_CONFIDENT) {
+
+			break;
+		}
+
+		Current = DevExt->LevelSuccessor[Current];
+		if (Current == (ULONG)Level) {
+			break;
+		}
+
+		Mask |= HotdogBatteryLevelRegisters(DevExt, Current);
+	}
+
+	return Mask;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryObserveLevel(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	BATTERY_QUERY_INFORMATION_LEVEL Level
+)
+
+/*++
+
+Routine Description:
+
+	This routine records that Level was queried. When the previous query
+	happened within the prefetch lifetime, Level is counted as its successor
+	in the learned sequence.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Level - Supplies the level being queried.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONGLONG Now;
+	ULONG Previous;
+
+	if ((ULONG)Level >= SURFACE_BATTERY_LEVEL_COUNT) {
+		return;
+	}
+
+	Now = KeQueryInterruptTime();
+	Previous = DevExt->PreviousLevel;
+	if (DevExt->PreviousLevelTime != 0 &&
+		(Now - DevExt->PreviousLevelTime) <= SURFACE_BATTERY_PREFETCH_LIFETIME) {
+
+		if (DevExt->LevelSuccessor[Previous] == (UCHAR)Level) {
+			if (DevExt->LevelConfidence[Previous] < SURFACE_BATTERY_PREFETCH_CONFIDENCE_MAX) {
+				DevExt->LevelConfidence[Previous] += 1;
+			}
+
+		} else if (DevExt->LevelConfidence[Previous] > 0) {
+			DevExt->LevelConfidence[Previous] -= 1;
+
+		} else {
+			DevExt->LevelSuccessor[Previous] = (UCHAR)Level;
+			DevExt->LevelConfidence[Previous] = 1;
+		}
+	}
+
+	DevExt->PreviousLevel = (ULONG)Level;
+	DevExt->PreviousLevelTime = Now;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryReadRegisters(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	BATTERY_QUERY_INFORMATION_LEVEL Level,
+	ULONG RegisterMask
+)
+
+/*++
+
+Routine Description:
+
+	This routine makes sure every register in RegisterMask is present and
+	within the staleness bound of Level in the register cache. If any of
+	them has to be read, the
+	registers of the predicted next levels are read along with them, and
+	neighbouring registers are merged into as few transfers as possible.
+
+	Reads for SURFACE_BATTERY_LEVEL_NONE are not counted as prefetch hits
+	or misses and read nothing speculatively.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Level - Supplies the level the registers are needed for, or
+		SURFACE_BATTERY_LEVEL_NONE.
+
+	RegisterMask - Supplies the register indices needed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	UINT16 Buffer[SURFACE_BATTERY_CACHE_REGISTERS];
+	ULONG First;
+	ULONG Fresh;
+	ULONG Last;
+	ULONG Next;
+	ULONGLONG Now;
+	ULONG Plan;
+	ULONG Speculative;
+	ULONG SpanMask;
+	NTSTATUS Status;
+
+	Status = STATUS_SUCCESS;
+	Now = KeQueryInterruptTime();
+	Fresh = HotdogBatteryFreshRegisters(DevExt,
+		Now,
+		HotdogBatteryStalenessBound(DevExt,
+			((ULONG)Level < SURFACE_BATTERY_LEVEL_COUNT) ? DevExt->LevelMaxAge[Level] : 0));
+	HotdogBatteryCount(DevExt, CacheLookups, 1);
+	if ((RegisterMask & ~Fresh) == 0) {
+		HotdogBatteryCount(DevExt, CacheHits, 1);
+		if ((ULONG)Level < SURFACE_BATTERY_LEVEL_COUNT &&
+			(RegisterMask & DevExt->PrefetchedMask) != 0) {
+
+			DevExt->PrefetchHits += 1;
+			DevExt->PrefetchedMask &= ~RegisterMask;
+		}
+
+		goto Exit;
+	}
+
+	Plan = RegisterMask & ~Fresh;
+	if ((ULONG)Level < SURFACE_BATTERY_LEVEL_COUNT) {
+		DevExt->PrefetchMisses += 1;
+		Plan |= HotdogBatteryPredictRegisters(DevExt, Level) & ~Fresh;
+	}
+
+	Speculative = Plan & ~RegisterMask;
+
+	while (Plan != 0) {
+		First = 0;
+		while ((Plan & (1UL << First)) == 0) {
+			First += 1;
+		}
+
+		Last = First;
+		for (Next = First + 1; Next < SURFACE_BATTERY_CACHE_REGISTERS; Next += 1) {
+			if ((Plan & (1UL << Next)) == 0) {
+				continue;
+			}
+
+			if ((Next - Last - 1) * sizeof(UINT16) > SURFACE_BATTERY_PREFETCH_MAX_GAP ||
+				(Next - First + 1) * sizeof(UINT16) > DEFAULT_SPB_BUFFER_SIZE) {
+
+				break;
+			}
+
+			Last = Next;
+		}
+
+		Status = SpbReadDataSynchronously(&DevExt->I2CContext,
+			(UCHAR)(First << 1),
+			Buffer,
+			(Last - First + 1) * sizeof(UINT16));
+
+		if (!NT_SUCCESS(Status)) {
+			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
+			goto Exit;
+		}
+
+		HotdogBatteryCacheFill(DevExt,
+			(UCHAR)(First << 1),
+			Buffer,
+			(Last - First + 1) * sizeof(UINT16));
+
+		SpanMask = ((Last == SURFACE_BATTERY_CACHE_REGISTERS - 1) ? MAXULONG : ((1UL << (Last + 1)) - 1)) &
+			~((1UL << First) - 1);
+
+		Plan &= ~SpanMask;
+	}
+
+	DevExt->PrefetchedMask |= Speculative;
+
+Exit:
+	Trace(TRACE_LEVEL_VERBOSE, SURFACE_BATTERY_TRACE,
+		"Level %d: PrefetchHits %u, PrefetchMisses %u\n",
+		Level,
+		DevExt->PrefetchHits,
+		DevExt->PrefetchMisses);
+
+	return Status;
+}
+
+_Use_decl_annotations_
+ULONGLONG
+HotdogBatteryStalenessBound(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONG MaxAge
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns how old a cached value may be when reported. A
+	value within the prefetch lifetime was read for the current sequence of
+	queries and is always reported. Older values are reported up to MaxAge,
+	unless the controller was used moments ago, in which case reading them
+	again does not wake it up.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	MaxAge - Supplies the staleness bound in milliseconds, 0 for the
+		default.
+
+Return Value:
+
+	Maximum age in 100ns units.
+
+--*/
+
+{
+	if (MaxAge <= SURFACE_BATTERY_PREFETCH_LIFETIME_MS ||
+		SpbBusIsAwake(&DevExt->I2CContext)) {
+
+		return SURFACE_BATTERY_PREFETCH_LIFETIME;
+	}
+
+	return (ULONGLONG)MaxAge * 10000;
+}
+
+_Use_decl_annotations_
+ULONG
+HotdogBatteryAge(
+	ULONGLONG Timestamp,
+	ULONGLONG Now
+)
+
+/*++
+
+Routine Description:
+
+	This routine converts an interrupt time into an age in milliseconds.
+
+Arguments:
+
+	Timestamp - Supplies the interrupt time of the sample, 0 if none.
+
+	Now - Supplies the current interrupt time.
+
+Return Value:
+
+	Age in milliseconds, SURFACE_BATTERY_STALENESS_NEVER without a sample.
+
+--*/
+
+{
+	ULONGLONG Age;
+
+	if (Timestamp == 0) {
+		return SURFACE_BATTERY_STALENESS_NEVER;
+	}
+
+	Age = (Now - Timestamp) / 10000;
+	return (ULONG)min(Age, (ULONGLONG)SURFACE_BATTERY_STALENESS_NEVER - 1);
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryQueryStaleness(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PSURFACE_BATTERY_STALENESS Staleness
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the staleness bounds and the age of the status
+	sample and of the registers of every information level. The age of a
+	level is that of its oldest register.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Staleness - Supplies a pointer to the structure to fill.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONG Age;
+	ULONG Index;
+	ULONG Level;
+	ULONG Mask;
+	ULONGLONG Now;
+
+	Now = KeQueryInterruptTime();
+	Staleness->Version = SURFACE_BATTERY_STALENESS_VERSION;
+	Staleness->StatusMaxAge = (DevExt->StatusMaxAge != 0) ?
+		max(DevExt->StatusMaxAge, SURFACE_BATTERY_STALENESS_MINIMUM) :
+		SURFACE_BATTERY_STATUS_DEFAULT_MAX_AGE_MS;
+	Staleness->StatusAge = HotdogBatteryAge(DevExt->LastBurstTime, Now);
+	for (Level = 0; Level < SURFACE_BATTERY_LEVEL_COUNT; Level += 1) {
+		Staleness->LevelMaxAge[Level] = max(DevExt->LevelMaxAge[Level],
+			SURFACE_BATTERY_STALENESS_MINIMUM);
+
+		Staleness->LevelAge[Level] = 0;
+		Mask = HotdogBatteryLevelRegisters(DevExt, Level);
+		for (Index = 0; Index < SURFACE_BATTERY_CACHE_REGISTERS; Index += 1) {
+			if ((Mask & (1UL << Index)) != 0) {
+				Age = HotdogBatteryAge(DevExt->RegisterCacheTime[Index], Now);
+				Staleness->LevelAge[Level] = max(Staleness->LevelAge[Level], Age);
+			}
+		}
+	}
+}
@@ -0,0 +1,635 @@
+/*++
+
+Module Name:
+
+	sampler.c
+
+Abstract:
+
+	This module implements the tiered battery sampler. A short period timer
+	reads only the gauge Flags word, which is enough to see the charger being
+	attached or removed and the discharge and critical bits changing. A full
+	status burst is read only when one of those bits changed, or once every
+	SURFACE_BATTERY_FULL_SAMPLE_PERIOD polls to keep the sample fresh.
+
+	Between two bursts the remaining capacity is extrapolated by coulomb
+	counting: the average current of the last burst is integrated over the
+	time since it was read. Every burst re-anchors the extrapolation, and a
+	burst is read early once the integrated charge exceeds
+	SURFACE_BATTERY_ESTIMATE_MAX_DRIFT per mille of the full charge capacity.
+
+	The same integration, with the voltage folded in, accounts the energy
+	charged into and discharged from the battery and the time spent on AC
+	and on battery. Every burst closes the interval since the previous one.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "sampler.tmh"
+
+//------------------------------------------------------------------- Prototypes
+
+EVT_WDF_TIMER HotdogBatterySamplerTimer;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+LONG
+HotdogBatteryIntegrateCharge(
+	_In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+	_In_ ULONGLONG Now
+);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+HotdogBatteryNextTick(
+	_In_ ULONG Period
+);
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, HotdogBatterySamplerCreate)
+#pragma alloc_text(PAGE, HotdogBatterySamplerStart)
+#pragma alloc_text(PAGE, HotdogBatterySamplerStop)
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatterySamplerCreate(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the sampler timer. The timer runs at PASSIVE_LEVEL
+	since every tick issues synchronous bus I/O, and is coalescable since
+	nothing depends on a tick being on time.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+	WDF_OBJECT_ATTRIBUTES TimerAttributes;
+	WDF_TIMER_CONFIG TimerConfig;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+
+	WDF_TIMER_CONFIG_INIT_PERIODIC(&TimerConfig,
+		HotdogBatterySamplerTimer,
+		SURFACE_BATTERY_FLAGS_POLL_INTERVAL_MS);
+
+	TimerConfig.AutomaticSerialization = FALSE;
+	TimerConfig.TolerableDelay = SURFACE_BATTERY_TIMER_TOLERABLE_DELAY_MS;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&TimerAttributes);
+	TimerAttributes.ParentObject = Device;
+	TimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+	Status = WdfTimerCreate(&TimerConfig,
+		&TimerAttributes,
+		&DevExt->SamplerTimer);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+			"WdfTimerCreate(SamplerTimer) Failed. Status 0x%x\n",
+			Status);
+	}
+
+	return Status;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySamplerStart(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine starts sampling. The first tick always reads a full burst,
+	since no Flags baseline is known yet. The first tick is aligned to the
+	driver-wide tick, so every battery is sampled in the same wakeup.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	HotdogBatteryAcquireStateLock(DevExt);
+	DevExt->SampledFlagsValid = FALSE;
+	DevExt->PollsSinceBurst = 0;
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	WdfTimerStart(DevExt->SamplerTimer,
+		WDF_REL_TIMEOUT_IN_MS(HotdogBatteryNextTick(
+			SURFACE_BATTERY_FLAGS_POLL_INTERVAL_MS)));
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySamplerStop(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine stops sampling and waits for a running tick to finish, so
+	no bus I/O is issued once it returns.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	WdfTimerStop(DevExt->SamplerTimer, TRUE);
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySamplerTimer(
+	WDFTIMER Timer
+)
+
+/*++
+
+Routine Description:
+
+	This routine is the periodic sampler tick. It reads the 2-byte Flags word
+	and escalates to a full status burst when a notify bit changed, a power
+	state transition is pending, the slow cadence is due or the extrapolated
+	capacity drifted too far. Transitions of the debounced power state are
+	reported to the battery class so it re-queries the status instead of
+	waiting for its next poll, and every full sample is offered to the
+	pending change subscriptions.
+
+Arguments:
+
+	Timer - Supplies a handle to the sampler timer.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	BATTERY_STATUS BatteryStatus;
+	BOOLEAN Changed;
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+	UINT16 Flags;
+	ULONG PowerState;
+	BOOLEAN Sampled;
+	NTSTATUS Status;
+
+	DevExt = GetDeviceExtension(WdfTimerGetParentObject(Timer));
+	Changed = FALSE;
+	Flags = 0;
+	Sampled = FALSE;
+
+	HotdogBatteryAcquireStateLock(DevExt);
+
+	//
+	// Without a baseline there is nothing to compare Flags against, go
+	// straight to a full burst which also reads Flags.
+	//
+
+	if (DevExt->SampledFlagsValid != FALSE) {
+		Status = SpbReadDataSynchronously(&DevExt->I2CContext,
+			HotdogBatteryGaugeRegister(DevExt, SURFACE_BATTERY_GAUGE_FLAGS),
+			&Flags,
+			sizeof(Flags));
+
+		if (!NT_SUCCESS(Status)) {
+			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+				"Flags poll failed with Status = 0x%08lX\n",
+				Status);
+
+			goto SamplerTimerEnd;
+		}
+
+		Changed = ((Flags ^ DevExt->SampledFlags) & DevExt->Gauge->FlagsNotifyMask) != 0;
+		DevExt->SampledFlags = Flags;
+		DevExt->PollsSinceBurst += 1;
+		if (Changed == FALSE &&
+			DevExt->PowerFilter.PendingPowerState == 0 &&
+			DevExt->PollsSinceBurst < SURFACE_BATTERY_FULL_SAMPLE_PERIOD &&
+			HotdogBatteryEstimateExpired(DevExt, KeQueryInterruptTime()) == FALSE) {
+
+			goto SamplerTimerEnd;
+		}
+	}
+
+	Trace(TRACE_LEVEL_VERBOSE, SURFACE_BATTERY_TRACE,
+		"Full sample: Flags 0x%04x, Changed %d\n",
+		Flags,
+		Changed);
+
+	//
+	// Notify the class on transitions of the debounced power state only, a
+	// raw Flags change may be a flap that never makes it that far.
+	//
+
+	PowerState = DevExt->PowerFilter.PowerState;
+	Changed = FALSE;
+	Status = HotdogBatteryRefreshStatus(DevExt, &BatteryStatus);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+			"HotdogBatteryRefreshStatus failed with Status = 0x%08lX\n",
+			Status);
+
+		goto SamplerTimerEnd;
+	}
+
+	Changed = (PowerState != 0 && PowerState != DevExt->PowerFilter.PowerState);
+	Sampled = TRUE;
+
+SamplerTimerEnd:
+	WdfWaitLockRelease(DevExt->StateLock);
+	if (Changed != FALSE) {
+		HotdogBatteryNotifyClass(DevExt);
+	}
+
+	if (Sampled != FALSE) {
+		HotdogBatteryCompleteSubscriptions(DevExt);
+	}
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryNotifyClass(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine tells the battery class that the battery status changed.
+	It is a no-op while the device is not registered with the class.
+
+	The caller must not hold the state lock, since the class may call back
+	into the miniport to query the new status.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	if (ExAcquireRundownProtection(&DevExt->ClassRundown)) {
+		BatteryClassStatusNotify(DevExt->ClassHandle);
+		ExReleaseRundownProtection(&DevExt->ClassRundown);
+	}
+}
+
+_Use_decl_annotations_
+ULONG
+HotdogBatteryNextTick(
+	ULONG Period
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the time until the next multiple of Period from
+	the driver-wide tick epoch.
+
+Arguments:
+
+	Period - Supplies the period of the timer in milliseconds.
+
+Return Value:
+
+	Milliseconds until the next tick, at least 1.
+
+--*/
+
+{
+	LARGE_INTEGER Frequency;
+	LONGLONG Interval;
+	LONGLONG Now;
+
+	Now = KeQueryPerformanceCounter(&Frequency).QuadPart;
+	Interval = Frequency.QuadPart * Period / 1000;
+	if (Interval == 0) {
+		return max(Period, 1);
+	}
+
+	Now -= GetGlobalData(WdfGetDriver())->TickEpoch;
+	return (ULONG)max((Interval - (Now % Interval)) * 1000 / Frequency.QuadPart, 1);
+}
+
+_Use_decl_annotations_
+LONG
+HotdogBatteryIntegrateCharge(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONGLONG Now
+)
+
+/*++
+
+Routine Description:
+
+	This routine integrates the average current of the last burst over the
+	time since it was read.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Now - Supplies the current interrupt time.
+
+Return Value:
+
+	Charge in mAh that flowed since the last burst, negative while
+	discharging.
+
+--*/
+
+{
+	if (DevExt->LastBurstTime == 0 || Now <= DevExt->LastBurstTime) {
+		return 0;
+	}
+
+	return HotdogBatteryChargeOverInterval(DevExt->LastBurst.AverageCurrent,
+		Now - DevExt->LastBurstTime);
+}
+
+_Use_decl_annotations_
+BOOLEAN
+HotdogBatteryEstimateExpired(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONGLONG Now
+)
+
+/*++
+
+Routine Description:
+
+	This routine decides whether the extrapolation drifted far enough from
+	the last burst that a new burst must be read.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Now - Supplies the current interrupt time.
+
+Return Value:
+
+	TRUE if there is no burst to extrapolate from or it drifted too far.
+
+--*/
+
+{
+	LONG Charge;
+
+	if (DevExt->LastBurstTime == 0) {
+		return TRUE;
+	}
+
+	Charge = HotdogBatteryIntegrateCharge(DevExt, Now);
+	if (Charge < 0) {
+		Charge = -Charge;
+	}
+
+	return (ULONG)Charge * 1000 >=
+		(ULONG)DevExt->LastBurst.FullChargeCapacity * SURFACE_BATTERY_ESTIMATE_MAX_DRIFT;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryEstimateStatus(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONGLONG Now,
+	PBATTERY_STATUS BatteryStatus
+)
+
+/*++
+
+Routine Description:
+
+	This routine extrapolates the battery status of the last burst to Now.
+	Only the remaining capacity moves, it is kept between empty and the
+	full charge capacity.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Now - Supplies the current interrupt time.
+
+	BatteryStatus - Supplies a pointer to the structure to fill.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	LONG Remaining;
+
+	Remaining = (LONG)DevExt->LastBurst.RemainingCapacity +
+		HotdogBatteryIntegrateCharge(DevExt, Now);
+
+	Remaining = max(Remaining, 0);
+	Remaining = min(Remaining, (LONG)DevExt->LastBurst.FullChargeCapacity);
+
+	BatteryStatus->PowerState = DevExt->Snapshot.PowerState;
+	BatteryStatus->Capacity = HotdogBatteryConvertToWatts((ULONG)Remaining);
+	BatteryStatus->Voltage = DevExt->Snapshot.Voltage;
+	BatteryStatus->Rate = DevExt->Snapshot.Rate;
+}
+
+_Use_decl_annotations_
+ULONG
+HotdogBatteryEstimateTimeToEmpty(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONGLONG Now,
+	UINT16 TimeToEmpty
+)
+
+/*++
+
+Routine Description:
+
+	This routine counts the cached TimeToEmpty register down by the time
+	since it was read.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Now - Supplies the current interrupt time.
+
+	TimeToEmpty - Supplies the cached register value in minutes.
+
+Return Value:
+
+	Estimated time in seconds.
+
+--*/
+
+{
+	ULONGLONG Elapsed;
+	ULONGLONG ReadTime;
+
+	ReadTime = DevExt->RegisterCacheTime[
+		HotdogBatteryGaugeRegister(DevExt, SURFACE_BATTERY_GAUGE_TIME_TO_EMPTY) >> 1];
+
+	Elapsed = 0;
+	if (ReadTime != 0 && Now > ReadTime) {
+		Elapsed = (Now - ReadTime) / 10000000;
+	}
+
+	Elapsed = min(Elapsed, (ULONGLONG)TimeToEmpty * 60);
+	return (ULONG)((ULONGLONG)TimeToEmpty * 60 - Elapsed);
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryIntegrateEnergy(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	ULONGLONG Now,
+	PSURFACE_BATTERY_ENERGY_ACCOUNT Account
+)
+
+/*++
+
+Routine Description:
+
+	This routine adds the interval since the last burst to an energy
+	account. The voltage and average current of the last burst are taken as
+	constant over the interval and the power state reported during it
+	decides between AC and battery time, so the routine must run before a
+	new burst replaces the last one.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Now - Supplies the current interrupt time.
+
+	Account - Supplies the energy account to add the interval to.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	if (DevExt->LastBurstTime == 0 || Now <= DevExt->LastBurstTime) {
+		return;
+	}
+
+	HotdogBatteryEnergyAccountAdd(Account,
+		&DevExt->LastBurst,
+		DevExt->PowerFilter.PowerState,
+		Now - DevExt->LastBurstTime,
+		(ULONGLONG)SURFACE_BATTERY_ENERGY_MAX_INTERVAL_MS * 10000);
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryQueryEnergy(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PSURFACE_BATTERY_ENERGY Energy
+)
+
+/*++
+
+Routine Description:
+
+	This routine fills IOCTL_SURFACE_BATTERY_QUERY_ENERGY output from the
+	energy account, including the interval since the last burst without
+	committing it to the account.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Energy - Supplies a pointer to the structure to fill.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	SURFACE_BATTERY_ENERGY_ACCOUNT Account;
+
+	Account = DevExt->Energy;
+	HotdogBatteryIntegrateEnergy(DevExt, KeQueryInterruptTime(), &Account);
+
+	RtlZeroMemory(Energy, sizeof(SURFACE_BATTERY_ENERGY));
+	Energy->Version = SURFACE_BATTERY_ENERGY_VERSION;
+	Energy->ChargedEnergy = (Account.Charged + 500000) / 1000000;
+	Energy->DischargedEnergy = (Account.Discharged + 500000) / 1000000;
+	Energy->AcTime = Account.AcTime;
+	Energy->BatteryTime = Account.BatteryTime;
+	Energy->GapTime = Account.GapTime;
+	Energy->Samples = Account.Samples;
+}
@@ -0,0 +1,227 @@
+/*++
+
+Module Name:
+
+	snapshot.c
+
+Abstract:
+
+	This module persists a compact last-known-good battery snapshot under the
+	device hardware key, so the first battery class queries after boot can
+	be answered before the gauge has been read.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "snapshot.tmh"
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, HotdogBatteryLoadSnapshot)
+
+//
+// N.B. HotdogBatterySaveSnapshot is called from the status query path and
+//      usually returns without writing, so it stays nonpaged.
+//
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryLoadSnapshot(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine loads the persisted snapshot and primes the first
+	BatteryInformation and status queries with it when it is fresh enough.
+	The persisted battery tag is always used as the seed for the next tag.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	WDFKEY Key;
+	LARGE_INTEGER Now;
+	SURFACE_BATTERY_SNAPSHOT Snapshot;
+	ULONG SnapshotLength;
+	NTSTATUS Status;
+	ULONG ValueType;
+	DECLARE_CONST_UNICODE_STRING(ValueName, SURFACE_BATTERY_SNAPSHOT_VALUE_NAME);
+
+	PAGED_CODE();
+
+	DevExt->InformationPrimed = FALSE;
+	DevExt->StatusPrimed = FALSE;
+
+	Status = WdfDeviceOpenRegistryKey(DevExt->Device,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&Key);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"WdfDeviceOpenRegistryKey() Failed. Status 0x%x\n",
+			Status);
+
+		return;
+	}
+
+	RtlZeroMemory(&Snapshot, sizeof(Snapshot));
+	SnapshotLength = 0;
+	Status = WdfRegistryQueryValue(Key,
+		&ValueName,
+		sizeof(Snapshot),
+		&Snapshot,
+		&SnapshotLength,
+		&ValueType);
+
+	WdfRegistryClose(Key);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_INFO,
+			"No snapshot loaded. Status 0x%x\n",
+			Status);
+
+		return;
+	}
+
+	if (ValueType != REG_BINARY ||
+		HotdogBatterySnapshotIsValid(&Snapshot, SnapshotLength) == FALSE) {
+
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"Ignoring snapshot with version %u, size %u\n",
+			Snapshot.Version,
+			SnapshotLength);
+
+		return;
+	}
+
+	DevExt->Snapshot = Snapshot;
+	if (Snapshot.BatteryTag != BATTERY_TAG_INVALID) {
+		DevExt->BatteryTag = Snapshot.BatteryTag;
+	}
+
+	KeQuerySystemTime(&Now);
+	DevExt->InformationPrimed = HotdogBatterySnapshotIsFresh(
+		Snapshot.InformationTimestamp,
+		SURFACE_BATTERY_SNAPSHOT_INFORMATION_MAX_AGE,
+		Now.QuadPart);
+
+	DevExt->StatusPrimed = HotdogBatterySnapshotIsFresh(
+		Snapshot.StatusTimestamp,
+		SURFACE_BATTERY_SNAPSHOT_STATUS_MAX_AGE,
+		Now.QuadPart);
+
+	//
+	// The snapshot on disk already matches memory, and the first write after
+	// start is deferred by a full interval.
+	//
+
+	DevExt->SnapshotDirty = FALSE;
+	DevExt->SnapshotLastWrite = Now;
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_INFO,
+		"Snapshot loaded: Tag %u, InformationPrimed %d, StatusPrimed %d\n",
+		Snapshot.BatteryTag,
+		DevExt->InformationPrimed,
+		DevExt->StatusPrimed);
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySaveSnapshot(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	BOOLEAN Force
+)
+
+/*++
+
+Routine Description:
+
+	This routine writes the in-memory snapshot back to the registry. Updates
+	are batched: a dirty snapshot is only written once the write interval
+	has elapsed, unless the caller forces the write because the device is
+	leaving D0.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Force - Supplies TRUE to ignore the write interval.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	WDFKEY Key;
+	LARGE_INTEGER Now;
+	NTSTATUS Status;
+	DECLARE_CONST_UNICODE_STRING(ValueName, SURFACE_BATTERY_SNAPSHOT_VALUE_NAME);
+
+	if (DevExt->SnapshotDirty == FALSE) {
+		return;
+	}
+
+	KeQuerySystemTime(&Now);
+	if (Force == FALSE &&
+		(Now.QuadPart - DevExt->SnapshotLastWrite.QuadPart) <
+			SURFACE_BATTERY_SNAPSHOT_WRITE_INTERVAL) {
+
+		return;
+	}
+
+	Status = WdfDeviceOpenRegistryKey(DevExt->Device,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_SET_VALUE,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&Key);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"WdfDeviceOpenRegistryKey() Failed. Status 0x%x\n",
+			Status);
+
+		return;
+	}
+
+	HotdogBatterySnapshotSeal(&DevExt->Snapshot, DevExt->BatteryTag);
+	Status = WdfRegistryAssignValue(Key,
+		&ValueName,
+		REG_BINARY,
+		sizeof(SURFACE_BATTERY_SNAPSHOT),
+		&DevExt->Snapshot);
+
+	WdfRegistryClose(Key);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"WdfRegistryAssignValue() Failed. Status 0x%x\n",
+			Status);
+
+		return;
+	}
+
+	DevExt->SnapshotDirty = FALSE;
+	DevExt->SnapshotLastWrite = Now;
+}
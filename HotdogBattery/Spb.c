@@ -24,196 +24,214 @@
 
 #include "HotdogBattery.h"
 #include "spb.h"
+#include <spb.h>
 #include <spb.tmh>
 
 #define I2C_VERBOSE_LOGGING 0
 
-NTSTATUS
-SpbDoWriteDataSynchronously(
-	IN SPB_CONTEXT* SpbContext,
-	IN UCHAR Address,
-	IN PVOID Data,
-	IN ULONG Length
+//
+// The SPB context is embedded in the battery device extension, so transfers
+// are accounted to the performance counters of that device.
+//
+#define SpbCountTransfer(SpbContext, Length)                                  \
+	do {                                                                      \
+		PSURFACE_BATTERY_FDO_DATA _DevExt = CONTAINING_RECORD((SpbContext),   \
+			SURFACE_BATTERY_FDO_DATA, I2CContext);                            \
+		HotdogBatteryCount(_DevExt, I2cTransactions, 1);                      \
+		HotdogBatteryCount(_DevExt, I2cBytes, (Length));                      \
+	} while (0)
+
+//
+// Transfers are charged to the battery class callback they are issued for,
+// if any. Callers hold the device state lock.
+//
+#define SpbAccountCall(SpbContext, Length, Start, Allocated)                  \
+	do {                                                                      \
+		PSURFACE_BATTERY_CALLBACK_STAT _Call = CONTAINING_RECORD((SpbContext),\
+			SURFACE_BATTERY_FDO_DATA, I2CContext)->ActiveCall;                \
+		if (_Call != NULL)                                                    \
+		{                                                                     \
+			_Call->Transfers += 1;                                            \
+			_Call->BusBytes += (Length);                                      \
+			_Call->BusTime += KeQueryPerformanceCounter(NULL).QuadPart -      \
+				(Start);                                                      \
+			_Call->LockAcquisitions += 1;                                     \
+			_Call->Allocations += (Allocated) ? 1 : 0;                        \
+		}                                                                     \
+	} while (0)
+
+//
+// Transfers issued by a battery class callback are interactive, anything
+// else (sampler, identification, user mode telemetry) is background work.
+// Callers hold the device state lock.
+//
+#define SpbIsInteractive(SpbContext)                                          \
+	(CONTAINING_RECORD((SpbContext), SURFACE_BATTERY_FDO_DATA,                \
+		I2CContext)->ActiveCall != NULL)
+
+#define SpbActivityStart(Activity, EventName, Address, Length)                \
+	HotdogBatteryActivityStart((Activity), EventName, WINEVENT_LEVEL_VERBOSE, \
+		SURFACE_BATTERY_KEYWORD_SPB,                                          \
+		TraceLoggingUInt8((Address), "Register"),                             \
+		TraceLoggingUInt32((Length), "Bytes"))
+
+#define SpbActivityStop(Activity, EventName, Status)                          \
+	HotdogBatteryActivityStop((Activity), EventName, WINEVENT_LEVEL_VERBOSE,  \
+		SURFACE_BATTERY_KEYWORD_SPB,                                          \
+		TraceLoggingNTStatus((Status), "Status"))
+
+//
+// Transfer capture ring. Once full, the oldest record is overwritten.
+//
+struct _SPB_CAPTURE
+{
+	ULONG Head;
+	ULONG Count;
+	ULONG Dropped;
+	SURFACE_BATTERY_BUS_RECORD Records[SURFACE_BATTERY_BUS_CAPTURE_RECORDS];
+};
+
+C_ASSERT(DEFAULT_SPB_BUFFER_SIZE <= SURFACE_BATTERY_BUS_RECORD_DATA_SIZE);
+
+//
+// Controller shared by every device with the same resource hub id. The bus
+// lock orders the transfers of all of those devices.
+//
+// Interactive transfers waiting for the bus are counted in
+// InteractiveWaiters, background transfers wait for InteractiveIdle before
+// taking the lock, for at most SPB_BACKGROUND_YIELD_MS so they can not be
+// starved. Background reads longer than SPB_BACKGROUND_CHUNK_SIZE are split
+// on a shared bus, so an interactive transfer only waits for one chunk. A
+// status burst is never split: its registers must all come from the same
+// gauge update, which another device interleaving between chunks would
+// break. Only longer block reads are chunked.
+//
+struct _SPB_BUS
+{
+	LIST_ENTRY Link;
+	LARGE_INTEGER I2cResHubId;
+	ULONG References;
+	WDFWAITLOCK Lock;
+	LONG InteractiveWaiters;
+	KEVENT InteractiveIdle;
+
+	//
+	// Controller activity in performance counter ticks, guarded by Lock.
+	// Transfers less than SPB_BUS_IDLE_TIMEOUT_MS apart are counted in the
+	// same power-up period.
+	//
+	LONGLONG LastActive;
+	LONGLONG ActiveTime;
+	LONGLONG Wakeups;
+};
+
+#define SPB_BUS_IDLE_TIMEOUT_MS 10
+#define SPB_BACKGROUND_YIELD_MS 50
+#define SPB_BACKGROUND_CHUNK_SIZE SURFACE_BATTERY_STATUS_BURST_MAX
+
+static LIST_ENTRY SpbBusList;
+static WDFWAITLOCK SpbBusListLock;
+
+//
+// Timer closing the I/O target once the device stopped transferring.
+//
+typedef struct _SPB_IDLE_TIMER_CONTEXT
+{
+	SPB_CONTEXT* SpbContext;
+} SPB_IDLE_TIMER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(SPB_IDLE_TIMER_CONTEXT, SpbGetIdleTimerContext)
+
+//
+// The sampler polls Flags every SURFACE_BATTERY_FLAGS_POLL_INTERVAL_MS, up
+// to its tolerable delay late. The default idle timeout outlasts that gap,
+// so the sampler cadence keeps the target open while the device is in D0
+// and the target only closes once the sampler stopped. A shorter timeout
+// would close and reopen the target through the resource hub on every
+// poll, about 1800 times an hour.
+//
+// The lazy close therefore saves nothing in D0. It only matters outside
+// D0, where the odd class query or IOCTL would otherwise leave the target
+// open indefinitely. The TargetOpens and TargetOpenTime counters show how
+// often it actually fires.
+//
+#define SPB_TARGET_IDLE_TIMEOUT_MS \
+	(2 * (SURFACE_BATTERY_FLAGS_POLL_INTERVAL_MS + SURFACE_BATTERY_TIMER_TOLERABLE_DELAY_MS))
+#define SPB_TARGET_IDLE_TIMEOUT_VALUE_NAME L"SpbIdleTimeoutMs"
+
+EVT_WDF_TIMER SpbTargetIdleTimer;
+
+VOID
+SpbLockBus(
+	IN SPB_CONTEXT* SpbContext
 )
 /*++
 
   Routine Description:
 
-	This helper routine abstracts creating and sending an I/O
-	request (I2C Write) to the Spb I/O target.
+	This helper routine acquires the bus shared with the other devices on
+	the controller, then the SPB lock.
 
   Arguments:
 
 	SpbContext - Pointer to the current device context
-	Address    - The I2C register address to write to
-	Data       - A buffer to receive the data at at the above address
-	Length     - The amount of data to be read from the above address
 
   Return Value:
 
-	NTSTATUS Status indicating success or failure
+	None
 
 --*/
 {
-	PUCHAR buffer;
-	ULONG length;
-	WDFMEMORY memory;
-	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
-	NTSTATUS status;
-
-	//
-	// The address pointer and data buffer must be combined
-	// into one contiguous buffer representing the write transaction.
-	//
-	length = Length + 1;
-	memory = NULL;
-
-	if (length > DEFAULT_SPB_BUFFER_SIZE)
-	{
-		status = WdfMemoryCreate(
-			WDF_NO_OBJECT_ATTRIBUTES,
-			NonPagedPool,
-			SPB_POOL_TAG,
-			length,
-			&memory,
-			&buffer);
-
-		if (!NT_SUCCESS(status))
-		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				SURFACE_BATTERY_ERROR,
-				"Error allocating memory for Spb write - 0x%08lX",
-				status);
-			goto exit;
-		}
-
-		WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(
-			&memoryDescriptor,
-			memory,
-			NULL);
-	}
-	else
-	{
-		buffer = (PUCHAR)WdfMemoryGetBuffer(SpbContext->WriteMemory, NULL);
-
-		WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
-			&memoryDescriptor,
-			(PVOID)buffer,
-			length);
-	}
-
-	//
-	// Transaction starts by specifying the address bytes
-	//
-	RtlCopyMemory(buffer, &Address, sizeof(Address));
-
-	//
-	// Address is followed by the data payload
-	//
-	RtlCopyMemory((buffer + sizeof(Address)), Data, length - sizeof(Address));
-
-#if I2C_VERBOSE_LOGGING
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CWRITE: LENGTH=%d", length);
-	for (ULONG j = 0; j < length; j++)
-	{
-		UCHAR byte = *(buffer + j);
-		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
-	}
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
-#endif
-
-	status = WdfIoTargetSendWriteSynchronously(
-		SpbContext->SpbIoTarget,
-		NULL,
-		&memoryDescriptor,
-		NULL,
-		NULL,
-		NULL);
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			SURFACE_BATTERY_ERROR,
-			"Error writing to Spb - 0x%08lX",
-			status);
-		goto exit;
-	}
-
-exit:
-
-	if (NULL != memory)
+	if (SpbContext->Bus != NULL)
 	{
-		WdfObjectDelete(memory);
+		WdfWaitLockAcquire(SpbContext->Bus->Lock, NULL);
 	}
 
-	return status;
+	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
 }
 
-NTSTATUS
-SpbWriteDataSynchronously(
-	IN SPB_CONTEXT* SpbContext,
-	IN UCHAR Address,
-	IN PVOID Data,
-	IN ULONG Length
+VOID
+SpbUnlockBus(
+	IN SPB_CONTEXT* SpbContext
 )
 /*++
 
   Routine Description:
 
-	This routine abstracts creating and sending an I/O
-	request (I2C Write) to the Spb I/O target and utilizes
-	a helper routine to do work inside of locked code.
+	This helper routine releases the locks taken by SpbLockBus.
 
   Arguments:
 
 	SpbContext - Pointer to the current device context
-	Address    - The I2C register address to write to
-	Data       - A buffer to receive the data at at the above address
-	Length     - The amount of data to be read from the above address
 
   Return Value:
 
-	NTSTATUS Status indicating success or failure
+	None
 
 --*/
 {
-	NTSTATUS status;
-
-	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
-
-	status = SpbDoWriteDataSynchronously(
-		SpbContext,
-		Address,
-		Data,
-		Length);
-
 	WdfWaitLockRelease(SpbContext->SpbLock);
 
-	return status;
+	if (SpbContext->Bus != NULL)
+	{
+		WdfWaitLockRelease(SpbContext->Bus->Lock);
+	}
 }
 
 NTSTATUS
-SpbReadDataSynchronously(
-	IN SPB_CONTEXT* SpbContext,
-	IN UCHAR Address,
-	_In_reads_bytes_(Length) PVOID Data,
-	IN ULONG Length
+SpbTargetOpen(
+	IN SPB_CONTEXT* SpbContext
 )
 /*++
 
   Routine Description:
 
-	This helper routine abstracts creating and sending an I/O
-	request (I2C Read) to the Spb I/O target.
+	This helper routine opens the Spb I/O target through the resource hub.
+	The caller holds the SPB lock.
 
   Arguments:
 
 	SpbContext - Pointer to the current device context
-	Address    - The I2C register address to read from
-	Data       - A buffer to receive the data at at the above address
-	Length     - The amount of data to be read from the above address
 
   Return Value:
 
@@ -221,161 +239,1279 @@ SpbReadDataSynchronously(
 
 --*/
 {
-	PUCHAR buffer;
-	WDFMEMORY memory;
-	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	WDF_IO_TARGET_OPEN_PARAMS openParams;
+	UNICODE_STRING spbDeviceName;
+	WCHAR spbDeviceNameBuffer[RESOURCE_HUB_PATH_SIZE];
+	LONGLONG start;
 	NTSTATUS status;
-	ULONG_PTR bytesRead;
 
-	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+	start = KeQueryPerformanceCounter(NULL).QuadPart;
 
-	memory = NULL;
-	status = STATUS_INVALID_PARAMETER;
-	bytesRead = 0;
+#if SPB_EMULATE_GAUGE
+	UNREFERENCED_PARAMETER(openParams);
+	UNREFERENCED_PARAMETER(spbDeviceName);
+	UNREFERENCED_PARAMETER(spbDeviceNameBuffer);
 
-	//
-	// Read transactions start by writing an address pointer
-	//
-	status = SpbDoWriteDataSynchronously(
-		SpbContext,
-		Address,
-		NULL,
-		0);
+	status = SpbEmulatorOpen(SpbContext);
+#else
+	RtlInitEmptyUnicodeString(
+		&spbDeviceName,
+		spbDeviceNameBuffer,
+		sizeof(spbDeviceNameBuffer));
+
+	status = RESOURCE_HUB_CREATE_PATH_FROM_ID(
+		&spbDeviceName,
+		SpbContext->I2cResHubId.LowPart,
+		SpbContext->I2cResHubId.HighPart);
 
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			SURFACE_BATTERY_ERROR,
-			"Error setting address pointer for Spb read - 0x%08lX",
+			"Error creating Spb resource hub path string - 0x%08lX",
 			status);
 		goto exit;
 	}
 
-	if (Length > DEFAULT_SPB_BUFFER_SIZE)
-	{
-		status = WdfMemoryCreate(
-			WDF_NO_OBJECT_ATTRIBUTES,
-			NonPagedPool,
-			SPB_POOL_TAG,
-			Length,
-			&memory,
-			&buffer);
-
-		if (!NT_SUCCESS(status))
-		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				SURFACE_BATTERY_ERROR,
-				"Error allocating memory for Spb read - 0x%08lX",
-				status);
-			goto exit;
-		}
-
-		WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(
-			&memoryDescriptor,
-			memory,
-			NULL);
-	}
-	else
-	{
-		buffer = (PUCHAR)WdfMemoryGetBuffer(SpbContext->ReadMemory, NULL);
-
-		WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
-			&memoryDescriptor,
-			(PVOID)buffer,
-			Length);
-	}
+	WDF_IO_TARGET_OPEN_PARAMS_INIT_OPEN_BY_NAME(
+		&openParams,
+		&spbDeviceName,
+		(GENERIC_READ | GENERIC_WRITE));
 
+	openParams.ShareAccess = 0;
+	openParams.CreateDisposition = FILE_OPEN;
+	openParams.FileAttributes = FILE_ATTRIBUTE_NORMAL;
 
-	status = WdfIoTargetSendReadSynchronously(
-		SpbContext->SpbIoTarget,
-		NULL,
-		&memoryDescriptor,
-		NULL,
-		NULL,
-		&bytesRead);
+	status = WdfIoTargetOpen(SpbContext->SpbIoTarget, &openParams);
+#endif
 
-	if (!NT_SUCCESS(status) ||
-		bytesRead != Length)
+	if (!NT_SUCCESS(status))
 	{
 		Trace(
 			TRACE_LEVEL_ERROR,
 			SURFACE_BATTERY_ERROR,
-			"Error reading from Spb - 0x%08lX",
+			"Error opening Spb target for communication - 0x%08lX",
 			status);
 		goto exit;
 	}
 
-#if I2C_VERBOSE_LOGGING
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CREAD: LENGTH=%d", Length);
-	for (ULONG j = 0; j < Length; j++)
-	{
-		UCHAR byte = *(buffer + j);
-		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
-	}
-	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
-#endif
-
-	//
-	// Copy back to the caller's buffer
-	//
-	RtlCopyMemory(Data, buffer, Length);
+	SpbContext->TargetOpen = TRUE;
+	WriteNoFence64(&SpbContext->OpenCount, SpbContext->OpenCount + 1);
+	WriteNoFence64(&SpbContext->OpenTime,
+		SpbContext->OpenTime + (KeQueryPerformanceCounter(NULL).QuadPart - start));
 
 exit:
-	if (NULL != memory)
-	{
-		WdfObjectDelete(memory);
-	}
-
-	WdfWaitLockRelease(SpbContext->SpbLock);
 
 	return status;
 }
 
 VOID
-SpbTargetDeinitialize(
-	IN WDFDEVICE FxDevice,
+SpbTargetClose(
 	IN SPB_CONTEXT* SpbContext
 )
 /*++
 
   Routine Description:
 
-	This helper routine is used to free any members added to the SPB_CONTEXT,
-	note the SPB I/O target is parented to the device and will be
-	closed and free'd when the device is removed.
+	This helper routine closes the Spb I/O target, so the controller can
+	idle. The caller holds the SPB lock.
 
   Arguments:
 
-	FxDevice   - Handle to the framework device object
 	SpbContext - Pointer to the current device context
 
   Return Value:
 
-	NTSTATUS Status indicating success or failure
+	None
 
 --*/
 {
-	UNREFERENCED_PARAMETER(FxDevice);
-	UNREFERENCED_PARAMETER(SpbContext);
+	if (!SpbContext->TargetOpen)
+	{
+		return;
+	}
+
+#if !SPB_EMULATE_GAUGE
+	WdfIoTargetClose(SpbContext->SpbIoTarget);
+#endif
+
+	SpbContext->TargetOpen = FALSE;
+}
+
+NTSTATUS
+SpbAcquireBus(
+	IN SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+
+	This helper routine locks the bus for a transfer and reopens the Spb
+	I/O target if it was closed while idle. Background transfers first
+	let the interactive transfers waiting for the bus go ahead.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure, the locks are held
+	either way
+
+--*/
+{
+	SPB_BUS* bus;
+	BOOLEAN interactive;
+	LARGE_INTEGER timeout;
+
+	bus = SpbContext->Bus;
+	interactive = SpbIsInteractive(SpbContext);
+	if (bus != NULL)
+	{
+		if (interactive)
+		{
+			if (InterlockedIncrement(&bus->InteractiveWaiters) == 1)
+			{
+				KeClearEvent(&bus->InteractiveIdle);
+			}
+		}
+		else if (ReadNoFence(&bus->InteractiveWaiters) != 0)
+		{
+			timeout.QuadPart = -10000LL * SPB_BACKGROUND_YIELD_MS;
+			KeWaitForSingleObject(
+				&bus->InteractiveIdle,
+				Executive,
+				KernelMode,
+				FALSE,
+				&timeout);
+		}
+	}
+
+	SpbLockBus(SpbContext);
+
+	if (bus != NULL && interactive)
+	{
+		if (InterlockedDecrement(&bus->InteractiveWaiters) == 0)
+		{
+			KeSetEvent(&bus->InteractiveIdle, IO_NO_INCREMENT, FALSE);
+		}
+	}
+
+	if (SpbContext->TargetOpen)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	return SpbTargetOpen(SpbContext);
+}
+
+VOID
+SpbReleaseBus(
+	IN SPB_CONTEXT* SpbContext,
+	IN LONGLONG Start
+)
+/*++
+
+  Routine Description:
+
+	This helper routine charges a transfer to the controller activity,
+	arms the idle timer of the target and releases the locks taken by
+	SpbAcquireBus.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Start      - Performance counter value when the transfer started
+
+  Return Value:
+
+	None
+
+--*/
+{
+	SPB_BUS* bus;
+	LARGE_INTEGER frequency;
+	LONGLONG end;
+
+	end = KeQueryPerformanceCounter(&frequency).QuadPart;
+	SpbContext->LastTransfer = end;
+	if (SpbContext->IdleTimer != NULL && SpbContext->TargetOpen)
+	{
+		WdfTimerStart(
+			SpbContext->IdleTimer,
+			WDF_REL_TIMEOUT_IN_MS(SpbContext->IdleTimeoutMs));
+	}
+
+	bus = SpbContext->Bus;
+	if (bus != NULL)
+	{
+		if (bus->LastActive == 0 ||
+			Start - bus->LastActive > frequency.QuadPart * SPB_BUS_IDLE_TIMEOUT_MS / 1000)
+		{
+			WriteNoFence64(&bus->Wakeups, bus->Wakeups + 1);
+		}
+
+		WriteNoFence64(&bus->ActiveTime, bus->ActiveTime + (end - Start));
+		WriteNoFence64(&bus->LastActive, end);
+	}
+
+	SpbUnlockBus(SpbContext);
+}
+
+VOID
+SpbTargetIdleTimer(
+	IN WDFTIMER Timer
+)
+/*++
+
+  Routine Description:
+
+	This routine closes the Spb I/O target once no transfer was issued for
+	the idle timeout. Every transfer restarts the timer, a transfer racing
+	with it is recognized by its timestamp.
+
+	While the sampler runs in D0 its polls restart the timer before it
+	expires, so the target is only closed once the sampler stopped.
+
+  Arguments:
+
+	Timer - Handle to the idle timer
+
+  Return Value:
+
+	None
+
+--*/
+{
+	LARGE_INTEGER frequency;
+	SPB_CONTEXT* spbContext;
+
+	spbContext = SpbGetIdleTimerContext(Timer)->SpbContext;
+	SpbLockBus(spbContext);
+
+	if (KeQueryPerformanceCounter(&frequency).QuadPart - spbContext->LastTransfer >=
+		frequency.QuadPart * spbContext->IdleTimeoutMs / 1000)
+	{
+		SpbTargetClose(spbContext);
+	}
+
+	SpbUnlockBus(spbContext);
+}
+
+NTSTATUS
+SpbBusAttach(
+	IN SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+
+	This helper routine joins the device to the bus of its controller,
+	creating the bus for the first device.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	SPB_BUS* bus;
+	PLIST_ENTRY entry;
+	NTSTATUS status;
+
+	status = STATUS_SUCCESS;
+	WdfWaitLockAcquire(SpbBusListLock, NULL);
+	for (entry = SpbBusList.Flink; entry != &SpbBusList; entry = entry->Flink)
+	{
+		bus = CONTAINING_RECORD(entry, SPB_BUS, Link);
+		if (bus->I2cResHubId.QuadPart == SpbContext->I2cResHubId.QuadPart)
+		{
+			bus->References += 1;
+			SpbContext->Bus = bus;
+			goto exit;
+		}
+	}
+
+	bus = (SPB_BUS*)ExAllocatePool2(
+		POOL_FLAG_NON_PAGED,
+		sizeof(SPB_BUS),
+		SPB_POOL_TAG);
+
+	if (bus == NULL)
+	{
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto exit;
+	}
+
+	status = WdfWaitLockCreate(
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&bus->Lock);
+
+	if (!NT_SUCCESS(status))
+	{
+		ExFreePoolWithTag(bus, SPB_POOL_TAG);
+		goto exit;
+	}
+
+	bus->I2cResHubId = SpbContext->I2cResHubId;
+	bus->References = 1;
+	bus->InteractiveWaiters = 0;
+	KeInitializeEvent(&bus->InteractiveIdle, NotificationEvent, TRUE);
+	InsertTailList(&SpbBusList, &bus->Link);
+	SpbContext->Bus = bus;
+
+exit:
+	WdfWaitLockRelease(SpbBusListLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SURFACE_BATTERY_ERROR,
+			"Error creating Spb bus - 0x%08lX",
+			status);
+	}
+
+	return status;
+}
+
+VOID
+SpbBusDetach(
+	IN SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+
+	This helper routine leaves the bus, freeing it with the last device.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+
+  Return Value:
+
+	None
+
+--*/
+{
+	SPB_BUS* bus;
+
+	bus = SpbContext->Bus;
+	if (bus == NULL)
+	{
+		return;
+	}
+
+	SpbContext->Bus = NULL;
+	WdfWaitLockAcquire(SpbBusListLock, NULL);
+	bus->References -= 1;
+	if (bus->References == 0)
+	{
+		RemoveEntryList(&bus->Link);
+	}
+	else
+	{
+		bus = NULL;
+	}
+
+	WdfWaitLockRelease(SpbBusListLock);
+
+	if (bus != NULL)
+	{
+		WdfObjectDelete(bus->Lock);
+		ExFreePoolWithTag(bus, SPB_POOL_TAG);
+	}
+}
+
+VOID
+SpbCaptureRecord(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Direction,
+	IN UCHAR Address,
+	_In_reads_bytes_opt_(Length) PVOID Data,
+	IN ULONG Length,
+	IN LONGLONG Start,
+	IN NTSTATUS Status
+)
+/*++
+
+  Routine Description:
+
+	This helper routine appends a transfer to the capture ring, if a
+	capture is running. The caller must hold the SPB lock.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Direction  - SURFACE_BATTERY_BUS_READ or SURFACE_BATTERY_BUS_WRITE
+	Address    - The I2C register address of the transfer
+	Data       - The transferred data, NULL if none was transferred
+	Length     - The length of the transfer
+	Start      - Performance counter value when the transfer started
+	Status     - Status of the transfer
+
+  Return Value:
+
+	None
+
+--*/
+{
+	SPB_CAPTURE* capture;
+	PSURFACE_BATTERY_BUS_RECORD record;
+
+	capture = SpbContext->Capture;
+	if (capture == NULL)
+	{
+		return;
+	}
+
+	record = &capture->Records[capture->Head];
+	capture->Head = (capture->Head + 1) % SURFACE_BATTERY_BUS_CAPTURE_RECORDS;
+	if (capture->Count == SURFACE_BATTERY_BUS_CAPTURE_RECORDS)
+	{
+		capture->Dropped += 1;
+	}
+	else
+	{
+		capture->Count += 1;
+	}
+
+	record->Timestamp = Start;
+	record->Duration = (ULONG)(KeQueryPerformanceCounter(NULL).QuadPart - Start);
+	record->Status = Status;
+	record->Address = Address;
+	record->Direction = Direction;
+	record->Length = (USHORT)Length;
+	RtlZeroMemory(record->Data, sizeof(record->Data));
+	if (Data != NULL)
+	{
+		RtlCopyMemory(record->Data, Data, min(Length, sizeof(record->Data)));
+	}
+}
+
+NTSTATUS
+SpbDoWriteDataSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	IN PVOID Data,
+	IN ULONG Length
+)
+/*++
+
+  Routine Description:
+
+	This helper routine abstracts creating and sending an I/O
+	request (I2C Write) to the Spb I/O target.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to write to
+	Data       - A buffer to receive the data at at the above address
+	Length     - The amount of data to be read from the above address
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	PUCHAR buffer;
+	ULONG length;
+	WDFMEMORY memory;
+	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	NTSTATUS status;
+
+	//
+	// The address pointer and data buffer must be combined
+	// into one contiguous buffer representing the write transaction.
+	//
+	length = Length + 1;
+	memory = NULL;
+
+	if (length > DEFAULT_SPB_BUFFER_SIZE)
+	{
+		status = WdfMemoryCreate(
+			WDF_NO_OBJECT_ATTRIBUTES,
+			NonPagedPool,
+			SPB_POOL_TAG,
+			length,
+			&memory,
+			&buffer);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				SURFACE_BATTERY_ERROR,
+				"Error allocating memory for Spb write - 0x%08lX",
+				status);
+			goto exit;
+		}
+
+		WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(
+			&memoryDescriptor,
+			memory,
+			NULL);
+	}
+	else
+	{
+		buffer = (PUCHAR)WdfMemoryGetBuffer(SpbContext->WriteMemory, NULL);
+
+		WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
+			&memoryDescriptor,
+			(PVOID)buffer,
+			length);
+	}
+
+	//
+	// Transaction starts by specifying the address bytes
+	//
+	RtlCopyMemory(buffer, &Address, sizeof(Address));
+
+	//
+	// Address is followed by the data payload
+	//
+	RtlCopyMemory((buffer + sizeof(Address)), Data, length - sizeof(Address));
+
+#if I2C_VERBOSE_LOGGING
+	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CWRITE: LENGTH=%d", length);
+	for (ULONG j = 0; j < length; j++)
+	{
+		UCHAR byte = *(buffer + j);
+		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
+	}
+	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
+#endif
+
+#if SPB_EMULATE_GAUGE
+	status = SpbEmulatorWrite(SpbContext, buffer, length);
+#else
+	status = WdfIoTargetSendWriteSynchronously(
+		SpbContext->SpbIoTarget,
+		NULL,
+		&memoryDescriptor,
+		NULL,
+		NULL,
+		NULL);
+#endif
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SURFACE_BATTERY_ERROR,
+			"Error writing to Spb - 0x%08lX",
+			status);
+		goto exit;
+	}
+
+exit:
+
+	if (NULL != memory)
+	{
+		WdfObjectDelete(memory);
+	}
+
+	return status;
+}
+
+NTSTATUS
+SpbWriteDataSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	IN PVOID Data,
+	IN ULONG Length
+)
+/*++
+
+  Routine Description:
+
+	This routine abstracts creating and sending an I/O
+	request (I2C Write) to the Spb I/O target and utilizes
+	a helper routine to do work inside of locked code.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to write to
+	Data       - A buffer to receive the data at at the above address
+	Length     - The amount of data to be read from the above address
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	SURFACE_BATTERY_ACTIVITY activity;
+	LONGLONG start;
+	NTSTATUS status;
+
+	if (SpbContext->SpbLock == NULL)
+	{
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	SpbActivityStart(&activity, "SpbWrite", Address, Length);
+	status = SpbAcquireBus(SpbContext);
+
+	start = KeQueryPerformanceCounter(NULL).QuadPart;
+	if (NT_SUCCESS(status))
+	{
+		status = SpbDoWriteDataSynchronously(
+			SpbContext,
+			Address,
+			Data,
+			Length);
+	}
+
+	SpbCaptureRecord(
+		SpbContext,
+		SURFACE_BATTERY_BUS_WRITE,
+		Address,
+		Data,
+		Length,
+		start,
+		status);
+
+	SpbReleaseBus(SpbContext, start);
+
+	SpbAccountCall(SpbContext, Length, start, Length + 1 > DEFAULT_SPB_BUFFER_SIZE);
+
+	if (NT_SUCCESS(status))
+	{
+		SpbCountTransfer(SpbContext, Length);
+	}
+
+	SpbActivityStop(&activity, "SpbWrite", status);
+	return status;
+}
+
+NTSTATUS
+SpbDoReadSequenceSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	_Out_writes_bytes_(Length) PUCHAR Buffer,
+	IN ULONG Length,
+	OUT PULONG_PTR BytesRead
+)
+/*++
+
+  Routine Description:
+
+	This helper routine sends the address pointer write and the read as
+	one I2C transaction with a repeated start (IOCTL_SPB_EXECUTE_SEQUENCE),
+	instead of two transactions.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to read from
+	Buffer     - A buffer to receive the data at the above address
+	Length     - The amount of data to be read from the above address
+	BytesRead  - Receives the amount of data read
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	SPB_TRANSFER_LIST_AND_ENTRIES(2) sequence;
+	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	ULONG_PTR bytesTransferred;
+	NTSTATUS status;
+
+	*BytesRead = 0;
+	bytesTransferred = 0;
+
+#if SPB_EMULATE_GAUGE
+	UNREFERENCED_PARAMETER(sequence);
+	UNREFERENCED_PARAMETER(memoryDescriptor);
+
+	status = SpbEmulatorWriteRead(SpbContext, Address, Buffer, Length);
+	if (NT_SUCCESS(status))
+	{
+		bytesTransferred = sizeof(Address) + Length;
+	}
+#else
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), 2);
+	sequence.List.Transfers[0] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+		SpbTransferDirectionToDevice,
+		0,
+		&Address,
+		sizeof(Address));
+
+	sequence.List.Transfers[1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+		SpbTransferDirectionFromDevice,
+		0,
+		Buffer,
+		Length);
+
+	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
+		&memoryDescriptor,
+		(PVOID)&sequence,
+		sizeof(sequence));
+
+	status = WdfIoTargetSendIoctlSynchronously(
+		SpbContext->SpbIoTarget,
+		NULL,
+		IOCTL_SPB_EXECUTE_SEQUENCE,
+		&memoryDescriptor,
+		NULL,
+		NULL,
+		&bytesTransferred);
+#endif
+
+	//
+	// The sequence reports the bytes of both transfers
+	//
+	if (NT_SUCCESS(status) &&
+		bytesTransferred > sizeof(Address))
+	{
+		*BytesRead = bytesTransferred - sizeof(Address);
+	}
+
+	return status;
+}
+
+NTSTATUS
+SpbDoCommandSequenceSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	_In_reads_(Count) const UINT16* Commands,
+	IN ULONG Count,
+	IN ULONG DelayInUs,
+	_Out_writes_(Count) PUINT16 Results
+)
+/*++
+
+  Routine Description:
+
+	This helper routine sends every command and the read of its result as
+	one sequence. The controller waits DelayInUs before each result is
+	read, so the delays do not stall the processor.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address commands are written to
+	Commands   - The 16 bit commands to issue
+	Count      - The number of commands, at most SPB_MAX_COMMANDS
+	DelayInUs  - The time the device needs before a result can be read
+	Results    - A buffer to receive the 16 bit result of every command
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	SPB_TRANSFER_LIST_AND_ENTRIES(SPB_MAX_COMMANDS * 3) sequence;
+	UCHAR writes[SPB_MAX_COMMANDS][3];
+	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	ULONG_PTR bytesTransferred;
+	NTSTATUS status;
+	ULONG i;
+
+	for (i = 0; i < Count; i++)
+	{
+		writes[i][0] = Address;
+		writes[i][1] = (UCHAR)(Commands[i] & 0xFF);
+		writes[i][2] = (UCHAR)(Commands[i] >> 8);
+	}
+
+#if SPB_EMULATE_GAUGE
+	UNREFERENCED_PARAMETER(sequence);
+	UNREFERENCED_PARAMETER(memoryDescriptor);
+	UNREFERENCED_PARAMETER(bytesTransferred);
+	UNREFERENCED_PARAMETER(DelayInUs);
+
+	status = STATUS_SUCCESS;
+	for (i = 0; i < Count && NT_SUCCESS(status); i++)
+	{
+		status = SpbEmulatorWrite(SpbContext, writes[i], sizeof(writes[i]));
+		if (NT_SUCCESS(status))
+		{
+			status = SpbEmulatorWriteRead(SpbContext, Address, (PUCHAR)&Results[i], sizeof(UINT16));
+		}
+	}
+#else
+	//
+	// Every command takes three transfers: the command write, the register
+	// pointer write after the delay and the read of the result.
+	//
+	SPB_TRANSFER_LIST_INIT(&(sequence.List), Count * 3);
+	for (i = 0; i < Count; i++)
+	{
+		sequence.List.Transfers[i * 3] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionToDevice,
+			0,
+			writes[i],
+			sizeof(writes[i]));
+
+		sequence.List.Transfers[i * 3 + 1] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionToDevice,
+			DelayInUs,
+			writes[i],
+			sizeof(Address));
+
+		sequence.List.Transfers[i * 3 + 2] = SPB_TRANSFER_LIST_ENTRY_INIT_SIMPLE(
+			SpbTransferDirectionFromDevice,
+			0,
+			&Results[i],
+			sizeof(UINT16));
+	}
+
+	WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
+		&memoryDescriptor,
+		(PVOID)&sequence,
+		sizeof(sequence));
+
+	bytesTransferred = 0;
+	status = WdfIoTargetSendIoctlSynchronously(
+		SpbContext->SpbIoTarget,
+		NULL,
+		IOCTL_SPB_EXECUTE_SEQUENCE,
+		&memoryDescriptor,
+		NULL,
+		NULL,
+		&bytesTransferred);
+
+	if (NT_SUCCESS(status) &&
+		bytesTransferred != Count * (sizeof(writes[0]) + sizeof(Address) + sizeof(UINT16)))
+	{
+		status = STATUS_DEVICE_PROTOCOL_ERROR;
+	}
+#endif
+
+	return status;
+}
+
+NTSTATUS
+SpbReadDataSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	_In_reads_bytes_(Length) PVOID Data,
+	IN ULONG Length
+)
+/*++
+
+  Routine Description:
+
+	This helper routine abstracts creating and sending an I/O
+	request (I2C Read) to the Spb I/O target. Long background
+	reads on a shared bus are issued in chunks.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address to read from
+	Data       - A buffer to receive the data at at the above address
+	Length     - The amount of data to be read from the above address
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	SURFACE_BATTERY_ACTIVITY activity;
+	PUCHAR buffer;
+	WDFMEMORY memory;
+	WDF_MEMORY_DESCRIPTOR memoryDescriptor;
+	LONGLONG start;
+	NTSTATUS status;
+	ULONG_PTR bytesRead;
+	ULONG offset;
+
+	if (SpbContext->SpbLock == NULL)
+	{
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	if (Length > SPB_BACKGROUND_CHUNK_SIZE &&
+		SpbContext->Bus != NULL &&
+		SpbContext->Bus->References > 1 &&
+		!SpbIsInteractive(SpbContext))
+	{
+		status = STATUS_SUCCESS;
+		for (offset = 0; offset < Length && NT_SUCCESS(status); offset += SPB_BACKGROUND_CHUNK_SIZE)
+		{
+			status = SpbReadDataSynchronously(
+				SpbContext,
+				(UCHAR)(Address + offset),
+				(PUCHAR)Data + offset,
+				min(Length - offset, SPB_BACKGROUND_CHUNK_SIZE));
+		}
+
+		return status;
+	}
+
+	SpbActivityStart(&activity, "SpbRead", Address, Length);
+	status = SpbAcquireBus(SpbContext);
+
+	start = KeQueryPerformanceCounter(NULL).QuadPart;
+	memory = NULL;
+	bytesRead = 0;
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = STATUS_INVALID_PARAMETER;
+
+	if (Length > DEFAULT_SPB_BUFFER_SIZE)
+	{
+		status = WdfMemoryCreate(
+			WDF_NO_OBJECT_ATTRIBUTES,
+			NonPagedPool,
+			SPB_POOL_TAG,
+			Length,
+			&memory,
+			&buffer);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				SURFACE_BATTERY_ERROR,
+				"Error allocating memory for Spb read - 0x%08lX",
+				status);
+			goto exit;
+		}
+
+		WDF_MEMORY_DESCRIPTOR_INIT_HANDLE(
+			&memoryDescriptor,
+			memory,
+			NULL);
+	}
+	else
+	{
+		buffer = (PUCHAR)WdfMemoryGetBuffer(SpbContext->ReadMemory, NULL);
+
+		WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(
+			&memoryDescriptor,
+			(PVOID)buffer,
+			Length);
+	}
+
+	//
+	// Read transactions start by writing an address pointer. Both are sent
+	// as one sequence with a repeated start, unless the controller already
+	// refused sequences.
+	//
+	if (!SpbContext->SequenceUnsupported)
+	{
+		status = SpbDoReadSequenceSynchronously(
+			SpbContext,
+			Address,
+			buffer,
+			Length,
+			&bytesRead);
+
+		if (status == STATUS_NOT_SUPPORTED ||
+			status == STATUS_INVALID_DEVICE_REQUEST)
+		{
+			Trace(
+				TRACE_LEVEL_WARNING,
+				SURFACE_BATTERY_WARN,
+				"Spb controller does not support sequences - 0x%08lX",
+				status);
+			SpbContext->SequenceUnsupported = TRUE;
+		}
+	}
+
+	if (SpbContext->SequenceUnsupported)
+	{
+		status = SpbDoWriteDataSynchronously(
+			SpbContext,
+			Address,
+			NULL,
+			0);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				SURFACE_BATTERY_ERROR,
+				"Error setting address pointer for Spb read - 0x%08lX",
+				status);
+			goto exit;
+		}
+
+#if SPB_EMULATE_GAUGE
+		status = SpbEmulatorRead(SpbContext, buffer, Length);
+		bytesRead = NT_SUCCESS(status) ? Length : 0;
+#else
+		status = WdfIoTargetSendReadSynchronously(
+			SpbContext->SpbIoTarget,
+			NULL,
+			&memoryDescriptor,
+			NULL,
+			NULL,
+			&bytesRead);
+#endif
+	}
+
+	if (!NT_SUCCESS(status) ||
+		bytesRead != Length)
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			SURFACE_BATTERY_ERROR,
+			"Error reading from Spb - 0x%08lX",
+			status);
+		goto exit;
+	}
+
+#if I2C_VERBOSE_LOGGING
+	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "I2CREAD: LENGTH=%d", Length);
+	for (ULONG j = 0; j < Length; j++)
+	{
+		UCHAR byte = *(buffer + j);
+		DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, " %02hhX", byte);
+	}
+	DbgPrintEx(DPFLTR_IHVDRIVER_ID, DPFLTR_ERROR_LEVEL, "\n");
+#endif
+
+	//
+	// Copy back to the caller's buffer
+	//
+	RtlCopyMemory(Data, buffer, Length);
+	SpbCountTransfer(SpbContext, Length);
+
+exit:
+	SpbCaptureRecord(
+		SpbContext,
+		SURFACE_BATTERY_BUS_READ,
+		Address,
+		NT_SUCCESS(status) ? Data : NULL,
+		Length,
+		start,
+		status);
+
+	if (NULL != memory)
+	{
+		WdfObjectDelete(memory);
+	}
+
+	SpbReleaseBus(SpbContext, start);
+
+	SpbAccountCall(SpbContext, Length, start, Length > DEFAULT_SPB_BUFFER_SIZE);
+	SpbActivityStop(&activity, "SpbRead", status);
+	return status;
+}
+
+NTSTATUS
+SpbReadCommandsSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	_In_reads_(Count) const UINT16* Commands,
+	IN ULONG Count,
+	IN ULONG DelayInUs,
+	_Out_writes_(Count) PUINT16 Results
+)
+/*++
+
+  Routine Description:
+
+	This routine writes every command to the register at Address and reads
+	its 16 bit result back from the same register. The commands are sent
+	as one sequence, or one by one if the controller refused sequences.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	Address    - The I2C register address commands are written to
+	Commands   - The 16 bit commands to issue
+	Count      - The number of commands, at most SPB_MAX_COMMANDS
+	DelayInUs  - The time the device needs before a result can be read
+	Results    - A buffer to receive the 16 bit result of every command
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	SURFACE_BATTERY_ACTIVITY activity;
+	LONGLONG start;
+	NTSTATUS status;
+	ULONG i;
+
+	if (Count == 0 || Count > SPB_MAX_COMMANDS)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (SpbContext->SpbLock == NULL)
+	{
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	RtlZeroMemory(Results, Count * sizeof(UINT16));
+	if (!SpbContext->SequenceUnsupported)
+	{
+		SpbActivityStart(&activity, "SpbCommands", Address, Count * sizeof(UINT16));
+		status = SpbAcquireBus(SpbContext);
+
+		start = KeQueryPerformanceCounter(NULL).QuadPart;
+		if (NT_SUCCESS(status))
+		{
+			status = SpbDoCommandSequenceSynchronously(
+				SpbContext,
+				Address,
+				Commands,
+				Count,
+				DelayInUs,
+				Results);
+		}
+
+		SpbCaptureRecord(
+			SpbContext,
+			SURFACE_BATTERY_BUS_READ,
+			Address,
+			NT_SUCCESS(status) ? Results : NULL,
+			Count * sizeof(UINT16),
+			start,
+			status);
+
+		SpbReleaseBus(SpbContext, start);
+
+		SpbAccountCall(SpbContext, Count * sizeof(UINT16), start, FALSE);
+		if (NT_SUCCESS(status))
+		{
+			SpbCountTransfer(SpbContext, Count * sizeof(UINT16));
+		}
+
+		SpbActivityStop(&activity, "SpbCommands", status);
+		if (status != STATUS_NOT_SUPPORTED &&
+			status != STATUS_INVALID_DEVICE_REQUEST)
+		{
+			return status;
+		}
+
+		Trace(
+			TRACE_LEVEL_WARNING,
+			SURFACE_BATTERY_WARN,
+			"Spb controller does not support sequences - 0x%08lX",
+			status);
+		SpbContext->SequenceUnsupported = TRUE;
+	}
+
+	//
+	// Separate transactions are spaced by far more than any command delay
+	// on a 100 kHz bus.
+	//
+	status = STATUS_SUCCESS;
+	for (i = 0; i < Count && NT_SUCCESS(status); i++)
+	{
+		status = SpbWriteDataSynchronously(
+			SpbContext,
+			Address,
+			(PVOID)&Commands[i],
+			sizeof(UINT16));
+
+		if (NT_SUCCESS(status))
+		{
+			status = SpbReadDataSynchronously(
+				SpbContext,
+				Address,
+				&Results[i],
+				sizeof(UINT16));
+		}
+	}
+
+	return status;
+}
+
+VOID
+SpbTargetDeinitialize(
+	IN WDFDEVICE FxDevice,
+	IN SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+
+	This helper routine is used to free any members added to the SPB_CONTEXT,
+	closes the SPB I/O target and leaves the bus. It runs when the device
+	releases its hardware and on a failed initialization. Transfers and
+	capture calls issued afterwards fail, the caller keeps them out while it
+	runs by holding the lock they are all issued under.
+
+  Arguments:
+
+	FxDevice   - Handle to the framework device object
+	SpbContext - Pointer to the current device context
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	UNREFERENCED_PARAMETER(FxDevice);
+	UNREFERENCED_PARAMETER(SpbContext);
 
 	//
 	// Free any SPB_CONTEXT allocations here
 	//
+	if (SpbContext->IdleTimer != NULL)
+	{
+		WdfTimerStop(SpbContext->IdleTimer, TRUE);
+		WdfObjectDelete(SpbContext->IdleTimer);
+		SpbContext->IdleTimer = NULL;
+	}
+
+	if (SpbContext->SpbLock != NULL)
+	{
+		SpbLockBus(SpbContext);
+		SpbTargetClose(SpbContext);
+		SpbUnlockBus(SpbContext);
+	}
+
+#if SPB_EMULATE_GAUGE
+	SpbEmulatorDestroy(SpbContext);
+#endif
+
+	SpbCaptureStop(SpbContext);
+	SpbBusDetach(SpbContext);
+
+#if !SPB_EMULATE_GAUGE
+	if (SpbContext->SpbIoTarget != NULL)
+	{
+		WdfObjectDelete(SpbContext->SpbIoTarget);
+		SpbContext->SpbIoTarget = NULL;
+	}
+#endif
+
 	if (SpbContext->SpbLock != NULL)
 	{
 		WdfObjectDelete(SpbContext->SpbLock);
+		SpbContext->SpbLock = NULL;
 	}
 
 	if (SpbContext->ReadMemory != NULL)
 	{
 		WdfObjectDelete(SpbContext->ReadMemory);
+		SpbContext->ReadMemory = NULL;
 	}
 
 	if (SpbContext->WriteMemory != NULL)
 	{
 		WdfObjectDelete(SpbContext->WriteMemory);
+		SpbContext->WriteMemory = NULL;
 	}
 }
 
@@ -388,9 +1524,10 @@ SpbTargetInitialize(
 
   Routine Description:
 
-	This helper routine opens the Spb I/O target and
-	initializes a request object used for the lifetime
-	of communication between this driver and Spb.
+	This helper routine creates the Spb I/O target, opens
+	it once and initializes the buffers and the idle timer
+	used for the lifetime of communication between this
+	driver and Spb.
 
   Arguments:
 
@@ -402,13 +1539,24 @@ SpbTargetInitialize(
 	NTSTATUS Status indicating success or failure
 
 --*/
-{
-	WDF_OBJECT_ATTRIBUTES objectAttributes;
-	WDF_IO_TARGET_OPEN_PARAMS openParams;
-	UNICODE_STRING spbDeviceName;
-	WCHAR spbDeviceNameBuffer[RESOURCE_HUB_PATH_SIZE];
+{
+	WDF_OBJECT_ATTRIBUTES objectAttributes;
+	WDFKEY key;
+	WDF_TIMER_CONFIG timerConfig;
 	NTSTATUS status;
+	DECLARE_CONST_UNICODE_STRING(idleTimeoutName, SPB_TARGET_IDLE_TIMEOUT_VALUE_NAME);
+
+#if SPB_EMULATE_GAUGE
+	//
+	// The emulated gauge replaces the I/O target
+	//
+	status = SpbEmulatorCreate(SpbContext);
 
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+#else
 	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
 	objectAttributes.ParentObject = FxDevice;
 
@@ -425,50 +1573,10 @@ SpbTargetInitialize(
 			"Error creating IoTarget object - 0x%08lX",
 			status);
 
-		WdfObjectDelete(SpbContext->SpbIoTarget);
-		goto exit;
-	}
-
-	RtlInitEmptyUnicodeString(
-		&spbDeviceName,
-		spbDeviceNameBuffer,
-		sizeof(spbDeviceNameBuffer));
-
-	status = RESOURCE_HUB_CREATE_PATH_FROM_ID(
-		&spbDeviceName,
-		SpbContext->I2cResHubId.LowPart,
-		SpbContext->I2cResHubId.HighPart);
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			SURFACE_BATTERY_ERROR,
-			"Error creating Spb resource hub path string - 0x%08lX",
-			status);
-		goto exit;
-	}
-
-	WDF_IO_TARGET_OPEN_PARAMS_INIT_OPEN_BY_NAME(
-		&openParams,
-		&spbDeviceName,
-		(GENERIC_READ | GENERIC_WRITE));
-
-	openParams.ShareAccess = 0;
-	openParams.CreateDisposition = FILE_OPEN;
-	openParams.FileAttributes = FILE_ATTRIBUTE_NORMAL;
-
-	status = WdfIoTargetOpen(SpbContext->SpbIoTarget, &openParams);
-
-	if (!NT_SUCCESS(status))
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			SURFACE_BATTERY_ERROR,
-			"Error opening Spb target for communication - 0x%08lX",
-			status);
+		SpbContext->SpbIoTarget = NULL;
 		goto exit;
 	}
+#endif
 
 	//
 	// Allocate some fixed-size buffers from NonPagedPool for typical
@@ -527,6 +1635,84 @@ SpbTargetInitialize(
 		goto exit;
 	}
 
+	status = SpbBusAttach(SpbContext);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	//
+	// Open the target once to validate the connection. It is closed again
+	// by the idle timer and reopened by the next transfer, the registry can
+	// override the idle timeout and 0 keeps the target open.
+	//
+	SpbContext->IdleTimeoutMs = SPB_TARGET_IDLE_TIMEOUT_MS;
+	status = WdfDeviceOpenRegistryKey(
+		FxDevice,
+		PLUGPLAY_REGKEY_DEVICE,
+		KEY_READ,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&key);
+
+	if (NT_SUCCESS(status))
+	{
+		WdfRegistryQueryULong(
+			key,
+			&idleTimeoutName,
+			&SpbContext->IdleTimeoutMs);
+
+		WdfRegistryClose(key);
+	}
+
+	if (SpbContext->IdleTimeoutMs != 0)
+	{
+		//
+		// Closing the target late only delays the idle of the controller,
+		// let the timer coalesce with anything expiring up to one more
+		// timeout later.
+		//
+		WDF_TIMER_CONFIG_INIT(&timerConfig, SpbTargetIdleTimer);
+		timerConfig.AutomaticSerialization = FALSE;
+		timerConfig.TolerableDelay = SpbContext->IdleTimeoutMs;
+
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(
+			&objectAttributes,
+			SPB_IDLE_TIMER_CONTEXT);
+
+		objectAttributes.ParentObject = FxDevice;
+		objectAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+		status = WdfTimerCreate(
+			&timerConfig,
+			&objectAttributes,
+			&SpbContext->IdleTimer);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				SURFACE_BATTERY_ERROR,
+				"Error creating Spb idle timer - 0x%08lX",
+				status);
+			goto exit;
+		}
+
+		SpbGetIdleTimerContext(SpbContext->IdleTimer)->SpbContext = SpbContext;
+	}
+
+	SpbLockBus(SpbContext);
+	status = SpbTargetOpen(SpbContext);
+	SpbContext->LastTransfer = KeQueryPerformanceCounter(NULL).QuadPart;
+	if (SpbContext->IdleTimer != NULL && SpbContext->TargetOpen)
+	{
+		WdfTimerStart(
+			SpbContext->IdleTimer,
+			WDF_REL_TIMEOUT_IN_MS(SpbContext->IdleTimeoutMs));
+	}
+
+	SpbUnlockBus(SpbContext);
+
 exit:
 
 	if (!NT_SUCCESS(status))
@@ -535,4 +1721,286 @@ exit:
 	}
 
 	return status;
-}
\ No newline at end of file
+}
+
+NTSTATUS
+SpbCaptureStart(
+	IN SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+
+	This routine starts recording transfers, or empties the ring of a
+	capture that is already running.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	SPB_CAPTURE* capture;
+
+	if (SpbContext->SpbLock == NULL)
+	{
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	//
+	// Allocate outside the lock so transfers are not held up, a concurrent
+	// start simply frees the loser's ring.
+	//
+	capture = (SPB_CAPTURE*)ExAllocatePool2(
+		POOL_FLAG_NON_PAGED,
+		sizeof(SPB_CAPTURE),
+		SPB_POOL_TAG);
+
+	if (capture == NULL)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+	if (SpbContext->Capture == NULL)
+	{
+		SpbContext->Capture = capture;
+		capture = NULL;
+	}
+	else
+	{
+		SpbContext->Capture->Head = 0;
+		SpbContext->Capture->Count = 0;
+		SpbContext->Capture->Dropped = 0;
+	}
+
+	WdfWaitLockRelease(SpbContext->SpbLock);
+
+	if (capture != NULL)
+	{
+		ExFreePoolWithTag(capture, SPB_POOL_TAG);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+SpbCaptureStop(
+	IN SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+
+	This routine stops recording transfers and frees the capture ring,
+	including any records not read yet.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+
+  Return Value:
+
+	None
+
+--*/
+{
+	SPB_CAPTURE* capture;
+
+	if (SpbContext->SpbLock == NULL)
+	{
+		return;
+	}
+
+	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+	capture = SpbContext->Capture;
+	SpbContext->Capture = NULL;
+	WdfWaitLockRelease(SpbContext->SpbLock);
+
+	if (capture != NULL)
+	{
+		ExFreePoolWithTag(capture, SPB_POOL_TAG);
+	}
+}
+
+NTSTATUS
+SpbCaptureRead(
+	IN SPB_CONTEXT* SpbContext,
+	_Out_writes_(MaxRecords) PSURFACE_BATTERY_BUS_RECORD Records,
+	IN ULONG MaxRecords,
+	OUT PULONG RecordCount,
+	OUT PULONG Dropped
+)
+/*++
+
+  Routine Description:
+
+	This routine moves up to MaxRecords of the oldest records out of the
+	capture ring, and returns the number of records overwritten since the
+	previous call.
+
+  Arguments:
+
+	SpbContext  - Pointer to the current device context
+	Records     - Buffer receiving the records, oldest first
+	MaxRecords  - Number of records that fit in Records
+	RecordCount - Receives the number of records returned
+	Dropped     - Receives the number of records lost
+
+  Return Value:
+
+	STATUS_INVALID_DEVICE_STATE if no capture is running
+
+--*/
+{
+	SPB_CAPTURE* capture;
+	ULONG count;
+	ULONG index;
+	ULONG tail;
+	NTSTATUS status;
+
+	*RecordCount = 0;
+	*Dropped = 0;
+	if (SpbContext->SpbLock == NULL)
+	{
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	WdfWaitLockAcquire(SpbContext->SpbLock, NULL);
+	capture = SpbContext->Capture;
+	if (capture == NULL)
+	{
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto exit;
+	}
+
+	count = min(capture->Count, MaxRecords);
+	tail = (capture->Head + SURFACE_BATTERY_BUS_CAPTURE_RECORDS - capture->Count) %
+		SURFACE_BATTERY_BUS_CAPTURE_RECORDS;
+
+	for (index = 0; index < count; index++)
+	{
+		Records[index] = capture->Records[(tail + index) % SURFACE_BATTERY_BUS_CAPTURE_RECORDS];
+	}
+
+	capture->Count -= count;
+	*RecordCount = count;
+	*Dropped = capture->Dropped;
+	capture->Dropped = 0;
+	status = STATUS_SUCCESS;
+
+exit:
+	WdfWaitLockRelease(SpbContext->SpbLock);
+	return status;
+}
+
+NTSTATUS
+SpbBusInitialize(
+	VOID
+)
+/*++
+
+  Routine Description:
+
+	This routine initializes the driver-wide list of buses. It is called
+	once from DriverEntry, the list lock is parented to the driver.
+
+  Arguments:
+
+	None
+
+  Return Value:
+
+	NTSTATUS Status indicating success or failure
+
+--*/
+{
+	InitializeListHead(&SpbBusList);
+	return WdfWaitLockCreate(
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&SpbBusListLock);
+}
+
+VOID
+SpbBusQueryActivity(
+	IN SPB_CONTEXT* SpbContext,
+	OUT PULONGLONG ActiveTime,
+	OUT PULONGLONG Wakeups
+)
+/*++
+
+  Routine Description:
+
+	This routine returns the activity of the controller, as seen by all
+	devices on the bus.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+	ActiveTime - Receives the time spent in transfers, in 100ns units
+	Wakeups    - Receives the number of controller power-up periods
+
+  Return Value:
+
+	None
+
+--*/
+{
+	LARGE_INTEGER frequency;
+	LONGLONG ticks;
+
+	*ActiveTime = 0;
+	*Wakeups = 0;
+	if (SpbContext->Bus == NULL)
+	{
+		return;
+	}
+
+	KeQueryPerformanceCounter(&frequency);
+	ticks = ReadNoFence64(&SpbContext->Bus->ActiveTime);
+	*ActiveTime = (ULONGLONG)((ticks / frequency.QuadPart) * 10000000 +
+		(ticks % frequency.QuadPart) * 10000000 / frequency.QuadPart);
+
+	*Wakeups = (ULONGLONG)ReadNoFence64(&SpbContext->Bus->Wakeups);
+}
+
+BOOLEAN
+SpbBusIsAwake(
+	IN SPB_CONTEXT* SpbContext
+)
+/*++
+
+  Routine Description:
+
+	This routine tells whether a transfer issued now would find the
+	controller powered up, because the target is open and any device on
+	the bus transferred within SPB_BUS_IDLE_TIMEOUT_MS. The answer is only
+	a hint, the bus lock is not taken.
+
+  Arguments:
+
+	SpbContext - Pointer to the current device context
+
+  Return Value:
+
+	TRUE if the controller is awake
+
+--*/
+{
+	LARGE_INTEGER frequency;
+	LONGLONG lastActive;
+
+	if (!SpbContext->TargetOpen || SpbContext->Bus == NULL)
+	{
+		return FALSE;
+	}
+
+	lastActive = ReadNoFence64(&SpbContext->Bus->LastActive);
+	return lastActive != 0 &&
+		KeQueryPerformanceCounter(&frequency).QuadPart - lastActive <=
+			frequency.QuadPart * SPB_BUS_IDLE_TIMEOUT_MS / 1000;
+}
@@ -27,6 +27,21 @@
 
 #define SPB_POOL_TAG 'bpSB'
 
+//
+// Most commands SpbReadCommandsSynchronously issues in one sequence.
+//
+#define SPB_MAX_COMMANDS 4
+
+//
+// Answer transfers from the emulated gauge in emulator.c instead of the bus.
+//
+#define SPB_EMULATE_GAUGE 0
+
+struct _SURFACE_BATTERY_BUS_RECORD;
+typedef struct _SPB_CAPTURE SPB_CAPTURE;
+typedef struct _SPB_EMULATOR SPB_EMULATOR;
+typedef struct _SPB_BUS SPB_BUS;
+
 //
 // SPB (I2C) context
 //
@@ -38,8 +53,81 @@ typedef struct _SPB_CONTEXT
 	WDFMEMORY WriteMemory;
 	WDFMEMORY ReadMemory;
 	WDFWAITLOCK SpbLock;
+
+	//
+	// Transfer capture ring, NULL unless a capture is running. Guarded by
+	// SpbLock.
+	//
+	SPB_CAPTURE* Capture;
+
+	//
+	// Emulated gauge, only used with SPB_EMULATE_GAUGE.
+	//
+	SPB_EMULATOR* Emulator;
+
+	//
+	// Set once the controller refused IOCTL_SPB_EXECUTE_SEQUENCE, reads
+	// then write the address pointer and read in separate transactions.
+	//
+	BOOLEAN SequenceUnsupported;
+
+	//
+	// Controller shared with the other devices on the same resource hub id.
+	// Transfers hold its lock before SpbLock.
+	//
+	SPB_BUS* Bus;
+
+	//
+	// The I/O target is reopened by the first transfer after IdleTimer
+	// closed it, IdleTimeoutMs after the last transfer. In D0 the sampler
+	// polls more often than that and the target stays open. TargetOpen and
+	// LastTransfer are guarded by SpbLock, OpenCount and OpenTime (in
+	// performance counter ticks) are read by the performance counters.
+	//
+	WDFTIMER IdleTimer;
+	ULONG IdleTimeoutMs;
+	BOOLEAN TargetOpen;
+	LONGLONG LastTransfer;
+	LONG64 OpenCount;
+	LONG64 OpenTime;
 } SPB_CONTEXT;
 
+NTSTATUS
+SpbBusInitialize(
+	VOID
+);
+
+BOOLEAN
+SpbBusIsAwake(
+	IN SPB_CONTEXT* SpbContext
+);
+
+VOID
+SpbBusQueryActivity(
+	IN SPB_CONTEXT* SpbContext,
+	OUT PULONGLONG ActiveTime,
+	OUT PULONGLONG Wakeups
+);
+
+NTSTATUS
+SpbCaptureStart(
+	IN SPB_CONTEXT* SpbContext
+);
+
+VOID
+SpbCaptureStop(
+	IN SPB_CONTEXT* SpbContext
+);
+
+NTSTATUS
+SpbCaptureRead(
+	IN SPB_CONTEXT* SpbContext,
+	_Out_writes_(MaxRecords) struct _SURFACE_BATTERY_BUS_RECORD* Records,
+	IN ULONG MaxRecords,
+	OUT PULONG RecordCount,
+	OUT PULONG Dropped
+);
+
 
 NTSTATUS
 SpbReadDataSynchronously(
@@ -49,6 +137,16 @@ SpbReadDataSynchronously(
 	IN ULONG Length
 );
 
+NTSTATUS
+SpbReadCommandsSynchronously(
+	IN SPB_CONTEXT* SpbContext,
+	IN UCHAR Address,
+	_In_reads_(Count) const UINT16* Commands,
+	IN ULONG Count,
+	IN ULONG DelayInUs,
+	_Out_writes_(Count) PUINT16 Results
+);
+
 VOID
 SpbTargetDeinitialize(
 	IN WDFDEVICE FxDevice,
@@ -67,4 +165,45 @@ SpbWriteDataSynchronously(
 	IN UCHAR Address,
 	IN PVOID Data,
 	IN ULONG Length
-);
\ No newline at end of file
+);
+
+#if SPB_EMULATE_GAUGE
+
+NTSTATUS
+SpbEmulatorCreate(
+	_Inout_ SPB_CONTEXT* SpbContext
+);
+
+VOID
+SpbEmulatorDestroy(
+	_Inout_ SPB_CONTEXT* SpbContext
+);
+
+NTSTATUS
+SpbEmulatorOpen(
+	_Inout_ SPB_CONTEXT* SpbContext
+);
+
+NTSTATUS
+SpbEmulatorWrite(
+	_Inout_ SPB_CONTEXT* SpbContext,
+	_In_reads_bytes_(Length) PUCHAR Buffer,
+	_In_ ULONG Length
+);
+
+NTSTATUS
+SpbEmulatorRead(
+	_Inout_ SPB_CONTEXT* SpbContext,
+	_Out_writes_bytes_(Length) PUCHAR Buffer,
+	_In_ ULONG Length
+);
+
+NTSTATUS
+SpbEmulatorWriteRead(
+	_Inout_ SPB_CONTEXT* SpbContext,
+	_In_ UCHAR Address,
+	_Out_writes_bytes_(Length) PUCHAR Buffer,
+	_In_ ULONG Length
+);
+
+#endif
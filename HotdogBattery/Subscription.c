@@ -0,0 +1,496 @@
+/*++
+
+Module Name:
+
+	subscription.c
+
+Abstract:
+
+	This module implements IOCTL_SURFACE_BATTERY_WAIT_FOR_CHANGE. Requests
+	that cannot be satisfied right away are parked in a manual queue and
+	completed by the sampler once the sample moved past the caller's
+	thresholds, so user mode services can block instead of polling. A
+	sample is taken once and fanned out to every parked request in one pass
+	over the queue.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "subscription.tmh"
+
+//------------------------------------------------------------------ Definitions
+
+typedef struct _SURFACE_BATTERY_SUBSCRIPTION
+{
+	SURFACE_BATTERY_CHANGE_FILTER Filter;
+
+	//
+	// Used while the request is out of the change queue during a fan-out.
+	//
+
+	LIST_ENTRY Link;
+	ULONG ChangedFields;
+} SURFACE_BATTERY_SUBSCRIPTION, *PSURFACE_BATTERY_SUBSCRIPTION;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(SURFACE_BATTERY_SUBSCRIPTION, GetSubscription);
+
+//------------------------------------------------------------------- Prototypes
+
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL HotdogBatteryEvtIoDeviceControl;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryGetChangeSample(
+	_In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+	_Out_ PSURFACE_BATTERY_CHANGE_SAMPLE Sample
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatteryCompleteChange(
+	_In_ WDFREQUEST Request,
+	_In_ ULONG ChangedFields,
+	_In_ PSURFACE_BATTERY_CHANGE_SAMPLE Sample
+);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+HotdogBatterySubscribe(
+	_In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+	_In_ WDFREQUEST Request
+);
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, HotdogBatterySubscriptionCreate)
+#pragma alloc_text(PAGE, HotdogBatteryEvtIoDeviceControl)
+#pragma alloc_text(PAGE, HotdogBatterySubscribe)
+#pragma alloc_text(PAGE, HotdogBatteryCompleteSubscriptions)
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatterySubscriptionCreate(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the default queue, which receives the IOCTLs not
+	claimed by the battery class, and the manual queue pending subscriptions
+	are parked in. Neither queue is power managed, subscriptions survive
+	Dx transitions.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+	WDF_IO_QUEUE_CONFIG QueueConfig;
+	WDFQUEUE Queue;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+
+	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&QueueConfig, WdfIoQueueDispatchParallel);
+	QueueConfig.EvtIoDeviceControl = HotdogBatteryEvtIoDeviceControl;
+	QueueConfig.PowerManaged = WdfFalse;
+	Status = WdfIoQueueCreate(Device,
+		&QueueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&Queue);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+			"WdfIoQueueCreate(Default) Failed. Status 0x%x\n",
+			Status);
+
+		goto SubscriptionCreateEnd;
+	}
+
+	WDF_IO_QUEUE_CONFIG_INIT(&QueueConfig, WdfIoQueueDispatchManual);
+	QueueConfig.PowerManaged = WdfFalse;
+	Status = WdfIoQueueCreate(Device,
+		&QueueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&DevExt->ChangeQueue);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+			"WdfIoQueueCreate(ChangeQueue) Failed. Status 0x%x\n",
+			Status);
+
+		goto SubscriptionCreateEnd;
+	}
+
+SubscriptionCreateEnd:
+	return Status;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryEvtIoDeviceControl(
+	WDFQUEUE Queue,
+	WDFREQUEST Request,
+	size_t OutputBufferLength,
+	size_t InputBufferLength,
+	ULONG IoControlCode
+)
+
+/*++
+
+Routine Description:
+
+	This routine dispatches the driver-private IOCTLs that go through the
+	framework. Anything else was already refused by the battery class and is
+	failed the way the framework fails requests without a queue.
+
+Arguments:
+
+	Queue - Supplies a handle to the default queue.
+
+	Request - Supplies a handle to the request.
+
+	OutputBufferLength - Supplies the length of the output buffer.
+
+	InputBufferLength - Supplies the length of the input buffer.
+
+	IoControlCode - Supplies the IOCTL code.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+
+	UNREFERENCED_PARAMETER(OutputBufferLength);
+	UNREFERENCED_PARAMETER(InputBufferLength);
+
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(WdfIoQueueGetDevice(Queue));
+	switch (IoControlCode) {
+	case IOCTL_SURFACE_BATTERY_WAIT_FOR_CHANGE:
+		HotdogBatterySubscribe(DevExt, Request);
+		break;
+
+	default:
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+		break;
+	}
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryGetChangeSample(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PSURFACE_BATTERY_CHANGE_SAMPLE Sample
+)
+
+/*++
+
+Routine Description:
+
+	This routine extracts the fields subscriptions are filtered on from the
+	latest sample.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Sample - Supplies a pointer to the structure to fill.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	Sample->BatteryTag = DevExt->BatteryTag;
+	Sample->PowerState = DevExt->Snapshot.PowerState;
+	Sample->Capacity = DevExt->Snapshot.Capacity;
+	Sample->Voltage = DevExt->Snapshot.Voltage;
+	Sample->Rate = DevExt->Snapshot.Rate;
+	Sample->Temperature = DevExt->LastBurst.Temperature;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCompleteChange(
+	WDFREQUEST Request,
+	ULONG ChangedFields,
+	PSURFACE_BATTERY_CHANGE_SAMPLE Sample
+)
+
+/*++
+
+Routine Description:
+
+	This routine completes a subscription with the sample that satisfied it.
+
+Arguments:
+
+	Request - Supplies a handle to the subscription request.
+
+	ChangedFields - Supplies the fields that changed.
+
+	Sample - Supplies the sample to return.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_CHANGE Change;
+	NTSTATUS Status;
+
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		sizeof(SURFACE_BATTERY_CHANGE),
+		(PVOID*)&Change,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		WdfRequestComplete(Request, Status);
+		return;
+	}
+
+	Change->ChangedFields = ChangedFields;
+	Change->Sample = *Sample;
+	WdfRequestCompleteWithInformation(Request,
+		STATUS_SUCCESS,
+		sizeof(SURFACE_BATTERY_CHANGE));
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySubscribe(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	WDFREQUEST Request
+)
+
+/*++
+
+Routine Description:
+
+	This routine validates a subscription and either completes it right away,
+	when the latest sample already satisfies it, or parks it in the change
+	queue. The check and the park happen under the state lock, so a sample
+	published in between cannot be missed.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Request - Supplies a handle to the subscription request.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	WDF_OBJECT_ATTRIBUTES Attributes;
+	ULONG ChangedFields;
+	PSURFACE_BATTERY_CHANGE Change;
+	PSURFACE_BATTERY_CHANGE_FILTER Filter;
+	SURFACE_BATTERY_CHANGE_SAMPLE Sample;
+	NTSTATUS Status;
+	PSURFACE_BATTERY_SUBSCRIPTION Subscription;
+
+	PAGED_CODE();
+
+	Status = WdfRequestRetrieveInputBuffer(Request,
+		sizeof(SURFACE_BATTERY_CHANGE_FILTER),
+		(PVOID*)&Filter,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		goto SubscribeEnd;
+	}
+
+	Status = WdfRequestRetrieveOutputBuffer(Request,
+		sizeof(SURFACE_BATTERY_CHANGE),
+		(PVOID*)&Change,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		goto SubscribeEnd;
+	}
+
+	if (Filter->Version != SURFACE_BATTERY_CHANGE_FILTER_VERSION) {
+		Status = STATUS_REVISION_MISMATCH;
+		goto SubscribeEnd;
+	}
+
+	//
+	// The filter is kept in a request context, the buffers of a request
+	// cannot be touched while it sits in the manual queue.
+	//
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&Attributes, SURFACE_BATTERY_SUBSCRIPTION);
+	Status = WdfObjectAllocateContext(Request, &Attributes, (PVOID*)&Subscription);
+	if (!NT_SUCCESS(Status)) {
+		goto SubscribeEnd;
+	}
+
+	Subscription->Filter = *Filter;
+
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryGetChangeSample(DevExt, &Sample);
+	ChangedFields = HotdogBatteryChangedFields(&Subscription->Filter, &Sample);
+	if (ChangedFields == 0) {
+		Status = WdfRequestForwardToIoQueue(Request, DevExt->ChangeQueue);
+		if (!RtlEqualMemory(&Sample, &DevExt->ChangeSample, sizeof(Sample))) {
+			DevExt->ChangeSampleValid = FALSE;
+		}
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+	if (ChangedFields != 0) {
+		HotdogBatteryCompleteChange(Request, ChangedFields, &Sample);
+		return;
+	}
+
+	if (NT_SUCCESS(Status)) {
+		return;
+	}
+
+	Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+		"WdfRequestForwardToIoQueue() Failed. Status 0x%x\n",
+		Status);
+
+SubscribeEnd:
+	WdfRequestComplete(Request, Status);
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryCompleteSubscriptions(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine completes every subscription the latest sample satisfies.
+	The change queue is drained once under the state lock, satisfied
+	requests are completed after the lock is dropped and the others are
+	put back. Every parked request was already checked against ChangeSample
+	while ChangeSampleValid is set, so an unchanged sample skips the pass.
+
+	The caller must not hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	LIST_ENTRY Completed;
+	LIST_ENTRY Pending;
+	PLIST_ENTRY Entry;
+	WDFREQUEST Request;
+	SURFACE_BATTERY_CHANGE_SAMPLE Sample;
+	NTSTATUS Status;
+	PSURFACE_BATTERY_SUBSCRIPTION Subscription;
+
+	PAGED_CODE();
+
+	InitializeListHead(&Completed);
+	InitializeListHead(&Pending);
+
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryGetChangeSample(DevExt, &Sample);
+	if (DevExt->ChangeSampleValid != FALSE &&
+		RtlEqualMemory(&Sample, &DevExt->ChangeSample, sizeof(Sample))) {
+
+		WdfWaitLockRelease(DevExt->StateLock);
+		return;
+	}
+
+	for (;;) {
+		Status = WdfIoQueueRetrieveNextRequest(DevExt->ChangeQueue, &Request);
+		if (!NT_SUCCESS(Status)) {
+			break;
+		}
+
+		Subscription = GetSubscription(Request);
+		Subscription->ChangedFields = HotdogBatteryChangedFields(&Subscription->Filter,
+			&Sample);
+
+		if (Subscription->ChangedFields != 0) {
+			InsertTailList(&Completed, &Subscription->Link);
+
+		} else {
+
+			//
+			// Requeued requests go to the head of the queue, put them back
+			// in reverse to keep their order.
+			//
+
+			InsertHeadList(&Pending, &Subscription->Link);
+		}
+	}
+
+	while (!IsListEmpty(&Pending)) {
+		Entry = RemoveHeadList(&Pending);
+		Subscription = CONTAINING_RECORD(Entry, SURFACE_BATTERY_SUBSCRIPTION, Link);
+		Request = (WDFREQUEST)WdfObjectContextGetObject(Subscription);
+		Status = WdfRequestRequeue(Request);
+		if (!NT_SUCCESS(Status)) {
+			Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+				"WdfRequestRequeue() Failed. Status 0x%x\n",
+				Status);
+
+			Subscription->ChangedFields = 0;
+			InsertTailList(&Completed, &Subscription->Link);
+		}
+	}
+
+	DevExt->ChangeSample = Sample;
+	DevExt->ChangeSampleValid = TRUE;
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	while (!IsListEmpty(&Completed)) {
+		Entry = RemoveHeadList(&Completed);
+		Subscription = CONTAINING_RECORD(Entry, SURFACE_BATTERY_SUBSCRIPTION, Link);
+		Request = (WDFREQUEST)WdfObjectContextGetObject(Subscription);
+		if (Subscription->ChangedFields == 0) {
+			WdfRequestComplete(Request, STATUS_CANCELLED);
+
+		} else {
+			HotdogBatteryCompleteChange(Request, Subscription->ChangedFields, &Sample);
+		}
+	}
+}
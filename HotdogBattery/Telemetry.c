@@ -0,0 +1,940 @@
+/*++
+
+Module Name:
+
+	telemetry.c
+
+Abstract:
+
+	This module implements IOCTL_SURFACE_BATTERY_QUERY_TELEMETRY, which
+	returns the battery status and every information level in one call,
+	instead of one battery class IOCTL and bus sequence per level.
+
+	It also maintains the telemetry section. Every sample is published into
+	a pagefile-backed section under a sequence counter, and
+	IOCTL_SURFACE_BATTERY_MAP_TELEMETRY maps a read-only view of it into
+	user mode readers, which then poll it without entering the kernel.
+
+	Finally it exposes the SPB transfer capture of spb.c to user mode, so
+	gauge traffic can be recorded in the field and replayed offline, the
+	per callback cost statistics used to benchmark the driver, the
+	staleness bounds of the register cache in prefetch.c and the energy
+	account kept by the sampler.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include "HotdogBattery.h"
+#include "telemetry.tmh"
+
+//------------------------------------------------------------------ Definitions
+
+typedef struct _SURFACE_BATTERY_TELEMETRY_LEVEL
+{
+	BATTERY_QUERY_INFORMATION_LEVEL Level;
+	ULONG Offset;
+	ULONG Length;
+} SURFACE_BATTERY_TELEMETRY_LEVEL;
+
+#define TELEMETRY_LEVEL(Level, Field) \
+	{ (Level), \
+	  FIELD_OFFSET(SURFACE_BATTERY_TELEMETRY, Field), \
+	  RTL_FIELD_SIZE(SURFACE_BATTERY_TELEMETRY, Field) }
+
+//
+// Information levels returned by the batch query and where they land.
+//
+
+static const SURFACE_BATTERY_TELEMETRY_LEVEL HotdogBatteryTelemetryLevels[] = {
+	TELEMETRY_LEVEL(BatteryInformation, Information),
+	TELEMETRY_LEVEL(BatteryGranularityInformation, Granularity),
+	TELEMETRY_LEVEL(BatteryTemperature, Temperature),
+	TELEMETRY_LEVEL(BatteryEstimatedTime, EstimatedTime),
+	TELEMETRY_LEVEL(BatteryDeviceName, DeviceName),
+	TELEMETRY_LEVEL(BatteryManufactureDate, ManufactureDate),
+	TELEMETRY_LEVEL(BatteryManufactureName, ManufactureName),
+	TELEMETRY_LEVEL(BatteryUniqueID, UniqueID),
+	TELEMETRY_LEVEL(BatterySerialNumber, SerialNumber),
+};
+
+//------------------------------------------------------------------- Prototypes
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+HotdogBatteryQueryTelemetry(
+	_In_ PSURFACE_BATTERY_FDO_DATA DevExt,
+	_Out_ PSURFACE_BATTERY_TELEMETRY Telemetry
+);
+
+//---------------------------------------------------------------------- Pragmas
+
+#pragma alloc_text(PAGE, HotdogBatterySharedTelemetryCreate)
+#pragma alloc_text(PAGE, HotdogBatterySharedTelemetryDestroy)
+#pragma alloc_text(PAGE, HotdogBatteryMapTelemetryIoctl)
+#pragma alloc_text(PAGE, HotdogBatteryBusCaptureIoctl)
+#pragma alloc_text(PAGE, HotdogBatteryCallbackStatsIoctl)
+#pragma alloc_text(PAGE, HotdogBatteryStalenessIoctl)
+#pragma alloc_text(PAGE, HotdogBatteryEnergyIoctl)
+
+//
+// N.B. HotdogBatteryPublishTelemetry runs on every status sample and stays
+//      nonpaged with the rest of the status path.
+//
+
+//-------------------------------------------------------------------- Functions
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryQueryTelemetry(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PSURFACE_BATTERY_TELEMETRY Telemetry
+)
+
+/*++
+
+Routine Description:
+
+	This routine takes one coherent telemetry sample. The status is served
+	like a class status query: a sample within the staleness bound is
+	extrapolated, otherwise the status burst is read, which also fills the
+	register cache for most information levels. The registers of all levels
+	that are not fresh are then read in as few transfers as possible, and
+	finally every level is computed from the cache while the state lock is
+	still held. Telemetry readers therefore cannot drive gauge traffic beyond
+	what the staleness bounds allow.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Telemetry - Supplies a pointer to the structure to fill.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	ULONG Index;
+	LARGE_INTEGER Now;
+	ULONG RegisterMask;
+	ULONG ReturnedLength;
+	BOOLEAN Sampled;
+	NTSTATUS Status;
+
+	Sampled = FALSE;
+	RtlZeroMemory(Telemetry, sizeof(*Telemetry));
+	Telemetry->Version = SURFACE_BATTERY_TELEMETRY_VERSION;
+	Telemetry->Size = sizeof(*Telemetry);
+
+	HotdogBatteryAcquireStateLock(DevExt);
+	if (DevExt->BatteryTag == BATTERY_TAG_INVALID) {
+		Status = STATUS_NO_SUCH_DEVICE;
+		goto QueryTelemetryEnd;
+	}
+
+	Telemetry->BatteryTag = DevExt->BatteryTag;
+	KeQuerySystemTime(&Now);
+	Telemetry->Timestamp = Now.QuadPart;
+
+	Status = HotdogBatteryGetStatus(DevExt, &Telemetry->Status, &Sampled);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+			"HotdogBatteryGetStatus failed with Status = 0x%08lX\n",
+			Status);
+
+		goto QueryTelemetryEnd;
+	}
+
+	RegisterMask = 0;
+	for (Index = 0; Index < ARRAYSIZE(HotdogBatteryTelemetryLevels); Index += 1) {
+		RegisterMask |= HotdogBatteryLevelRegisters(DevExt, HotdogBatteryTelemetryLevels[Index].Level);
+	}
+
+	Status = HotdogBatteryReadRegisters(DevExt, SURFACE_BATTERY_LEVEL_NONE, RegisterMask);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+			"HotdogBatteryReadRegisters failed with Status = 0x%08lX\n",
+			Status);
+
+		goto QueryTelemetryEnd;
+	}
+
+	for (Index = 0; Index < ARRAYSIZE(HotdogBatteryTelemetryLevels); Index += 1) {
+		Status = HotdogBatteryQueryLevel(DevExt,
+			HotdogBatteryTelemetryLevels[Index].Level,
+			0,
+			(PUCHAR)Telemetry + HotdogBatteryTelemetryLevels[Index].Offset,
+			HotdogBatteryTelemetryLevels[Index].Length,
+			&ReturnedLength);
+
+		if (!NT_SUCCESS(Status)) {
+			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_ERROR,
+				"Level 0x%x failed with Status = 0x%08lX\n",
+				HotdogBatteryTelemetryLevels[Index].Level,
+				Status);
+
+			goto QueryTelemetryEnd;
+		}
+	}
+
+QueryTelemetryEnd:
+	WdfWaitLockRelease(DevExt->StateLock);
+	if (Sampled != FALSE) {
+		HotdogBatteryCompleteSubscriptions(DevExt);
+	}
+
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryTelemetryIoctl(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_SURFACE_BATTERY_QUERY_TELEMETRY and completes
+	the IRP.
+
+	The IOCTL is only served while the device is registered with the battery
+	class, i.e. while the gauge is reachable.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Irp - Supplies the IO request being processed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp;
+	NTSTATUS Status;
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	Irp->IoStatus.Information = 0;
+	if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength <
+		sizeof(SURFACE_BATTERY_TELEMETRY)) {
+
+		Status = STATUS_BUFFER_TOO_SMALL;
+		goto TelemetryIoctlEnd;
+	}
+
+	if (!ExAcquireRundownProtection(&DevExt->ClassRundown)) {
+		Status = STATUS_DEVICE_NOT_READY;
+		goto TelemetryIoctlEnd;
+	}
+
+	Status = HotdogBatteryQueryTelemetry(DevExt,
+		(PSURFACE_BATTERY_TELEMETRY)Irp->AssociatedIrp.SystemBuffer);
+
+	ExReleaseRundownProtection(&DevExt->ClassRundown);
+	if (NT_SUCCESS(Status)) {
+		Irp->IoStatus.Information = sizeof(SURFACE_BATTERY_TELEMETRY);
+	}
+
+TelemetryIoctlEnd:
+	Irp->IoStatus.Status = Status;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return Status;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySharedTelemetryCreate(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine creates the telemetry section and maps it into system space
+	for the driver to publish into. Failure only disables the shared
+	section, the IOCTL interfaces keep working.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	OBJECT_ATTRIBUTES ObjectAttributes;
+	HANDLE Section;
+	PVOID SectionObject;
+	LARGE_INTEGER SectionSize;
+	NTSTATUS Status;
+	PVOID View;
+	SIZE_T ViewSize;
+
+	PAGED_CODE();
+
+	Section = NULL;
+	SectionObject = NULL;
+	View = NULL;
+	InitializeObjectAttributes(&ObjectAttributes,
+		NULL,
+		OBJ_KERNEL_HANDLE,
+		NULL,
+		NULL);
+
+	SectionSize.QuadPart = PAGE_SIZE;
+	Status = ZwCreateSection(&Section,
+		SECTION_MAP_READ | SECTION_MAP_WRITE | SECTION_QUERY,
+		&ObjectAttributes,
+		&SectionSize,
+		PAGE_READWRITE,
+		SEC_COMMIT,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"ZwCreateSection() Failed. Status 0x%x\n",
+			Status);
+
+		goto SharedTelemetryCreateEnd;
+	}
+
+	Status = ObReferenceObjectByHandle(Section,
+		SECTION_MAP_READ | SECTION_MAP_WRITE,
+		NULL,
+		KernelMode,
+		&SectionObject,
+		NULL);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"ObReferenceObjectByHandle() Failed. Status 0x%x\n",
+			Status);
+
+		goto SharedTelemetryCreateEnd;
+	}
+
+	ViewSize = 0;
+	Status = MmMapViewInSystemSpace(SectionObject, &View, &ViewSize);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"MmMapViewInSystemSpace() Failed. Status 0x%x\n",
+			Status);
+
+		goto SharedTelemetryCreateEnd;
+	}
+
+	DevExt->SharedSection = Section;
+	DevExt->SharedSectionObject = SectionObject;
+	DevExt->SharedTelemetry = (PSURFACE_BATTERY_SHARED_TELEMETRY)View;
+	DevExt->SharedSequence = 0;
+	HotdogBatteryPublishTelemetry(DevExt);
+	Section = NULL;
+	SectionObject = NULL;
+
+SharedTelemetryCreateEnd:
+	if (SectionObject != NULL) {
+		ObDereferenceObject(SectionObject);
+	}
+
+	if (Section != NULL) {
+		ZwClose(Section);
+	}
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatterySharedTelemetryDestroy(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes an invalid battery tag, so readers holding a view
+	see the device is gone, and releases the driver's references to the
+	telemetry section. Views mapped into user mode keep the section alive
+	until they are unmapped.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONG BatteryTag;
+
+	PAGED_CODE();
+
+	if (DevExt->SharedTelemetry == NULL) {
+		return;
+	}
+
+	BatteryTag = DevExt->BatteryTag;
+	DevExt->BatteryTag = BATTERY_TAG_INVALID;
+	HotdogBatteryPublishTelemetry(DevExt);
+	DevExt->BatteryTag = BatteryTag;
+
+	MmUnmapViewInSystemSpace(DevExt->SharedTelemetry);
+	ObDereferenceObject(DevExt->SharedSectionObject);
+	ZwClose(DevExt->SharedSection);
+	DevExt->SharedTelemetry = NULL;
+	DevExt->SharedSectionObject = NULL;
+	DevExt->SharedSection = NULL;
+}
+
+_Use_decl_annotations_
+VOID
+HotdogBatteryPublishTelemetry(
+	PSURFACE_BATTERY_FDO_DATA DevExt
+)
+
+/*++
+
+Routine Description:
+
+	This routine copies the latest sample into the telemetry section. The
+	sequence is made odd before and even after the update, with full
+	barriers in between, so readers can detect and retry torn copies.
+
+	The sequence is taken from the device extension rather than from the
+	section, so the driver never depends on what is in the section. User
+	views are mapped with SEC_NO_CHANGE and cannot be made writable.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	PSURFACE_BATTERY_SHARED_TELEMETRY Shared;
+
+	Shared = DevExt->SharedTelemetry;
+	if (Shared == NULL) {
+		return;
+	}
+
+	HotdogBatterySharedTelemetryBeginUpdate(Shared, &DevExt->SharedSequence);
+	Shared->Version = SURFACE_BATTERY_SHARED_TELEMETRY_VERSION;
+	Shared->Size = sizeof(SURFACE_BATTERY_SHARED_TELEMETRY);
+	Shared->BatteryTag = DevExt->BatteryTag;
+	Shared->StatusTimestamp = (LONGLONG)DevExt->Snapshot.StatusTimestamp;
+	Shared->InformationTimestamp = (LONGLONG)DevExt->Snapshot.InformationTimestamp;
+	Shared->Status.PowerState = DevExt->Snapshot.PowerState;
+	Shared->Status.Capacity = DevExt->Snapshot.Capacity;
+	Shared->Status.Voltage = DevExt->Snapshot.Voltage;
+	Shared->Status.Rate = DevExt->Snapshot.Rate;
+	Shared->DesignedCapacity = DevExt->Snapshot.DesignedCapacity;
+	Shared->FullChargedCapacity = DevExt->Snapshot.FullChargedCapacity;
+	Shared->CycleCount = DevExt->Snapshot.CycleCount;
+	Shared->Temperature = DevExt->LastBurst.Temperature;
+	Shared->GaugeFlags = DevExt->LastBurst.Flags;
+	HotdogBatterySharedTelemetryEndUpdate(Shared, &DevExt->SharedSequence);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryMapTelemetryIoctl(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_SURFACE_BATTERY_MAP_TELEMETRY and completes
+	the IRP. A read-only view of the telemetry section is mapped into the
+	current process, which is the requestor since the battery FDO sits at
+	the top of its stack and the IOCTL is preprocessed synchronously.
+
+	Who may map the section is decided by the device object security
+	descriptor, which already gates opening the battery for read access.
+	Every reader shares the same pages, so the view is mapped with
+	SEC_NO_CHANGE and its protection can never be raised to write. Each
+	handle gets at most one view, later calls on the same handle return it
+	again instead of mapping another one.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Irp - Supplies the IO request being processed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	WDFFILEOBJECT FileObject;
+	PSURFACE_BATTERY_FILE_DATA FileData;
+	PIO_STACK_LOCATION IrpSp;
+	PSURFACE_BATTERY_TELEMETRY_MAPPING Mapping;
+	NTSTATUS Status;
+	PVOID View;
+	SIZE_T ViewSize;
+
+	PAGED_CODE();
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	Irp->IoStatus.Information = 0;
+	if (Irp->RequestorMode != UserMode) {
+		Status = STATUS_INVALID_DEVICE_REQUEST;
+		goto MapTelemetryIoctlEnd;
+	}
+
+	if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength <
+		sizeof(SURFACE_BATTERY_TELEMETRY_MAPPING)) {
+
+		Status = STATUS_BUFFER_TOO_SMALL;
+		goto MapTelemetryIoctlEnd;
+	}
+
+	FileObject = WdfDeviceGetFileObject(DevExt->Device, IrpSp->FileObject);
+	if (FileObject == NULL) {
+		Status = STATUS_INVALID_DEVICE_REQUEST;
+		goto MapTelemetryIoctlEnd;
+	}
+
+	FileData = GetFileData(FileObject);
+	View = NULL;
+	ViewSize = 0;
+	HotdogBatteryAcquireStateLock(DevExt);
+	if (FileData->TelemetryView != NULL) {
+
+		//
+		// A handle duplicated into another process does not get a view of
+		// its own there, the view of the first process is all it gets.
+		//
+
+		if (FileData->TelemetryProcess == PsGetCurrentProcess()) {
+			View = FileData->TelemetryView;
+			ViewSize = FileData->TelemetryViewSize;
+			Status = STATUS_SUCCESS;
+
+		} else {
+			Status = STATUS_ACCESS_DENIED;
+		}
+
+	} else if (DevExt->SharedSection == NULL) {
+		Status = STATUS_DEVICE_NOT_READY;
+
+	} else {
+		Status = ZwMapViewOfSection(DevExt->SharedSection,
+			ZwCurrentProcess(),
+			&View,
+			0,
+			0,
+			NULL,
+			&ViewSize,
+			ViewUnmap,
+			SEC_NO_CHANGE,
+			PAGE_READONLY);
+
+		if (NT_SUCCESS(Status)) {
+			FileData->TelemetryView = View;
+			FileData->TelemetryViewSize = ViewSize;
+			FileData->TelemetryProcess = PsGetCurrentProcess();
+			ObReferenceObject(FileData->TelemetryProcess);
+		}
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN,
+			"Mapping the telemetry section failed. Status 0x%x\n",
+			Status);
+
+		goto MapTelemetryIoctlEnd;
+	}
+
+	Mapping = (PSURFACE_BATTERY_TELEMETRY_MAPPING)Irp->AssociatedIrp.SystemBuffer;
+	Mapping->Address = (ULONGLONG)(ULONG_PTR)View;
+	Mapping->Size = (ULONG)ViewSize;
+	Mapping->Version = SURFACE_BATTERY_SHARED_TELEMETRY_VERSION;
+	Irp->IoStatus.Information = sizeof(SURFACE_BATTERY_TELEMETRY_MAPPING);
+
+MapTelemetryIoctlEnd:
+	Irp->IoStatus.Status = Status;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryBusCaptureIoctl(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_SURFACE_BATTERY_CONTROL_BUS_CAPTURE and
+	IOCTL_SURFACE_BATTERY_READ_BUS_CAPTURE and completes the IRP.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Irp - Supplies the IO request being processed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PSURFACE_BATTERY_BUS_CAPTURE Capture;
+	PSURFACE_BATTERY_BUS_CAPTURE_CONTROL Control;
+	LARGE_INTEGER Frequency;
+	PIO_STACK_LOCATION IrpSp;
+	ULONG MaxRecords;
+	ULONG OutputLength;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	Irp->IoStatus.Information = 0;
+	if (IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		IOCTL_SURFACE_BATTERY_CONTROL_BUS_CAPTURE) {
+
+		if (IrpSp->Parameters.DeviceIoControl.InputBufferLength <
+			sizeof(SURFACE_BATTERY_BUS_CAPTURE_CONTROL)) {
+
+			Status = STATUS_BUFFER_TOO_SMALL;
+			goto BusCaptureIoctlEnd;
+		}
+
+		Control = (PSURFACE_BATTERY_BUS_CAPTURE_CONTROL)Irp->AssociatedIrp.SystemBuffer;
+		if (Control->Version != SURFACE_BATTERY_BUS_CAPTURE_VERSION) {
+			Status = STATUS_REVISION_MISMATCH;
+			goto BusCaptureIoctlEnd;
+		}
+
+		//
+		// The state lock keeps the SPB context from being torn down by
+		// release hardware while the capture uses its lock.
+		//
+
+		HotdogBatteryAcquireStateLock(DevExt);
+		if (Control->Enable != FALSE) {
+			Status = SpbCaptureStart(&DevExt->I2CContext);
+
+		} else {
+			SpbCaptureStop(&DevExt->I2CContext);
+			Status = STATUS_SUCCESS;
+		}
+
+		WdfWaitLockRelease(DevExt->StateLock);
+
+		Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_INFO,
+			"Bus capture %s. Status 0x%x\n",
+			(Control->Enable != FALSE) ? "started" : "stopped",
+			Status);
+
+		goto BusCaptureIoctlEnd;
+	}
+
+	OutputLength = IrpSp->Parameters.DeviceIoControl.OutputBufferLength;
+	if (OutputLength < FIELD_OFFSET(SURFACE_BATTERY_BUS_CAPTURE, Records[1])) {
+		Status = STATUS_BUFFER_TOO_SMALL;
+		goto BusCaptureIoctlEnd;
+	}
+
+	Capture = (PSURFACE_BATTERY_BUS_CAPTURE)Irp->AssociatedIrp.SystemBuffer;
+	MaxRecords = (OutputLength - FIELD_OFFSET(SURFACE_BATTERY_BUS_CAPTURE, Records)) /
+		sizeof(SURFACE_BATTERY_BUS_RECORD);
+
+	RtlZeroMemory(Capture, FIELD_OFFSET(SURFACE_BATTERY_BUS_CAPTURE, Records));
+	HotdogBatteryAcquireStateLock(DevExt);
+	Status = SpbCaptureRead(&DevExt->I2CContext,
+		Capture->Records,
+		MaxRecords,
+		&Capture->RecordCount,
+		&Capture->Dropped);
+
+	WdfWaitLockRelease(DevExt->StateLock);
+	if (!NT_SUCCESS(Status)) {
+		goto BusCaptureIoctlEnd;
+	}
+
+	KeQueryPerformanceCounter(&Frequency);
+	Capture->Version = SURFACE_BATTERY_BUS_CAPTURE_VERSION;
+	Capture->Frequency = Frequency.QuadPart;
+	Irp->IoStatus.Information =
+		FIELD_OFFSET(SURFACE_BATTERY_BUS_CAPTURE, Records) +
+		(Capture->RecordCount * sizeof(SURFACE_BATTERY_BUS_RECORD));
+
+BusCaptureIoctlEnd:
+	Irp->IoStatus.Status = Status;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryCallbackStatsIoctl(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_SURFACE_BATTERY_QUERY_CALLBACK_STATS and
+	IOCTL_SURFACE_BATTERY_RESET_CALLBACK_STATS and completes the IRP.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Irp - Supplies the IO request being processed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	LARGE_INTEGER Frequency;
+	PIO_STACK_LOCATION IrpSp;
+	PSURFACE_BATTERY_CALLBACK_STATS Stats;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	Irp->IoStatus.Information = 0;
+	if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength <
+		sizeof(SURFACE_BATTERY_CALLBACK_STATS)) {
+
+		Status = STATUS_BUFFER_TOO_SMALL;
+		goto CallbackStatsIoctlEnd;
+	}
+
+	KeQueryPerformanceCounter(&Frequency);
+	Stats = (PSURFACE_BATTERY_CALLBACK_STATS)Irp->AssociatedIrp.SystemBuffer;
+	Stats->Version = SURFACE_BATTERY_CALLBACK_STATS_VERSION;
+	Stats->Count = SURFACE_BATTERY_CALLBACK_COUNT;
+	Stats->Frequency = Frequency.QuadPart;
+
+	HotdogBatteryAcquireStateLock(DevExt);
+	RtlCopyMemory(Stats->Callbacks, DevExt->CallStats, sizeof(DevExt->CallStats));
+	if (IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		IOCTL_SURFACE_BATTERY_RESET_CALLBACK_STATS) {
+
+		RtlZeroMemory(DevExt->CallStats, sizeof(DevExt->CallStats));
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	Irp->IoStatus.Information = sizeof(SURFACE_BATTERY_CALLBACK_STATS);
+	Status = STATUS_SUCCESS;
+
+CallbackStatsIoctlEnd:
+	Irp->IoStatus.Status = Status;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryStalenessIoctl(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_SURFACE_BATTERY_QUERY_STALENESS and
+	IOCTL_SURFACE_BATTERY_SET_STALENESS and completes the IRP.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Irp - Supplies the IO request being processed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp;
+	ULONG Level;
+	PSURFACE_BATTERY_STALENESS Staleness;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	Irp->IoStatus.Information = 0;
+	Staleness = (PSURFACE_BATTERY_STALENESS)Irp->AssociatedIrp.SystemBuffer;
+	if (IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		IOCTL_SURFACE_BATTERY_QUERY_STALENESS) {
+
+		if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength <
+			sizeof(SURFACE_BATTERY_STALENESS)) {
+
+			Status = STATUS_BUFFER_TOO_SMALL;
+			goto StalenessIoctlEnd;
+		}
+
+		HotdogBatteryAcquireStateLock(DevExt);
+		HotdogBatteryQueryStaleness(DevExt, Staleness);
+		WdfWaitLockRelease(DevExt->StateLock);
+
+		Irp->IoStatus.Information = sizeof(SURFACE_BATTERY_STALENESS);
+		Status = STATUS_SUCCESS;
+		goto StalenessIoctlEnd;
+	}
+
+	if (IrpSp->Parameters.DeviceIoControl.InputBufferLength <
+		sizeof(SURFACE_BATTERY_STALENESS)) {
+
+		Status = STATUS_BUFFER_TOO_SMALL;
+		goto StalenessIoctlEnd;
+	}
+
+	if (Staleness->Version != SURFACE_BATTERY_STALENESS_VERSION) {
+		Status = STATUS_REVISION_MISMATCH;
+		goto StalenessIoctlEnd;
+	}
+
+	//
+	// The bounds apply to every consumer of the battery, power policy
+	// included, so no caller gets to make them longer than the sampler
+	// cadence.
+	//
+
+	if (Staleness->StatusMaxAge > SURFACE_BATTERY_STALENESS_MAXIMUM) {
+		Status = STATUS_INVALID_PARAMETER;
+		goto StalenessIoctlEnd;
+	}
+
+	for (Level = 0; Level < SURFACE_BATTERY_LEVEL_COUNT; Level += 1) {
+		if (Staleness->LevelMaxAge[Level] > SURFACE_BATTERY_STALENESS_MAXIMUM) {
+			Status = STATUS_INVALID_PARAMETER;
+			goto StalenessIoctlEnd;
+		}
+	}
+
+	HotdogBatteryAcquireStateLock(DevExt);
+	DevExt->StatusMaxAge = Staleness->StatusMaxAge;
+	for (Level = 0; Level < SURFACE_BATTERY_LEVEL_COUNT; Level += 1) {
+		DevExt->LevelMaxAge[Level] = Staleness->LevelMaxAge[Level];
+	}
+
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_INFO,
+		"Staleness bounds set, status %u ms\n",
+		Staleness->StatusMaxAge);
+
+	Status = STATUS_SUCCESS;
+
+StalenessIoctlEnd:
+	Irp->IoStatus.Status = Status;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryEnergyIoctl(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PIRP Irp
+)
+
+/*++
+
+Routine Description:
+
+	This routine handles IOCTL_SURFACE_BATTERY_QUERY_ENERGY and completes
+	the IRP. The energy account is kept by the sampler, the query never
+	touches the bus.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Irp - Supplies the IO request being processed.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PIO_STACK_LOCATION IrpSp;
+	NTSTATUS Status;
+
+	PAGED_CODE();
+
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	Irp->IoStatus.Information = 0;
+	if (IrpSp->Parameters.DeviceIoControl.OutputBufferLength <
+		sizeof(SURFACE_BATTERY_ENERGY)) {
+
+		Status = STATUS_BUFFER_TOO_SMALL;
+		goto EnergyIoctlEnd;
+	}
+
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryQueryEnergy(DevExt,
+		(PSURFACE_BATTERY_ENERGY)Irp->AssociatedIrp.SystemBuffer);
+
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	Irp->IoStatus.Information = sizeof(SURFACE_BATTERY_ENERGY);
+	Status = STATUS_SUCCESS;
+
+EnergyIoctlEnd:
+	Irp->IoStatus.Status = Status;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return Status;
+}
@@ -25,14 +25,19 @@ Abstract:
 
 //------------------------------------------------------------------- Prototypes
 
-#define HotdogBatteryConvertToWatts(Value) ((Value) * 3870) / 1000
-
 _IRQL_requires_same_
 VOID
 HotdogBatteryUpdateTag(
 	_Inout_ PSURFACE_BATTERY_FDO_DATA DevExt
 );
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+HotdogBatteryDecodePowerState(
+	_In_ PCSURFACE_BATTERY_GAUGE_PROFILE Gauge,
+	_In_ UINT16 Flags
+);
+
 BCLASS_QUERY_TAG_CALLBACK HotdogBatteryQueryTag;
 BCLASS_QUERY_INFORMATION_CALLBACK HotdogBatteryQueryInformation;
 BCLASS_SET_INFORMATION_CALLBACK HotdogBatterySetInformation;
@@ -44,13 +49,19 @@ BCLASS_DISABLE_STATUS_NOTIFY_CALLBACK HotdogBatteryDisableStatusNotify;
 
 #pragma alloc_text(PAGE, HotdogBatteryPrepareHardware)
 #pragma alloc_text(PAGE, HotdogBatteryUpdateTag)
-#pragma alloc_text(PAGE, HotdogBatteryQueryTag)
-#pragma alloc_text(PAGE, HotdogBatteryQueryInformation)
-#pragma alloc_text(PAGE, HotdogBatteryQueryStatus)
 #pragma alloc_text(PAGE, HotdogBatterySetStatusNotify)
 #pragma alloc_text(PAGE, HotdogBatteryDisableStatusNotify)
 #pragma alloc_text(PAGE, HotdogBatterySetInformation)
 
+//
+// N.B. HotdogBatteryQueryTag, HotdogBatteryQueryInformation and
+//      HotdogBatteryQueryStatus, and the helpers they call, are deliberately
+//      left in nonpaged .text. The battery class polls them after long idle
+//      periods, when pageable code has usually been trimmed, and a page fault
+//      there would add disk latency in front of every bus access. They are
+//      still only called at PASSIVE_LEVEL.
+//
+
 //------------------------------------------------------------ Battery Interface
 _Use_decl_annotations_
 VOID
@@ -84,8 +95,19 @@ Return Value:
 
 	DevExt = GetDeviceExtension(Device);
 
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	HotdogBatteryAcquireStateLock(DevExt);
+
+	//
+	// Loading the snapshot also restores the persisted tag, so the tag
+	// handed out below keeps increasing across boots.
+	//
+
+	HotdogBatteryLoadSnapshot(DevExt);
 	HotdogBatteryUpdateTag(DevExt);
+	HotdogBatterySelectGauge(DevExt);
+	DevExt->StatusMaxAge = 0;
+	RtlZeroMemory(DevExt->LevelMaxAge, sizeof(DevExt->LevelMaxAge));
+	HotdogBatteryPowerStateConfigure(DevExt);
 	WdfWaitLockRelease(DevExt->StateLock);
 
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
@@ -156,15 +178,23 @@ Return Value:
 --*/
 
 {
+	SURFACE_BATTERY_ACTIVITY Activity;
 	PSURFACE_BATTERY_FDO_DATA DevExt;
+	LARGE_INTEGER Start;
 	NTSTATUS Status;
 
-	PAGED_CODE();
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 
+	HotdogBatteryClassActivityStart(&Activity,
+		"QueryTag",
+		TraceLoggingPointer(Context, "Context"));
+
 	DevExt = (PSURFACE_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	Start = KeQueryPerformanceCounter(NULL);
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryCallBegin(DevExt, SURFACE_BATTERY_CALLBACK_QUERY_TAG);
 	*BatteryTag = DevExt->BatteryTag;
+	HotdogBatteryCallEnd(DevExt, Start.QuadPart);
 	WdfWaitLockRelease(DevExt->StateLock);
 	if (*BatteryTag == BATTERY_TAG_INVALID) {
 		Status = STATUS_NO_SUCH_DEVICE;
@@ -173,6 +203,11 @@ Return Value:
 		Status = STATUS_SUCCESS;
 	}
 
+	HotdogBatteryClassActivityStop(&Activity,
+		"QueryTag",
+		TraceLoggingUInt32(*BatteryTag, "BatteryTag"),
+		TraceLoggingNTStatus(Status, "Status"));
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
 		"Leaving %!FUNC!: Status = 0x%08lX\n",
 		Status);
@@ -186,8 +221,56 @@ HotdogBatteryQueryBatteryInformation(
 )
 {
 	NTSTATUS Status;
+	UINT16 DesignedCapacity = 0;
+	UINT16 FullChargedCapacity = 0;
+	UINT16 CycleCount = 0;
+	LARGE_INTEGER Now;
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 
+	//
+	// The first query after start is answered from the last-known-good
+	// snapshot when one was loaded, later queries refresh it from the gauge.
+	//
+
+	if (DevExt->InformationPrimed)
+	{
+		DevExt->InformationPrimed = FALSE;
+		Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "BATTERY_INFORMATION answered from snapshot\n");
+		Status = STATUS_SUCCESS;
+		goto Fill;
+	}
+
+	Status = HotdogBatteryReadRegisters(DevExt,
+		BatteryInformation,
+		HotdogBatteryLevelRegisters(DevExt, BatteryInformation));
+
+	if (!NT_SUCCESS(Status))
+	{
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "HotdogBatteryReadRegisters failed with Status = 0x%08lX\n", Status);
+		goto Exit;
+	}
+
+	DesignedCapacity = HotdogBatteryCachedRegister(DevExt, SURFACE_BATTERY_GAUGE_DESIGN_CAPACITY);
+	FullChargedCapacity = HotdogBatteryCachedRegister(DevExt, SURFACE_BATTERY_GAUGE_FULL_CHARGE_CAPACITY);
+	CycleCount = HotdogBatteryCachedRegister(DevExt, SURFACE_BATTERY_GAUGE_CYCLE_COUNT);
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "FullChargedCapacity BeforeTransfer 0x0A: %x", FullChargedCapacity);
+
+	KeQuerySystemTime(&Now);
+	if (DevExt->Snapshot.DesignedCapacity != (ULONG)HotdogBatteryConvertToWatts(DesignedCapacity) ||
+		DevExt->Snapshot.FullChargedCapacity != (ULONG)HotdogBatteryConvertToWatts(FullChargedCapacity) ||
+		DevExt->Snapshot.CycleCount != CycleCount)
+	{
+		DevExt->SnapshotDirty = TRUE;
+	}
+
+	DevExt->Snapshot.DesignedCapacity = HotdogBatteryConvertToWatts(DesignedCapacity);
+	DevExt->Snapshot.FullChargedCapacity = HotdogBatteryConvertToWatts(FullChargedCapacity);
+	DevExt->Snapshot.CycleCount = CycleCount;
+	DevExt->Snapshot.InformationTimestamp = Now.QuadPart;
+	HotdogBatteryPublishTelemetry(DevExt);
+
+Fill:
 	BatteryInformationResult->Capabilities =
 		BATTERY_SYSTEM_BATTERY |
 		BATTERY_SET_CHARGE_SUPPORTED |
@@ -199,37 +282,15 @@ HotdogBatteryQueryBatteryInformation(
 
 	BYTE LION[4] = {'L','I','O','N'};
 	RtlCopyMemory(BatteryInformationResult->Chemistry, LION, 4);
-	Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x3C, &BatteryInformationResult->DesignedCapacity, 2);
-	if (!NT_SUCCESS(Status))
-	{
-		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-		goto Exit;
-	}
-
-	BatteryInformationResult->DesignedCapacity = HotdogBatteryConvertToWatts(BatteryInformationResult->DesignedCapacity);
-	
-	Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x0A, &BatteryInformationResult->FullChargedCapacity, 2);
-	if (!NT_SUCCESS(Status))
-	{
-		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-		goto Exit;
-	}
-	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "FullChargedCapacity 0x13: %x", BatteryInformationResult->FullChargedCapacity);
 
-	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "FullChargedCapacity BeforeTransfer 0x12: %x", BatteryInformationResult->FullChargedCapacity);
-	BatteryInformationResult->FullChargedCapacity = HotdogBatteryConvertToWatts(BatteryInformationResult->FullChargedCapacity);
+	BatteryInformationResult->DesignedCapacity = DevExt->Snapshot.DesignedCapacity;
+	BatteryInformationResult->FullChargedCapacity = DevExt->Snapshot.FullChargedCapacity;
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "FullChargedCapacity AfterTransfer: %x", BatteryInformationResult->FullChargedCapacity);
 
 	BatteryInformationResult->DefaultAlert1 = BatteryInformationResult->FullChargedCapacity * 7 / 100; // 7% of total capacity for error
 	BatteryInformationResult->DefaultAlert2 = BatteryInformationResult->FullChargedCapacity * 9 / 100; // 9% of total capacity for warning
 	BatteryInformationResult->CriticalBias = 0;
-
-	Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x2A, &BatteryInformationResult->CycleCount, 2);
-	if (!NT_SUCCESS(Status))
-	{
-		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-		goto Exit;
-	}
+	BatteryInformationResult->CycleCount = DevExt->Snapshot.CycleCount;
 
 	Trace(
 		TRACE_LEVEL_INFORMATION,
@@ -272,29 +333,27 @@ HotdogBatteryQueryBatteryEstimatedTime(
 )
 {
 	NTSTATUS Status = STATUS_SUCCESS;
-	UCHAR Flags = 0;
+	UINT16 Flags = 0;
 	UINT16 ETA = 0;
 
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 
 	if (AtRate == 0)
 	{
-		Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x06, &Flags, 2);
+		Status = HotdogBatteryReadRegisters(DevExt,
+			BatteryEstimatedTime,
+			HotdogBatteryLevelRegisters(DevExt, BatteryEstimatedTime));
+
 		if (!NT_SUCCESS(Status))
 		{
-			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
+			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "HotdogBatteryReadRegisters failed with Status = 0x%08lX\n", Status);
 			goto Exit;
 		}
 
-		if (Flags & (1 << 0) || Flags & (1 << 1))
+		Flags = HotdogBatteryCachedRegister(DevExt, SURFACE_BATTERY_GAUGE_FLAGS);
+		if (Flags & (DevExt->Gauge->FlagsDischarging | DevExt->Gauge->FlagsCritical))
 		{
-			Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x0C, &ETA, 2);
-			if (!NT_SUCCESS(Status))
-			{
-				Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-				goto Exit;
-			}
-
+			ETA = HotdogBatteryCachedRegister(DevExt, SURFACE_BATTERY_GAUGE_TIME_TO_EMPTY);
 			if (ETA == 0xFFFF)
 			{
 				*ResultValue = BATTERY_UNKNOWN_TIME;
@@ -306,7 +365,9 @@ HotdogBatteryQueryBatteryEstimatedTime(
 			}
 			else
 			{
-				*ResultValue = ETA * 60;
+				*ResultValue = HotdogBatteryEstimateTimeToEmpty(DevExt,
+					KeQueryInterruptTime(),
+					ETA);
 
 				Trace(
 					TRACE_LEVEL_INFORMATION,
@@ -390,7 +451,100 @@ Return Value:
 --*/
 
 {
+	SURFACE_BATTERY_ACTIVITY Activity;
 	PSURFACE_BATTERY_FDO_DATA DevExt;
+	LARGE_INTEGER Start;
+	NTSTATUS Status;
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
+
+	HotdogBatteryClassActivityStart(&Activity,
+		"QueryInformation",
+		TraceLoggingUInt32(BatteryTag, "BatteryTag"),
+		TraceLoggingInt32(Level, "Level"),
+		TraceLoggingInt32(AtRate, "AtRate"),
+		TraceLoggingUInt32(BufferLength, "BufferLength"));
+
+	DevExt = (PSURFACE_BATTERY_FDO_DATA)Context;
+	Start = KeQueryPerformanceCounter(NULL);
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryCallBegin(DevExt,
+		SURFACE_BATTERY_CALLBACK_QUERY_INFORMATION + (ULONG)Level);
+
+	if (BatteryTag != DevExt->BatteryTag) {
+		Status = STATUS_NO_SUCH_DEVICE;
+		goto QueryInformationEnd;
+	}
+
+	HotdogBatteryObserveLevel(DevExt, Level);
+	Status = HotdogBatteryQueryLevel(DevExt,
+		Level,
+		AtRate,
+		Buffer,
+		BufferLength,
+		ReturnedLength);
+
+QueryInformationEnd:
+	HotdogBatteryCallEnd(DevExt, Start.QuadPart);
+	WdfWaitLockRelease(DevExt->StateLock);
+	HotdogBatteryCount(DevExt,
+		QueryTime,
+		KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart);
+
+	HotdogBatteryCount(DevExt, Queries, 1);
+	HotdogBatteryClassActivityStop(&Activity,
+		"QueryInformation",
+		TraceLoggingInt32(Level, "Level"),
+		TraceLoggingUInt32(NT_SUCCESS(Status) ? *ReturnedLength : 0, "ReturnedLength"),
+		TraceLoggingNTStatus(Status, "Status"));
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
+		"Leaving %!FUNC!: Status = 0x%08lX\n",
+		Status);
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryQueryLevel(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	BATTERY_QUERY_INFORMATION_LEVEL Level,
+	LONG AtRate,
+	PVOID Buffer,
+	ULONG BufferLength,
+	PULONG ReturnedLength
+)
+
+/*++
+
+Routine Description:
+
+	This routine computes a single information level. It backs both the
+	battery class query and the batch telemetry IOCTL.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	Level - Supplies the type of information required
+
+	AtRate - Supplies the rate of drain for the BatteryEstimatedTime level
+
+	Buffer - Supplies a pointer to a buffer to place the information
+
+	BufferLength - Supplies the length in bytes of the buffer
+
+	ReturnedLength - Supplies the length in bytes of the returned data
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
 	ULONG ResultValue;
 	PVOID ReturnBuffer;
 	size_t ReturnBufferLength;
@@ -403,16 +557,6 @@ Return Value:
 
 	ULONG Temperature = 0;
 
-	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
-	PAGED_CODE();
-
-	DevExt = (PSURFACE_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
-	if (BatteryTag != DevExt->BatteryTag) {
-		Status = STATUS_NO_SUCH_DEVICE;
-		goto QueryInformationEnd;
-	}
-
 	//
 	// Determine the value of the information being queried for and return it.
 	//
@@ -616,14 +760,18 @@ Return Value:
 		break;
 
 	case BatteryGranularityInformation:
-		Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x0A, &ReportingScale.Capacity, 2);
+		Status = HotdogBatteryReadRegisters(DevExt,
+			Level,
+			HotdogBatteryLevelRegisters(DevExt, BatteryGranularityInformation));
+
 		if (!NT_SUCCESS(Status))
 		{
-			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
+			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "HotdogBatteryReadRegisters failed with Status = 0x%08lX\n", Status);
 			goto Exit;
 		}
 
-		ReportingScale.Capacity = HotdogBatteryConvertToWatts(ReportingScale.Capacity);
+		ReportingScale.Capacity = HotdogBatteryConvertToWatts(
+			HotdogBatteryCachedRegister(DevExt, SURFACE_BATTERY_GAUGE_FULL_CHARGE_CAPACITY));
 		ReportingScale.Granularity = 1;
 
 		Trace(
@@ -639,13 +787,18 @@ Return Value:
 		break;
 
 	case BatteryTemperature:
-		Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x02, &Temperature, 2);
+		Status = HotdogBatteryReadRegisters(DevExt,
+			Level,
+			HotdogBatteryLevelRegisters(DevExt, BatteryTemperature));
+
 		if (!NT_SUCCESS(Status))
 		{
-			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
+			Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "HotdogBatteryReadRegisters failed with Status = 0x%08lX\n", Status);
 			goto Exit;
 		}
 
+		Temperature = HotdogBatteryCachedRegister(DevExt, SURFACE_BATTERY_GAUGE_TEMPERATURE);
+
 		Trace(
 			TRACE_LEVEL_INFORMATION,
 			SURFACE_BATTERY_TRACE,
@@ -683,99 +836,80 @@ Exit:
 		*ReturnedLength = 0;
 	}
 
-QueryInformationEnd:
-	WdfWaitLockRelease(DevExt->StateLock);
-	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
-		"Leaving %!FUNC!: Status = 0x%08lX\n",
-		Status);
 	return Status;
 }
+
 struct BQ27541_SOC_DATA {
 	UINT32 unkownDATA;
 	UINT16 SOC;
 };
 
 _Use_decl_annotations_
-NTSTATUS
-HotdogBatteryQueryStatus(
-	PVOID Context,
-	ULONG BatteryTag,
-	PBATTERY_STATUS BatteryStatus
+ULONG
+HotdogBatteryDecodePowerState(
+	PCSURFACE_BATTERY_GAUGE_PROFILE Gauge,
+	UINT16 Flags
 )
 
 /*++
 
 Routine Description:
 
-	Called by the class driver to retrieve the batteries current status
-
-	The battery class driver will serialize all requests it issues to
-	the miniport for a given battery.
+	This routine decodes the gauge Flags word into the raw battery class
+	power state, before the power state machine filters it.
 
 Arguments:
 
-	Context - Supplies the miniport context value for battery
+	Gauge - Supplies the profile of the gauge the Flags were read from.
 
-	BatteryTag - Supplies the tag of current battery
-
-	BatteryStatus - Supplies a pointer to the structure to return the current
-		battery status in
+	Flags - Supplies the Flags word.
 
 Return Value:
 
-	Success if there is a battery currently installed, else no such device.
+	The raw power state.
 
 --*/
 
 {
-	PSURFACE_BATTERY_FDO_DATA DevExt;
-	NTSTATUS Status;
-	INT16 Rate = 0;
-	UCHAR Flags = 0;
+	ULONG PowerState;
 
-	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
-	PAGED_CODE();
-
-	DevExt = (PSURFACE_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
-	if (BatteryTag != DevExt->BatteryTag) {
-		Status = STATUS_NO_SUCH_DEVICE;
-		goto QueryStatusEnd;
-	}
+	//
+	// FC stays set after unplugging at full charge until the charge drops
+	// below the FC clear threshold, so DSG decides first and FC only means
+	// on AC while the battery is not discharging.
+	//
 
-	Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x06, &Flags, 2);
-	if (!NT_SUCCESS(Status))
+	if (Flags & Gauge->FlagsDischarging)
 	{
-		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-		goto QueryStatusEnd;
-	}
+		PowerState = BATTERY_DISCHARGING;
+		if (Flags & Gauge->FlagsCritical)
+		{
+			PowerState |= BATTERY_CRITICAL;
+		}
 
-	if (Flags & (1 << 9))
-	{
 		Trace(
 			TRACE_LEVEL_INFORMATION,
 			SURFACE_BATTERY_TRACE,
-			"BATTERY_POWER_ON_LINE\n");
-
-		BatteryStatus->PowerState = BATTERY_POWER_ON_LINE;
+			"BATTERY_DISCHARGING%s\n",
+			(PowerState & BATTERY_CRITICAL) ? " | BATTERY_CRITICAL" : "");
 	}
-	else if (Flags & (1 << 0))
+	else if (Flags & Gauge->FlagsFull)
 	{
 		Trace(
 			TRACE_LEVEL_INFORMATION,
 			SURFACE_BATTERY_TRACE,
-			"BATTERY_DISCHARGING\n");
+			"BATTERY_POWER_ON_LINE\n");
 
-		BatteryStatus->PowerState = BATTERY_DISCHARGING;
+		PowerState = BATTERY_POWER_ON_LINE;
 	}
-	else if (Flags & (1 << 1))
+	else if (Flags & Gauge->FlagsCritical)
 	{
 		Trace(
 			TRACE_LEVEL_INFORMATION,
 			SURFACE_BATTERY_TRACE,
 			"BATTERY_CRITICAL\n");
 
-		BatteryStatus->PowerState = BATTERY_CRITICAL;
+		PowerState = BATTERY_CRITICAL;
 	}
 	else
 	{
@@ -784,34 +918,92 @@ Return Value:
 			SURFACE_BATTERY_TRACE,
 			"BATTERY_CHARGING\n");
 
-		BatteryStatus->PowerState = BATTERY_CHARGING;
+		PowerState = BATTERY_CHARGING;
 	}
 
-	Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x08, &BatteryStatus->Capacity, 2);
-	if (!NT_SUCCESS(Status))
-	{
-		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-		goto QueryStatusEnd;
-	}
-	BatteryStatus->Capacity = HotdogBatteryConvertToWatts(BatteryStatus->Capacity);
+	return PowerState;
+}
 
-	Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x04, &BatteryStatus->Voltage, 2);
-	if (!NT_SUCCESS(Status))
-	{
-		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-		goto QueryStatusEnd;
-	}
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryRefreshStatus(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PBATTERY_STATUS BatteryStatus
+)
+
+/*++
+
+Routine Description:
+
+	This routine reads the status register window from the gauge in a single
+	burst and decodes it into a BATTERY_STATUS. The burst is kept as the
+	latest sample and folded into the last-known-good snapshot.
+
+	The caller must hold the state lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	BatteryStatus - Supplies a pointer to the structure to return the current
+		battery status in.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	SURFACE_BATTERY_STATUS_BURST Burst;
+	ULONGLONG BurstTime;
+	PCSURFACE_BATTERY_GAUGE_PROFILE Gauge;
+	LARGE_INTEGER Now;
+	NTSTATUS Status;
+	UINT16 Window[SURFACE_BATTERY_STATUS_BURST_MAX / sizeof(UINT16)];
+
+	Gauge = DevExt->Gauge;
+	Status = SpbReadDataSynchronously(&DevExt->I2CContext,
+		Gauge->StatusBurstStart,
+		Window,
+		Gauge->StatusBurstLength);
 
-	Status = SpbReadDataSynchronously(&DevExt->I2CContext, 0x10, &Rate, 2);
 	if (!NT_SUCCESS(Status))
 	{
 		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "SpbReadDataSynchronously failed with Status = 0x%08lX\n", Status);
-		goto QueryStatusEnd;
+		goto Exit;
 	}
 
-	BatteryStatus->Rate = Rate;
+#define BURST_REGISTER(Register) \
+	(Window[(Gauge->Registers[(Register)] - Gauge->StatusBurstStart) / sizeof(UINT16)])
+
+	Burst.Temperature = BURST_REGISTER(SURFACE_BATTERY_GAUGE_TEMPERATURE);
+	Burst.Voltage = BURST_REGISTER(SURFACE_BATTERY_GAUGE_VOLTAGE);
+	Burst.Flags = BURST_REGISTER(SURFACE_BATTERY_GAUGE_FLAGS);
+	Burst.RemainingCapacity = BURST_REGISTER(SURFACE_BATTERY_GAUGE_REMAINING_CAPACITY);
+	Burst.FullChargeCapacity = BURST_REGISTER(SURFACE_BATTERY_GAUGE_FULL_CHARGE_CAPACITY);
+	Burst.TimeToEmpty = BURST_REGISTER(SURFACE_BATTERY_GAUGE_TIME_TO_EMPTY);
+	Burst.AverageCurrent = (INT16)BURST_REGISTER(SURFACE_BATTERY_GAUGE_AVERAGE_CURRENT);
+
+#undef BURST_REGISTER
 
-	BatteryStatus->Rate = HotdogBatteryConvertToWatts(BatteryStatus->Rate);
+	BatteryStatus->PowerState = HotdogBatteryDecodePowerState(Gauge, Burst.Flags);
+
+	//
+	// Close the energy interval of the previous burst while the power state
+	// it was reported under is still in place.
+	//
+
+	BurstTime = KeQueryInterruptTime();
+	HotdogBatteryIntegrateEnergy(DevExt, BurstTime, &DevExt->Energy);
+	BatteryStatus->PowerState = HotdogBatteryFilterPowerState(DevExt,
+		BatteryStatus->PowerState,
+		&Burst,
+		BurstTime);
+
+	BatteryStatus->Capacity = HotdogBatteryConvertToWatts(Burst.RemainingCapacity);
+	BatteryStatus->Voltage = Burst.Voltage;
+	BatteryStatus->Rate = HotdogBatteryConvertToWatts((LONG)Burst.AverageCurrent);
 
 	Trace(
 		TRACE_LEVEL_INFORMATION,
@@ -826,10 +1018,224 @@ Return Value:
 		BatteryStatus->Voltage,
 		BatteryStatus->Rate);
 
+	HotdogBatteryCacheFill(DevExt,
+		Gauge->StatusBurstStart,
+		Window,
+		Gauge->StatusBurstLength);
+
+	DevExt->LastBurst = Burst;
+	DevExt->LastBurstTime = BurstTime;
+	DevExt->SampledFlags = Burst.Flags;
+	DevExt->SampledFlagsValid = TRUE;
+	DevExt->PollsSinceBurst = 0;
+
+	//
+	// Only the power state and the coarse capacity are worth a registry
+	// write, voltage and rate change on every sample.
+	//
+
+	if (DevExt->Snapshot.PowerState != BatteryStatus->PowerState ||
+		DevExt->Snapshot.Capacity != BatteryStatus->Capacity)
+	{
+		DevExt->SnapshotDirty = TRUE;
+	}
+
+	KeQuerySystemTime(&Now);
+	DevExt->Snapshot.PowerState = BatteryStatus->PowerState;
+	DevExt->Snapshot.Capacity = BatteryStatus->Capacity;
+	DevExt->Snapshot.Voltage = BatteryStatus->Voltage;
+	DevExt->Snapshot.Rate = BatteryStatus->Rate;
+	DevExt->Snapshot.StatusTimestamp = Now.QuadPart;
+	HotdogBatterySaveSnapshot(DevExt, FALSE);
+	HotdogBatteryPublishTelemetry(DevExt);
+
+Exit:
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryGetStatus(
+	PSURFACE_BATTERY_FDO_DATA DevExt,
+	PBATTERY_STATUS BatteryStatus,
+	PBOOLEAN Sampled
+)
+
+/*++
+
+Routine Description:
+
+	This routine returns the current battery status. A status sampled within
+	the staleness bound, by the sampler or an earlier query, is extrapolated
+	to now without going to the bus; otherwise a fresh status burst is read.
+
+	The caller must hold the state lock. When a burst was read, the caller
+	completes the change subscriptions once it has dropped the lock.
+
+Arguments:
+
+	DevExt - Supplies a pointer to the device extension of the battery.
+
+	BatteryStatus - Supplies a pointer to the structure to return the current
+		battery status in.
+
+	Sampled - Receives TRUE if a status burst was read.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	ULONGLONG Now;
+	NTSTATUS Status;
+
+	*Sampled = FALSE;
+	Now = KeQueryInterruptTime();
+	if (DevExt->LastBurstTime != 0 &&
+		(Now - DevExt->LastBurstTime) <=
+			HotdogBatteryStalenessBound(DevExt,
+				(DevExt->StatusMaxAge != 0) ? DevExt->StatusMaxAge : SURFACE_BATTERY_STATUS_DEFAULT_MAX_AGE_MS) &&
+		!HotdogBatteryEstimateExpired(DevExt, Now))
+	{
+		HotdogBatteryEstimateStatus(DevExt, Now, BatteryStatus);
+
+		Trace(TRACE_LEVEL_VERBOSE, SURFACE_BATTERY_TRACE, "BATTERY_STATUS extrapolated from the last sample\n");
+		return STATUS_SUCCESS;
+	}
+
+	Status = HotdogBatteryRefreshStatus(DevExt, BatteryStatus);
+	*Sampled = NT_SUCCESS(Status);
+	return Status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryQueryStatus(
+	PVOID Context,
+	ULONG BatteryTag,
+	PBATTERY_STATUS BatteryStatus
+)
+
+/*++
+
+Routine Description:
+
+	Called by the class driver to retrieve the batteries current status
+
+	The battery class driver will serialize all requests it issues to
+	the miniport for a given battery.
+
+Arguments:
+
+	Context - Supplies the miniport context value for battery
+
+	BatteryTag - Supplies the tag of current battery
+
+	BatteryStatus - Supplies a pointer to the structure to return the current
+		battery status in
+
+Return Value:
+
+	Success if there is a battery currently installed, else no such device.
+
+--*/
+
+{
+	SURFACE_BATTERY_ACTIVITY Activity;
+	SURFACE_BATTERY_STATUS_BURST Burst;
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+	UINT16 Flags;
+	BOOLEAN Sampled;
+	LARGE_INTEGER Start;
+	NTSTATUS Status;
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
+
+	HotdogBatteryClassActivityStart(&Activity,
+		"QueryStatus",
+		TraceLoggingUInt32(BatteryTag, "BatteryTag"));
+
+	DevExt = (PSURFACE_BATTERY_FDO_DATA)Context;
+	Sampled = FALSE;
+	Start = KeQueryPerformanceCounter(NULL);
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryCallBegin(DevExt, SURFACE_BATTERY_CALLBACK_QUERY_STATUS);
+	if (BatteryTag != DevExt->BatteryTag) {
+		Status = STATUS_NO_SUCH_DEVICE;
+		goto QueryStatusEnd;
+	}
+
+	//
+	// The first status query after start takes Capacity and Voltage from the
+	// last-known-good snapshot when one from the last few minutes was loaded.
+	// The machine may have been shut down on AC and started on battery since,
+	// so the power state comes from a live 2-byte Flags read and the rate,
+	// which goes with it, is left unknown. The decoded state seeds the power
+	// state machine like the first burst would, so the next burst is
+	// filtered against it. A failed Flags read falls back to a full burst.
+	//
+
+	if (DevExt->StatusPrimed)
+	{
+		DevExt->StatusPrimed = FALSE;
+		Status = SpbReadDataSynchronously(&DevExt->I2CContext,
+			HotdogBatteryGaugeRegister(DevExt, SURFACE_BATTERY_GAUGE_FLAGS),
+			&Flags,
+			sizeof(Flags));
+
+		if (NT_SUCCESS(Status))
+		{
+			RtlZeroMemory(&Burst, sizeof(Burst));
+			Burst.Flags = Flags;
+			Burst.Voltage = (UINT16)DevExt->Snapshot.Voltage;
+			BatteryStatus->PowerState = HotdogBatteryFilterPowerState(DevExt,
+				HotdogBatteryDecodePowerState(DevExt->Gauge, Flags),
+				&Burst,
+				KeQueryInterruptTime());
+
+			BatteryStatus->Capacity = DevExt->Snapshot.Capacity;
+			BatteryStatus->Voltage = DevExt->Snapshot.Voltage;
+			BatteryStatus->Rate = BATTERY_UNKNOWN_RATE;
+
+			Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "BATTERY_STATUS answered from snapshot and Flags\n");
+			goto QueryStatusEnd;
+		}
+
+		Trace(TRACE_LEVEL_WARNING, SURFACE_BATTERY_WARN, "Flags read failed with Status = 0x%08lX\n", Status);
+	}
+
+	Status = HotdogBatteryGetStatus(DevExt, BatteryStatus, &Sampled);
+	if (!NT_SUCCESS(Status))
+	{
+		Trace(TRACE_LEVEL_ERROR, SURFACE_BATTERY_TRACE, "HotdogBatteryGetStatus failed with Status = 0x%08lX\n", Status);
+		goto QueryStatusEnd;
+	}
+
 	Status = STATUS_SUCCESS;
 
 QueryStatusEnd:
+	HotdogBatteryCallEnd(DevExt, Start.QuadPart);
 	WdfWaitLockRelease(DevExt->StateLock);
+	if (Sampled != FALSE)
+	{
+		HotdogBatteryCompleteSubscriptions(DevExt);
+	}
+
+	HotdogBatteryCount(DevExt,
+		QueryTime,
+		KeQueryPerformanceCounter(NULL).QuadPart - Start.QuadPart);
+
+	HotdogBatteryCount(DevExt, Queries, 1);
+	HotdogBatteryClassActivityStop(&Activity,
+		"QueryStatus",
+		TraceLoggingUInt32(NT_SUCCESS(Status) ? BatteryStatus->PowerState : 0, "PowerState"),
+		TraceLoggingUInt32(NT_SUCCESS(Status) ? BatteryStatus->Capacity : 0, "Capacity"),
+		TraceLoggingUInt32(NT_SUCCESS(Status) ? BatteryStatus->Voltage : 0, "Voltage"),
+		TraceLoggingInt32(NT_SUCCESS(Status) ? (LONG)BatteryStatus->Rate : 0, "Rate"),
+		TraceLoggingNTStatus(Status, "Status"));
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
 		"Leaving %!FUNC!: Status = 0x%08lX\n",
 		Status);
@@ -870,16 +1276,25 @@ Return Value:
 --*/
 
 {
+	SURFACE_BATTERY_ACTIVITY Activity;
 	PSURFACE_BATTERY_FDO_DATA DevExt;
+	LARGE_INTEGER Start;
 	NTSTATUS Status;
 
-	UNREFERENCED_PARAMETER(BatteryNotify);
-
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
+	HotdogBatteryClassActivityStart(&Activity,
+		"SetStatusNotify",
+		TraceLoggingUInt32(BatteryTag, "BatteryTag"),
+		TraceLoggingUInt32(BatteryNotify->PowerState, "PowerState"),
+		TraceLoggingUInt32(BatteryNotify->LowCapacity, "LowCapacity"),
+		TraceLoggingUInt32(BatteryNotify->HighCapacity, "HighCapacity"));
+
 	DevExt = (PSURFACE_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	Start = KeQueryPerformanceCounter(NULL);
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryCallBegin(DevExt, SURFACE_BATTERY_CALLBACK_SET_STATUS_NOTIFY);
 	if (BatteryTag != DevExt->BatteryTag) {
 		Status = STATUS_NO_SUCH_DEVICE;
 		goto SetStatusNotifyEnd;
@@ -888,7 +1303,12 @@ Return Value:
 	Status = STATUS_NOT_SUPPORTED;
 
 SetStatusNotifyEnd:
+	HotdogBatteryCallEnd(DevExt, Start.QuadPart);
 	WdfWaitLockRelease(DevExt->StateLock);
+	HotdogBatteryClassActivityStop(&Activity,
+		"SetStatusNotify",
+		TraceLoggingNTStatus(Status, "Status"));
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
 		"Leaving %!FUNC!: Status = 0x%08lX\n",
 		Status);
@@ -921,14 +1341,21 @@ Return Value:
 --*/
 
 {
+	SURFACE_BATTERY_ACTIVITY Activity;
 	NTSTATUS Status;
 
-	UNREFERENCED_PARAMETER(Context);
-
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
+	HotdogBatteryClassActivityStart(&Activity,
+		"DisableStatusNotify",
+		TraceLoggingPointer(Context, "Context"));
+
 	Status = STATUS_NOT_SUPPORTED;
+	HotdogBatteryClassActivityStop(&Activity,
+		"DisableStatusNotify",
+		TraceLoggingNTStatus(Status, "Status"));
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
 		"Leaving %!FUNC!: Status = 0x%08lX\n",
 		Status);
@@ -973,14 +1400,23 @@ Return Value:
 	PBATTERY_CHARGER_STATUS ChargerStatus;
 	//PBATTERY_USB_CHARGER_STATUS UsbChargerStatus;
 	//PUSBFN_PORT_TYPE UsbFnPortType;
+	SURFACE_BATTERY_ACTIVITY Activity;
 	PSURFACE_BATTERY_FDO_DATA DevExt;
+	LARGE_INTEGER Start;
 	NTSTATUS Status;
 
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
+	HotdogBatteryClassActivityStart(&Activity,
+		"SetInformation",
+		TraceLoggingUInt32(BatteryTag, "BatteryTag"),
+		TraceLoggingInt32(Level, "Level"));
+
 	DevExt = (PSURFACE_BATTERY_FDO_DATA)Context;
-	WdfWaitLockAcquire(DevExt->StateLock, NULL);
+	Start = KeQueryPerformanceCounter(NULL);
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatteryCallBegin(DevExt, SURFACE_BATTERY_CALLBACK_SET_INFORMATION);
 	if (BatteryTag != DevExt->BatteryTag) {
 		Status = STATUS_NO_SUCH_DEVICE;
 		goto SetInformationEnd;
@@ -1067,7 +1503,13 @@ Return Value:
 	}
 
 SetInformationEnd:
+	HotdogBatteryCallEnd(DevExt, Start.QuadPart);
 	WdfWaitLockRelease(DevExt->StateLock);
+	HotdogBatteryClassActivityStop(&Activity,
+		"SetInformation",
+		TraceLoggingInt32(Level, "Level"),
+		TraceLoggingNTStatus(Status, "Status"));
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE,
 		"Leaving %!FUNC!: Status = 0x%08lX\n",
 		Status);
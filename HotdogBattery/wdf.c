@@ -20,35 +20,61 @@ Abstract:
 #include "HotdogBattery.h"
 #include "wdf.tmh"
 
+//------------------------------------------------------------------ Definitions
+
+//
+// TraceLogging provider "HotdogBattery" - 8497dfdc-e59c-40a3-8a6b-1c9740246d1f
+//
+
+TRACELOGGING_DEFINE_PROVIDER(
+	HotdogBatteryTraceProvider,
+	"HotdogBattery",
+	(0x8497dfdc, 0xe59c, 0x40a3, 0x8a, 0x6b, 0x1c, 0x97, 0x40, 0x24, 0x6d, 0x1f));
+
 //------------------------------------------------------------------- Prototypes
 
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD HotdogBatteryDriverDeviceAdd;
 EVT_WDF_DEVICE_SELF_MANAGED_IO_INIT  HotdogBatterySelfManagedIoInit;
 EVT_WDF_DEVICE_SELF_MANAGED_IO_CLEANUP  HotdogBatterySelfManagedIoCleanup;
+EVT_WDF_DEVICE_SELF_MANAGED_IO_SUSPEND  HotdogBatterySelfManagedIoSuspend;
+EVT_WDF_DEVICE_SELF_MANAGED_IO_RESTART  HotdogBatterySelfManagedIoRestart;
 EVT_WDF_DEVICE_QUERY_STOP HotdogBatteryQueryStop;
 EVT_WDF_DEVICE_PREPARE_HARDWARE HotdogBatteryDevicePrepareHardware;
+EVT_WDF_DEVICE_RELEASE_HARDWARE HotdogBatteryDeviceReleaseHardware;
+EVT_WDF_DEVICE_D0_EXIT HotdogBatteryDeviceD0Exit;
 EVT_WDFDEVICE_WDM_IRP_PREPROCESS HotdogBatteryWdmIrpPreprocessDeviceControl;
 EVT_WDFDEVICE_WDM_IRP_PREPROCESS HotdogBatteryWdmIrpPreprocessSystemControl;
 WMI_QUERY_REGINFO_CALLBACK HotdogBatteryQueryWmiRegInfo;
 WMI_QUERY_DATABLOCK_CALLBACK HotdogBatteryQueryWmiDataBlock;
 EVT_WDF_DRIVER_UNLOAD HotdogBatteryEvtDriverUnload;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP HotdogBatteryEvtDriverContextCleanup;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP HotdogBatteryEvtDeviceContextCleanup;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP HotdogBatteryEvtFileContextCleanup;
 
 //---------------------------------------------------------------------- Pragmas
 
 #pragma alloc_text(INIT, DriverEntry)
 #pragma alloc_text(PAGE, HotdogBatterySelfManagedIoInit)
 #pragma alloc_text(PAGE, HotdogBatterySelfManagedIoCleanup)
+#pragma alloc_text(PAGE, HotdogBatterySelfManagedIoSuspend)
+#pragma alloc_text(PAGE, HotdogBatterySelfManagedIoRestart)
 #pragma alloc_text(PAGE, HotdogBatteryQueryStop)
 #pragma alloc_text(PAGE, HotdogBatteryDriverDeviceAdd)
 #pragma alloc_text(PAGE, HotdogBatteryDevicePrepareHardware)
-#pragma alloc_text(PAGE, HotdogBatteryWdmIrpPreprocessDeviceControl)
-#pragma alloc_text(PAGE, HotdogBatteryWdmIrpPreprocessSystemControl)
+#pragma alloc_text(PAGE, HotdogBatteryDeviceReleaseHardware)
+#pragma alloc_text(PAGE, HotdogBatteryDeviceD0Exit)
 #pragma alloc_text(PAGE, HotdogBatteryQueryWmiRegInfo)
 #pragma alloc_text(PAGE, HotdogBatteryQueryWmiDataBlock)
 #pragma alloc_text(PAGE, HotdogBatteryEvtDriverUnload)
 #pragma alloc_text(PAGE, HotdogBatteryEvtDriverContextCleanup)
+#pragma alloc_text(PAGE, HotdogBatteryEvtDeviceContextCleanup)
+#pragma alloc_text(PAGE, HotdogBatteryEvtFileContextCleanup)
+
+//
+// N.B. The IRP preprocess callbacks are on the path of every battery IOCTL
+//      and are kept nonpaged together with the miniclass query callbacks.
+//
 
 //-------------------------------------------------------------------- Functions
 
@@ -94,6 +120,12 @@ Return Value:
 
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 
+	//
+	// A provider that fails to register only drops its events.
+	//
+
+	TraceLoggingRegister(HotdogBatteryTraceProvider);
+
 	WDF_DRIVER_CONFIG_INIT(&DriverConfig, HotdogBatteryDriverDeviceAdd);
 	DriverConfig.EvtDriverUnload = HotdogBatteryEvtDriverUnload;
 	DriverConfig.DriverPoolTag = SURFACE_BATTERY_TAG;
@@ -136,13 +168,41 @@ Return Value:
 	}
 
 	GlobalData = GetGlobalData(WdfGetDriver());
+	GlobalData->TickEpoch = KeQueryPerformanceCounter(NULL).QuadPart;
 	GlobalData->RegistryPath.MaximumLength = RegistryPath->Length +
 		sizeof(UNICODE_NULL);
 
 	GlobalData->RegistryPath.Length = RegistryPath->Length;
 	GlobalData->RegistryPath.Buffer = WdfDriverGetRegistryPath(WdfGetDriver());
 
+	InitializeListHead(&GlobalData->DeviceList);
+	Status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES,
+		&GlobalData->DeviceListLock);
+
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_ERROR,
+			"WdfWaitLockCreate(DeviceListLock) Failed. Status 0x%x\n",
+			Status);
+
+		goto DriverEntryEnd;
+	}
+
+	Status = SpbBusInitialize();
+	if (!NT_SUCCESS(Status)) {
+		Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_ERROR,
+			"SpbBusInitialize() Failed. Status 0x%x\n",
+			Status);
+
+		goto DriverEntryEnd;
+	}
+
+	HotdogBatteryCountersRegister(GlobalData);
+
 DriverEntryEnd:
+	if (!NT_SUCCESS(Status)) {
+		TraceLoggingUnregister(HotdogBatteryTraceProvider);
+	}
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
@@ -179,6 +239,8 @@ Return Value:
 	WDF_OBJECT_ATTRIBUTES DeviceAttributes;
 	PSURFACE_BATTERY_FDO_DATA DevExt;
 	WDFDEVICE DeviceHandle;
+	WDF_OBJECT_ATTRIBUTES FileAttributes;
+	WDF_FILEOBJECT_CONFIG FileConfig;
 	WDF_OBJECT_ATTRIBUTES LockAttributes;
 	WDF_PNPPOWER_EVENT_CALLBACKS PnpPowerCallbacks;
 	NTSTATUS Status;
@@ -195,9 +257,13 @@ Return Value:
 
 	WDF_PNPPOWER_EVENT_CALLBACKS_INIT(&PnpPowerCallbacks);
 	PnpPowerCallbacks.EvtDevicePrepareHardware = HotdogBatteryDevicePrepareHardware;
+	PnpPowerCallbacks.EvtDeviceReleaseHardware = HotdogBatteryDeviceReleaseHardware;
 	PnpPowerCallbacks.EvtDeviceSelfManagedIoInit = HotdogBatterySelfManagedIoInit;
 	PnpPowerCallbacks.EvtDeviceSelfManagedIoCleanup = HotdogBatterySelfManagedIoCleanup;
+	PnpPowerCallbacks.EvtDeviceSelfManagedIoSuspend = HotdogBatterySelfManagedIoSuspend;
+	PnpPowerCallbacks.EvtDeviceSelfManagedIoRestart = HotdogBatterySelfManagedIoRestart;
 	PnpPowerCallbacks.EvtDeviceQueryStop = HotdogBatteryQueryStop;
+	PnpPowerCallbacks.EvtDeviceD0Exit = HotdogBatteryDeviceD0Exit;
 	WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &PnpPowerCallbacks);
 
 	//
@@ -238,12 +304,29 @@ Return Value:
 		goto DriverDeviceAddEnd;
 	}
 
+	//
+	// Track file objects so per handle state, like the telemetry view, can
+	// hang off them. The battery class does not own the file objects but
+	// may look at their FsContext fields, leave those alone.
+	//
+
+	WDF_FILEOBJECT_CONFIG_INIT(&FileConfig,
+		WDF_NO_EVENT_CALLBACK,
+		WDF_NO_EVENT_CALLBACK,
+		WDF_NO_EVENT_CALLBACK);
+	FileConfig.FileObjectClass = WdfFileObjectWdfCannotUseFsContexts;
+	WDF_OBJECT_ATTRIBUTES_INIT(&FileAttributes);
+	WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&FileAttributes, SURFACE_BATTERY_FILE_DATA);
+	FileAttributes.EvtCleanupCallback = HotdogBatteryEvtFileContextCleanup;
+	WdfDeviceInitSetFileObjectConfig(DeviceInit, &FileConfig, &FileAttributes);
+
 	//
 	// Initialize attributes and a context area for the device object.
 	//
 
 	WDF_OBJECT_ATTRIBUTES_INIT(&DeviceAttributes);
 	WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&DeviceAttributes, SURFACE_BATTERY_FDO_DATA);
+	DeviceAttributes.EvtCleanupCallback = HotdogBatteryEvtDeviceContextCleanup;
 
 	//
 	// Create a framework device object.  This call will in turn create
@@ -265,6 +348,18 @@ Return Value:
 	DevExt->Device = DeviceHandle;
 	DevExt->BatteryTag = BATTERY_TAG_INVALID;
 	DevExt->ClassHandle = NULL;
+
+	HotdogBatteryCountersAttach(DevExt);
+
+	//
+	// Start with the class rundown completed, so no IOCTL can reference the
+	// class handle until registration re-arms it.
+	//
+
+	ExInitializeRundownProtection(&DevExt->ClassRundown);
+	ExWaitForRundownProtectionRelease(&DevExt->ClassRundown);
+	ExRundownCompleted(&DevExt->ClassRundown);
+
 	WDF_OBJECT_ATTRIBUTES_INIT(&LockAttributes);
 	LockAttributes.ParentObject = DeviceHandle;
 	Status = WdfWaitLockCreate(&LockAttributes,
@@ -291,6 +386,16 @@ Return Value:
 		goto DriverDeviceAddEnd;
 	}
 
+	Status = HotdogBatterySamplerCreate(DeviceHandle);
+	if (!NT_SUCCESS(Status)) {
+		goto DriverDeviceAddEnd;
+	}
+
+	Status = HotdogBatterySubscriptionCreate(DeviceHandle);
+	if (!NT_SUCCESS(Status)) {
+		goto DriverDeviceAddEnd;
+	}
+
 DriverDeviceAddEnd:
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
@@ -331,6 +436,9 @@ Return Value:
 	PAGED_CODE();
 
 	DevExt = GetDeviceExtension(Device);
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatterySharedTelemetryCreate(DevExt);
+	WdfWaitLockRelease(DevExt->StateLock);
 
 	//
 	// Attach to the battery class driver.
@@ -353,6 +461,10 @@ Return Value:
 	Status = BatteryClassInitializeDevice((PBATTERY_MINIPORT_INFO)&BattInit,
 		&DevExt->ClassHandle);
 
+	if (NT_SUCCESS(Status)) {
+		ExReInitializeRundownProtection(&DevExt->ClassRundown);
+	}
+
 	WdfWaitLockRelease(DevExt->ClassInitLock);
 	if (!NT_SUCCESS(Status)) {
 		goto DevicePrepareHardwareEnd;
@@ -387,6 +499,8 @@ Return Value:
 		Status = STATUS_SUCCESS;
 	}
 
+	HotdogBatterySamplerStart(Device);
+
 DevicePrepareHardwareEnd:
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
@@ -424,6 +538,8 @@ Return Value:
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 	PAGED_CODE();
 
+	HotdogBatterySamplerStop(Device);
+
 	DeviceObject = WdfDeviceWdmGetDeviceObject(Device);
 	Status = IoWMIRegistrationControl(DeviceObject, WMIREG_ACTION_DEREGISTER);
 	if (!NT_SUCCESS(Status)) {
@@ -437,15 +553,98 @@ Return Value:
 	DevExt = GetDeviceExtension(Device);
 	WdfWaitLockAcquire(DevExt->ClassInitLock, NULL);
 	if (DevExt->ClassHandle != NULL) {
+
+		//
+		// Wait for in-flight IOCTL and WMI dispatch to drain before the class
+		// handle goes away. New requests fail to acquire the rundown and are
+		// forwarded down the stack.
+		//
+
+		ExWaitForRundownProtectionRelease(&DevExt->ClassRundown);
+		ExRundownCompleted(&DevExt->ClassRundown);
 		Status = BatteryClassUnload(DevExt->ClassHandle);
 		DevExt->ClassHandle = NULL;
 	}
 
 	WdfWaitLockRelease(DevExt->ClassInitLock);
+
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatterySharedTelemetryDestroy(DevExt);
+	WdfWaitLockRelease(DevExt->StateLock);
+
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return;
 }
 
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatterySelfManagedIoSuspend(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This function is called before the device leaves D0. The sampler is
+	stopped so no bus I/O is attempted while the device is powered down.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
+	PAGED_CODE();
+
+	HotdogBatterySamplerStop(Device);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!\n");
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatterySelfManagedIoRestart(
+	WDFDEVICE Device
+)
+
+/*++
+
+Routine Description:
+
+	This function is called when the device returns to D0 after a
+	SelfManagedIoSuspend. Sampling resumes with a full burst, since the
+	battery may have changed state while the device was powered down.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
+	PAGED_CODE();
+
+	HotdogBatterySamplerStart(Device);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!\n");
+	return STATUS_SUCCESS;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 HotdogBatteryQueryStop(
@@ -565,6 +764,13 @@ Return Value:
 		}
 	}
 
+#if SPB_EMULATE_GAUGE
+	//
+	// The emulated gauge does not need a connection resource
+	//
+	status = STATUS_SUCCESS;
+#endif
+
 	if (!NT_SUCCESS(status))
 	{
 		Trace(
@@ -599,6 +805,102 @@ exit:
 	return status;
 }
 
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryDeviceReleaseHardware(
+	WDFDEVICE Device,
+	WDFCMRESLIST ResourcesTranslated
+)
+
+/*++
+
+Routine Description:
+
+	EvtDeviceReleaseHardware is called by the framework when the device is
+	stopped or removed, after it left D0. The SPB target is torn down here,
+	which also drops the reference of the device on the shared bus, so the
+	bus of a controller is freed with its last gauge.
+
+	The battery class is only unloaded later, in self managed I/O cleanup,
+	and may still call in. Every transfer and every bus capture access runs
+	under the state lock, taking it keeps them out while the target goes
+	away, and those issued afterwards fail.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+	ResourcesTranslated - Supplies a handle to a collection of framework
+		resource objects, not used.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+
+	UNREFERENCED_PARAMETER(ResourcesTranslated);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	HotdogBatteryAcquireStateLock(DevExt);
+	SpbTargetDeinitialize(Device, &DevExt->I2CContext);
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!\n");
+	return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+HotdogBatteryDeviceD0Exit(
+	WDFDEVICE Device,
+	WDF_POWER_DEVICE_STATE TargetState
+)
+
+/*++
+
+Routine Description:
+
+	EvtDeviceD0Exit is called by the framework when the device leaves D0, on
+	suspend, shutdown and removal. Any batched snapshot update is flushed to
+	the registry here so the next start can report it immediately.
+
+Arguments:
+
+	Device - Supplies a handle to a framework device object.
+
+	TargetState - Supplies the device power state being entered.
+
+Return Value:
+
+	NTSTATUS
+
+--*/
+
+{
+
+	PSURFACE_BATTERY_FDO_DATA DevExt;
+
+	UNREFERENCED_PARAMETER(TargetState);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
+	PAGED_CODE();
+
+	DevExt = GetDeviceExtension(Device);
+	HotdogBatteryAcquireStateLock(DevExt);
+	HotdogBatterySaveSnapshot(DevExt, TRUE);
+	WdfWaitLockRelease(DevExt->StateLock);
+
+	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!\n");
+	return STATUS_SUCCESS;
+}
+
 _Use_decl_annotations_
 NTSTATUS
 HotdogBatteryWdmIrpPreprocessDeviceControl(
@@ -634,9 +936,9 @@ Return Value:
 {
 
 	PSURFACE_BATTERY_FDO_DATA DevExt;
+	PIO_STACK_LOCATION IrpSp;
 	NTSTATUS Status;
 
-	PAGED_CODE();
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
 
 	ASSERTMSG("Must be called at IRQL = PASSIVE_LEVEL",
@@ -646,12 +948,71 @@ Return Value:
 	Status = STATUS_NOT_SUPPORTED;
 
 	//
-	// Suppress 28118:Irq Exceeds Caller, see Routine Description for
-	// explaination.
+	// Driver-private IOCTLs are completed here, everything else goes to the
+	// battery class first.
 	//
 
-#pragma warning(suppress: 28118)
-	WdfWaitLockAcquire(DevExt->ClassInitLock, NULL);
+	IrpSp = IoGetCurrentIrpStackLocation(Irp);
+	if (IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		IOCTL_SURFACE_BATTERY_QUERY_TELEMETRY) {
+
+		Status = HotdogBatteryTelemetryIoctl(DevExt, Irp);
+		goto PreprocessDeviceControlEnd;
+	}
+
+	if (IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		IOCTL_SURFACE_BATTERY_MAP_TELEMETRY) {
+
+		Status = HotdogBatteryMapTelemetryIoctl(DevExt, Irp);
+		goto PreprocessDeviceControlEnd;
+	}
+
+	if ((IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		 IOCTL_SURFACE_BATTERY_CONTROL_BUS_CAPTURE) ||
+		(IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		 IOCTL_SURFACE_BATTERY_READ_BUS_CAPTURE)) {
+
+		Status = HotdogBatteryBusCaptureIoctl(DevExt, Irp);
+		goto PreprocessDeviceControlEnd;
+	}
+
+	if ((IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		 IOCTL_SURFACE_BATTERY_QUERY_CALLBACK_STATS) ||
+		(IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		 IOCTL_SURFACE_BATTERY_RESET_CALLBACK_STATS)) {
+
+		Status = HotdogBatteryCallbackStatsIoctl(DevExt, Irp);
+		goto PreprocessDeviceControlEnd;
+	}
+
+	if ((IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		 IOCTL_SURFACE_BATTERY_QUERY_STALENESS) ||
+		(IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		 IOCTL_SURFACE_BATTERY_SET_STALENESS)) {
+
+		Status = HotdogBatteryStalenessIoctl(DevExt, Irp);
+		goto PreprocessDeviceControlEnd;
+	}
+
+	if (IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		IOCTL_SURFACE_BATTERY_QUERY_ENERGY) {
+
+		Status = HotdogBatteryEnergyIoctl(DevExt, Irp);
+		goto PreprocessDeviceControlEnd;
+	}
+
+	//
+	// Subscriptions are pended, they go through the framework so they can be
+	// parked in a queue and cancelled.
+	//
+
+	if (IrpSp->Parameters.DeviceIoControl.IoControlCode ==
+		IOCTL_SURFACE_BATTERY_WAIT_FOR_CHANGE) {
+
+		IoSkipCurrentIrpStackLocation(Irp);
+		Status = WdfDeviceWdmDispatchPreprocessedIrp(Device, Irp);
+		goto PreprocessDeviceControlEnd;
+	}
 
 	//
 	// N.B. An attempt to queue the IRP with the port driver should happen
@@ -660,23 +1021,28 @@ Return Value:
 	//      Battery port driver, which is a WDM driver, may complete the IRP if
 	//      it does endup procesing it.
 	//
+	// N.B. The class handle is only guarded by rundown protection, so IOCTLs
+	//      are dispatched in parallel and only wait on registration changes.
+	//
 
-	if (DevExt->ClassHandle != NULL) {
+	if (ExAcquireRundownProtection(&DevExt->ClassRundown)) {
 
 		//
-		// Suppress 28118:Irq Exceeds Caller, see above N.B.
+		// Suppress 28118:Irq Exceeds Caller, see Routine Description for
+		// explaination.
 		//
 
 #pragma warning(suppress: 28118)
 		Status = BatteryClassIoctl(DevExt->ClassHandle, Irp);
+		ExReleaseRundownProtection(&DevExt->ClassRundown);
 	}
 
-	WdfWaitLockRelease(DevExt->ClassInitLock);
 	if (Status == STATUS_NOT_SUPPORTED) {
 		IoSkipCurrentIrpStackLocation(Irp);
 		Status = WdfDeviceWdmDispatchPreprocessedIrp(Device, Irp);
 	}
 
+PreprocessDeviceControlEnd:
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Leaving %!FUNC!: Status = 0x%08lX\n", Status);
 	return Status;
 }
@@ -721,7 +1087,6 @@ Return Value:
 	NTSTATUS Status;
 
 	Trace(TRACE_LEVEL_INFORMATION, SURFACE_BATTERY_TRACE, "Entering %!FUNC!\n");
-	PAGED_CODE();
 
 	ASSERTMSG("Must be called at IRQL = PASSIVE_LEVEL", (KeGetCurrentIrql() == PASSIVE_LEVEL));
 
@@ -730,25 +1095,25 @@ Return Value:
 	Disposition = IrpForward;
 
 	//
-	// Acquire the class initialization lock and attempt to queue the IRP with
-	// the class driver.
+	// Acquire rundown protection on the class handle and attempt to queue the
+	// IRP with the class driver.
 	//
 	// Suppress 28118:Irq Exceeds Caller, see Routine Description for
 	// explaination.
 	//
 
-#pragma warning(suppress: 28118)
-	WdfWaitLockAcquire(DevExt->ClassInitLock, NULL);
-	if (DevExt->ClassHandle != NULL) {
+	if (ExAcquireRundownProtection(&DevExt->ClassRundown)) {
 		DeviceObject = WdfDeviceWdmGetDeviceObject(Device);
+#pragma warning(suppress: 28118)
 		Status = BatteryClassSystemControl(DevExt->ClassHandle,
 			&DevExt->WmiLibContext,
 			DeviceObject,
 			Irp,
 			&Disposition);
+
+		ExReleaseRundownProtection(&DevExt->ClassRundown);
 	}
 
-	WdfWaitLockRelease(DevExt->ClassInitLock);
 	switch (Disposition) {
 	case IrpProcessed:
 		break;
@@ -924,8 +1289,9 @@ Return Value:
 	//
 	// The class driver guarantees that all outstanding IO requests will be
 	// completed before it finishes unregistering. As a result, the class
-	// initialization lock does not need to be acquired in this callback, since
-	// it is called during class driver processing of a WMI IRP.
+	// rundown does not need to be acquired in this callback, since it is
+	// called during class driver processing of a WMI IRP, which already holds
+	// it.
 	//
 
 	Status = BatteryClassQueryWmiDataBlock(DevExt->ClassHandle,
@@ -981,6 +1347,64 @@ Return Value:
 	WPP_CLEANUP(NULL);
 }
 
+VOID
+HotdogBatteryEvtDeviceContextCleanup(
+	_In_ WDFOBJECT Device
+)
+/*++
+Routine Description:
+
+	Free the resources allocated in HotdogBatteryDriverDeviceAdd that are not
+	parented to the device object.
+
+Arguments:
+
+	Device - handle to a WDF Device object.
+
+Return Value:
+
+	VOID.
+
+--*/
+{
+	PAGED_CODE();
+
+	SpbCaptureStop(&GetDeviceExtension((WDFDEVICE)Device)->I2CContext);
+	HotdogBatteryCountersDetach(GetDeviceExtension((WDFDEVICE)Device));
+}
+
+VOID
+HotdogBatteryEvtFileContextCleanup(
+	_In_ WDFOBJECT FileObject
+)
+/*++
+Routine Description:
+
+	Drop the process reference taken when the telemetry section was mapped
+	for this handle. The view itself belongs to the process and is not
+	unmapped here.
+
+Arguments:
+
+	FileObject - handle to a WDF File object.
+
+Return Value:
+
+	VOID.
+
+--*/
+{
+	PSURFACE_BATTERY_FILE_DATA FileData;
+
+	PAGED_CODE();
+
+	FileData = GetFileData(FileObject);
+	if (FileData->TelemetryProcess != NULL) {
+		ObDereferenceObject(FileData->TelemetryProcess);
+		FileData->TelemetryProcess = NULL;
+	}
+}
+
 VOID
 HotdogBatteryEvtDriverUnload(
 	IN WDFDRIVER Driver
@@ -1002,6 +1426,9 @@ Return Value:
 {
 	PAGED_CODE();
 
+	HotdogBatteryCountersUnregister(GetGlobalData(Driver));
+	TraceLoggingUnregister(HotdogBatteryTraceProvider);
+
 	//
 	// Stop WPP Tracing
 	//
@@ -0,0 +1,779 @@
+/*++
+
+Module Name:
+
+	HotdogBatteryTest.c
+
+Abstract:
+
+	This module runs the kernel independent parts of the Hotdog battery
+	driver, HotdogBatteryLogic.h and the telemetry section reader of
+	HotdogBatteryIoctl.h, in user mode. Every failed check is printed with
+	its line, the exit code is the number of failed checks.
+
+	N.B. This code is provided "AS IS" without any expressed or implied warranty.
+
+--*/
+
+//--------------------------------------------------------------------- Includes
+
+#include <windows.h>
+#include <batclass.h>
+#include <stdio.h>
+#include <string.h>
+#include "HotdogBatteryLogic.h"
+
+//------------------------------------------------------------------ Definitions
+
+#define CHECK(Condition) \
+	HotdogBatteryTestCheck((Condition) ? TRUE : FALSE, #Condition, __LINE__)
+
+#define TEST_MS(Milliseconds) ((ULONGLONG)(Milliseconds) * 10000)
+
+#define TEST_SHARED_UPDATES 200000
+
+typedef struct _TEST_SHARED_CONTEXT
+{
+	SURFACE_BATTERY_SHARED_TELEMETRY Shared;
+	LONG Sequence;
+	volatile LONG Done;
+} TEST_SHARED_CONTEXT, *PTEST_SHARED_CONTEXT;
+
+//-------------------------------------------------------------------- Globals
+
+static ULONG HotdogBatteryTestChecks;
+static ULONG HotdogBatteryTestFailures;
+
+//-------------------------------------------------------------------- Functions
+
+static
+VOID
+HotdogBatteryTestCheck(
+	_In_ BOOLEAN Passed,
+	_In_ PCSTR Condition,
+	_In_ ULONG Line
+)
+
+/*++
+
+Routine Description:
+
+	This routine records the outcome of one check.
+
+Arguments:
+
+	Passed - Supplies whether the check passed.
+
+	Condition - Supplies the text of the checked condition.
+
+	Line - Supplies the line of the check.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	HotdogBatteryTestChecks += 1;
+	if (Passed == FALSE) {
+		HotdogBatteryTestFailures += 1;
+		printf("HotdogBatteryTest.c(%lu): CHECK(%s) failed\n", (unsigned long)Line, Condition);
+	}
+}
+
+static
+VOID
+HotdogBatteryTestBurst(
+	_Out_ PSURFACE_BATTERY_STATUS_BURST Burst,
+	_In_ UINT16 Voltage,
+	_In_ INT16 AverageCurrent,
+	_In_ UINT16 RemainingCapacity,
+	_In_ UINT16 FullChargeCapacity
+)
+
+/*++
+
+Routine Description:
+
+	This routine fills a status burst with the fields the logic looks at.
+
+Arguments:
+
+	Burst - Supplies the burst to fill.
+
+	Voltage - Supplies the voltage in mV.
+
+	AverageCurrent - Supplies the average current in mA.
+
+	RemainingCapacity - Supplies the remaining capacity in mAh.
+
+	FullChargeCapacity - Supplies the full charge capacity in mAh.
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ZeroMemory(Burst, sizeof(*Burst));
+	Burst->Voltage = Voltage;
+	Burst->AverageCurrent = AverageCurrent;
+	Burst->RemainingCapacity = RemainingCapacity;
+	Burst->FullChargeCapacity = FullChargeCapacity;
+}
+
+static
+VOID
+HotdogBatteryTestChangedFields(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine checks the thresholds of change subscriptions.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	SURFACE_BATTERY_CHANGE_FILTER Filter;
+	SURFACE_BATTERY_CHANGE_SAMPLE Sample;
+
+	ZeroMemory(&Filter, sizeof(Filter));
+	Filter.Version = SURFACE_BATTERY_CHANGE_FILTER_VERSION;
+	Filter.Baseline.BatteryTag = 7;
+	Filter.Baseline.PowerState = BATTERY_DISCHARGING;
+	Filter.Baseline.Capacity = 10000;
+	Filter.Baseline.Voltage = 3800;
+	Filter.Baseline.Rate = -500;
+	Filter.Baseline.Temperature = 2980;
+
+	//
+	// Nothing selected: only a new battery tag completes the request.
+	//
+
+	Sample = Filter.Baseline;
+	Sample.Capacity = 0;
+	Sample.PowerState = BATTERY_CHARGING;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == 0);
+	Sample.BatteryTag = 8;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == SURFACE_BATTERY_CHANGE_TAG);
+
+	//
+	// A delta is reached in both directions, one less is not.
+	//
+
+	Filter.Fields = SURFACE_BATTERY_CHANGE_CAPACITY;
+	Filter.CapacityDelta = 100;
+	Sample = Filter.Baseline;
+	Sample.Capacity = 10099;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == 0);
+	Sample.Capacity = 10100;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == SURFACE_BATTERY_CHANGE_CAPACITY);
+	Sample.Capacity = 9900;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == SURFACE_BATTERY_CHANGE_CAPACITY);
+
+	//
+	// A zero delta stands for any change.
+	//
+
+	Filter.Fields = SURFACE_BATTERY_CHANGE_VOLTAGE | SURFACE_BATTERY_CHANGE_POWER_STATE;
+	Sample = Filter.Baseline;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == 0);
+	Sample.Voltage = 3801;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == SURFACE_BATTERY_CHANGE_VOLTAGE);
+	Sample.PowerState = BATTERY_POWER_ON_LINE;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) ==
+		(SURFACE_BATTERY_CHANGE_VOLTAGE | SURFACE_BATTERY_CHANGE_POWER_STATE));
+
+	//
+	// The rate is signed, crossing zero counts the full distance.
+	//
+
+	Filter.Fields = SURFACE_BATTERY_CHANGE_RATE;
+	Filter.RateDelta = 1000;
+	Sample = Filter.Baseline;
+	Sample.Rate = 499;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == 0);
+	Sample.Rate = 500;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == SURFACE_BATTERY_CHANGE_RATE);
+
+	Filter.Fields = SURFACE_BATTERY_CHANGE_TEMPERATURE;
+	Filter.TemperatureDelta = 10;
+	Sample = Filter.Baseline;
+	Sample.Temperature = 2970;
+	CHECK(HotdogBatteryChangedFields(&Filter, &Sample) == SURFACE_BATTERY_CHANGE_TEMPERATURE);
+}
+
+static
+VOID
+HotdogBatteryTestPowerFilter(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine walks the power state machine through the transitions
+	described in powerstate.c.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	SURFACE_BATTERY_STATUS_BURST Burst;
+	SURFACE_BATTERY_POWER_FILTER Filter;
+	ULONGLONG Now;
+
+	HotdogBatteryPowerFilterReset(&Filter);
+	Now = TEST_MS(1000000);
+
+	//
+	// The first state is reported as is.
+	//
+
+	HotdogBatteryTestBurst(&Burst, 3800, -400, 2000, 4000);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_DISCHARGING, &Burst, Now) == BATTERY_DISCHARGING);
+	CHECK(Filter.Transitions == 0);
+
+	//
+	// Charging with a current below the hysteresis waits for the debounce,
+	// a raw state going back in the meantime restarts it.
+	//
+
+	HotdogBatteryTestBurst(&Burst, 3900, 10, 2000, 4000);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst, Now) == BATTERY_DISCHARGING);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst,
+		Now + TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS - 1)) == BATTERY_DISCHARGING);
+
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_DISCHARGING, &Burst,
+		Now + TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS)) == BATTERY_DISCHARGING);
+
+	CHECK(Filter.PendingPowerState == 0);
+	Now += TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS + 1);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst, Now) == BATTERY_DISCHARGING);
+	Now += TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst, Now) == BATTERY_CHARGING);
+	CHECK(Filter.Transitions == 1);
+
+	//
+	// A current agreeing with the raw state by the hysteresis is followed
+	// at once.
+	//
+
+	HotdogBatteryTestBurst(&Burst, 3800, (INT16)(-SURFACE_BATTERY_POWER_STATE_CURRENT_HYSTERESIS), 2000, 4000);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_DISCHARGING, &Burst, Now) == BATTERY_DISCHARGING);
+	CHECK(Filter.Transitions == 2);
+
+	//
+	// Critical is reported at once, leaving it takes the debounce even with
+	// a strong discharge current.
+	//
+
+	Now += TEST_MS(1);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_DISCHARGING | BATTERY_CRITICAL, &Burst, Now) ==
+		(BATTERY_DISCHARGING | BATTERY_CRITICAL));
+
+	HotdogBatteryTestBurst(&Burst, 3400, -2000, 100, 4000);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_DISCHARGING, &Burst, Now) ==
+		(BATTERY_DISCHARGING | BATTERY_CRITICAL));
+
+	Now += TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_DISCHARGING, &Burst, Now) == BATTERY_DISCHARGING);
+
+	//
+	// Once full, charging is only reported after the state of charge fell
+	// by the hysteresis.
+	//
+
+	HotdogBatteryTestBurst(&Burst, 4350, 0, 4000, 4000);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_POWER_ON_LINE, &Burst, Now) == BATTERY_DISCHARGING);
+	Now += TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_POWER_ON_LINE, &Burst, Now) == BATTERY_POWER_ON_LINE);
+
+	HotdogBatteryTestBurst(&Burst, 4340, 500, 3950, 4000);
+	Now += TEST_MS(1);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst, Now) == BATTERY_POWER_ON_LINE);
+	Now += TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS * 10);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst, Now) == BATTERY_POWER_ON_LINE);
+
+	HotdogBatteryTestBurst(&Burst, 4300, 500, 3900, 4000);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst, Now) == BATTERY_POWER_ON_LINE);
+	Now += TEST_MS(SURFACE_BATTERY_POWER_STATE_DEBOUNCE_MS);
+	CHECK(HotdogBatteryPowerFilterUpdate(&Filter, BATTERY_CHARGING, &Burst, Now) == BATTERY_CHARGING);
+}
+
+static
+VOID
+HotdogBatteryTestChargeOverInterval(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine checks the charge integration used by the status
+	extrapolation.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	CHECK(HotdogBatteryChargeOverInterval(1000, SURFACE_BATTERY_HOUR) == 1000);
+	CHECK(HotdogBatteryChargeOverInterval(-500, SURFACE_BATTERY_HOUR / 2) == -250);
+	CHECK(HotdogBatteryChargeOverInterval(-500, 0) == 0);
+
+	//
+	// Intervals are clamped to a day.
+	//
+
+	CHECK(HotdogBatteryChargeOverInterval(MAXSHORT, SURFACE_BATTERY_HOUR * 48) == (LONG)MAXSHORT * 24);
+	CHECK(HotdogBatteryChargeOverInterval(MINSHORT, SURFACE_BATTERY_HOUR * 48) == (LONG)MINSHORT * 24);
+}
+
+static
+VOID
+HotdogBatteryTestEnergyAccount(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine integrates fixed voltages and currents over fixed intervals
+	and checks the energies and the time split.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	SURFACE_BATTERY_ENERGY_ACCOUNT Account;
+	SURFACE_BATTERY_STATUS_BURST Burst;
+	ULONG Index;
+
+	ZeroMemory(&Account, sizeof(Account));
+
+	//
+	// 3.8 V at -1 A for 1800 two-second intervals is 3800 mWh on battery,
+	// less at most one nWh truncated per interval.
+	//
+
+	HotdogBatteryTestBurst(&Burst, 3800, -1000, 2000, 4000);
+	for (Index = 0; Index < 1800; Index += 1) {
+		HotdogBatteryEnergyAccountAdd(&Account,
+			&Burst,
+			BATTERY_DISCHARGING,
+			TEST_MS(2000),
+			SURFACE_BATTERY_HOUR);
+	}
+
+	CHECK(Account.Discharged <= 3800ULL * 1000000);
+	CHECK(Account.Discharged > 3800ULL * 1000000 - 1800);
+	CHECK(Account.Charged == 0);
+	CHECK(Account.BatteryTime == SURFACE_BATTERY_HOUR);
+	CHECK(Account.AcTime == 0);
+	CHECK(Account.Samples == 1800);
+
+	//
+	// 4.2 V at 0.5 A for half an hour on AC is 1050 mWh charged.
+	//
+
+	HotdogBatteryTestBurst(&Burst, 4200, 500, 3000, 4000);
+	HotdogBatteryEnergyAccountAdd(&Account,
+		&Burst,
+		BATTERY_POWER_ON_LINE,
+		SURFACE_BATTERY_HOUR / 2,
+		SURFACE_BATTERY_HOUR);
+
+	CHECK(Account.Charged == 1050ULL * 1000000);
+	CHECK(Account.AcTime == SURFACE_BATTERY_HOUR / 2);
+	CHECK(Account.BatteryTime == SURFACE_BATTERY_HOUR);
+
+	//
+	// Charging is decoded without BATTERY_POWER_ON_LINE and still counts as
+	// AC, 4.0 V at 1.5 A for a quarter hour is another 1500 mWh.
+	//
+
+	HotdogBatteryTestBurst(&Burst, 4000, 1500, 3500, 4000);
+	HotdogBatteryEnergyAccountAdd(&Account,
+		&Burst,
+		BATTERY_CHARGING,
+		SURFACE_BATTERY_HOUR / 4,
+		SURFACE_BATTERY_HOUR);
+
+	CHECK(Account.Charged == 2550ULL * 1000000);
+	CHECK(Account.AcTime == SURFACE_BATTERY_HOUR / 2 + SURFACE_BATTERY_HOUR / 4);
+	CHECK(Account.BatteryTime == SURFACE_BATTERY_HOUR);
+
+	//
+	// An interval longer than the bound only counts as a gap.
+	//
+
+	HotdogBatteryEnergyAccountAdd(&Account,
+		&Burst,
+		BATTERY_CHARGING,
+		SURFACE_BATTERY_HOUR + 1,
+		SURFACE_BATTERY_HOUR);
+
+	CHECK(Account.GapTime == SURFACE_BATTERY_HOUR + 1);
+	CHECK(Account.Charged == 2550ULL * 1000000);
+	CHECK(Account.AcTime == SURFACE_BATTERY_HOUR / 2 + SURFACE_BATTERY_HOUR / 4);
+	CHECK(Account.Samples == 1802);
+}
+
+static
+DWORD
+WINAPI
+HotdogBatteryTestSharedWriter(
+	_In_ LPVOID Parameter
+)
+
+/*++
+
+Routine Description:
+
+	This routine publishes TEST_SHARED_UPDATES updates of the telemetry
+	section. Every field of update N holds N, so a torn copy shows up as
+	fields that disagree.
+
+Arguments:
+
+	Parameter - Supplies the TEST_SHARED_CONTEXT.
+
+Return Value:
+
+	0
+
+--*/
+
+{
+	PTEST_SHARED_CONTEXT Context;
+	LONG Update;
+
+	Context = (PTEST_SHARED_CONTEXT)Parameter;
+	for (Update = 1; Update <= TEST_SHARED_UPDATES; Update += 1) {
+		HotdogBatterySharedTelemetryBeginUpdate(&Context->Shared, &Context->Sequence);
+		Context->Shared.Version = SURFACE_BATTERY_SHARED_TELEMETRY_VERSION;
+		Context->Shared.Size = sizeof(SURFACE_BATTERY_SHARED_TELEMETRY);
+		Context->Shared.BatteryTag = (ULONG)Update;
+		Context->Shared.StatusTimestamp = Update;
+		Context->Shared.InformationTimestamp = Update;
+
+		//
+		// Widen the window a reader can tear.
+		//
+
+		YieldProcessor();
+		Context->Shared.Status.PowerState = (ULONG)Update;
+		Context->Shared.Status.Capacity = (ULONG)Update;
+		Context->Shared.Status.Voltage = (ULONG)Update;
+		Context->Shared.Status.Rate = Update;
+		Context->Shared.DesignedCapacity = (ULONG)Update;
+		Context->Shared.FullChargedCapacity = (ULONG)Update;
+		Context->Shared.CycleCount = (ULONG)Update;
+		Context->Shared.Temperature = (ULONG)Update;
+		Context->Shared.GaugeFlags = (ULONG)Update;
+		HotdogBatterySharedTelemetryEndUpdate(&Context->Shared, &Context->Sequence);
+	}
+
+	WriteRelease(&Context->Done, TRUE);
+	return 0;
+}
+
+static
+BOOLEAN
+HotdogBatteryTestSharedConsistent(
+	_In_ const SURFACE_BATTERY_SHARED_TELEMETRY *Copy
+)
+
+/*++
+
+Routine Description:
+
+	This routine decides whether a copy of the telemetry section holds a
+	single update of HotdogBatteryTestSharedWriter.
+
+Arguments:
+
+	Copy - Supplies the copy.
+
+Return Value:
+
+	TRUE if every field holds the same update.
+
+--*/
+
+{
+	ULONG Update;
+
+	Update = Copy->BatteryTag;
+	return (Copy->Sequence & 1) == 0 &&
+		Copy->Sequence == (LONG)Update * 2 &&
+		Copy->StatusTimestamp == (LONGLONG)Update &&
+		Copy->InformationTimestamp == (LONGLONG)Update &&
+		Copy->Status.PowerState == Update &&
+		Copy->Status.Capacity == Update &&
+		Copy->Status.Voltage == Update &&
+		Copy->Status.Rate == (LONG)Update &&
+		Copy->DesignedCapacity == Update &&
+		Copy->FullChargedCapacity == Update &&
+		Copy->CycleCount == Update &&
+		Copy->Temperature == Update &&
+		Copy->GaugeFlags == Update;
+}
+
+static
+VOID
+HotdogBatteryTestSharedTelemetry(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs SurfaceBatteryReadSharedTelemetry against a concurrent
+	writer and checks that every copy it accepts is consistent and that the
+	updates it sees never go backwards.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	static TEST_SHARED_CONTEXT Context;
+	SURFACE_BATTERY_SHARED_TELEMETRY Copy;
+	ULONG Last;
+	ULONG Reads;
+	ULONG Torn;
+	HANDLE Writer;
+
+	ZeroMemory(&Context, sizeof(Context));
+
+	//
+	// A section stuck in an update is never returned.
+	//
+
+	HotdogBatterySharedTelemetryBeginUpdate(&Context.Shared, &Context.Sequence);
+	CHECK(SurfaceBatteryReadSharedTelemetry(&Context.Shared, &Copy) == FALSE);
+	HotdogBatterySharedTelemetryEndUpdate(&Context.Shared, &Context.Sequence);
+	CHECK(SurfaceBatteryReadSharedTelemetry(&Context.Shared, &Copy) != FALSE);
+	CHECK(Copy.Sequence == 2);
+
+	ZeroMemory(&Context, sizeof(Context));
+	Writer = CreateThread(NULL, 0, HotdogBatteryTestSharedWriter, &Context, 0, NULL);
+	CHECK(Writer != NULL);
+	if (Writer == NULL) {
+		return;
+	}
+
+	Last = 0;
+	Reads = 0;
+	Torn = 0;
+	while (ReadAcquire(&Context.Done) == FALSE) {
+		if (SurfaceBatteryReadSharedTelemetry(&Context.Shared, &Copy) == FALSE) {
+			continue;
+		}
+
+		Reads += 1;
+		if (HotdogBatteryTestSharedConsistent(&Copy) == FALSE || Copy.BatteryTag < Last) {
+			Torn += 1;
+		}
+
+		Last = Copy.BatteryTag;
+	}
+
+	WaitForSingleObject(Writer, INFINITE);
+	CloseHandle(Writer);
+
+	printf("Shared telemetry: %lu consistent reads during %lu updates\n",
+		(unsigned long)(Reads - Torn),
+		(unsigned long)TEST_SHARED_UPDATES);
+
+	CHECK(Torn == 0);
+	CHECK(SurfaceBatteryReadSharedTelemetry(&Context.Shared, &Copy) != FALSE);
+	CHECK(HotdogBatteryTestSharedConsistent(&Copy) != FALSE);
+	CHECK(Copy.BatteryTag == TEST_SHARED_UPDATES);
+}
+
+static
+VOID
+HotdogBatteryTestSnapshotIsFresh(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine checks the staleness bound of persisted timestamps around
+	its edges.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	ULONGLONG Now;
+
+	Now = 133000000000000000ULL;
+	CHECK(HotdogBatterySnapshotIsFresh(0, SURFACE_BATTERY_HOUR, Now) == FALSE);
+	CHECK(HotdogBatterySnapshotIsFresh(Now + 1, SURFACE_BATTERY_HOUR, Now) == FALSE);
+	CHECK(HotdogBatterySnapshotIsFresh(Now, SURFACE_BATTERY_HOUR, Now) != FALSE);
+	CHECK(HotdogBatterySnapshotIsFresh(Now - SURFACE_BATTERY_HOUR, SURFACE_BATTERY_HOUR, Now) != FALSE);
+	CHECK(HotdogBatterySnapshotIsFresh(Now - SURFACE_BATTERY_HOUR - 1, SURFACE_BATTERY_HOUR, Now) == FALSE);
+}
+
+static
+VOID
+HotdogBatteryTestSnapshotRoundTrip(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine seals a snapshot, reads it back through a byte buffer the
+	way the registry returns it and checks that it is accepted unchanged,
+	and that truncated or foreign snapshots are rejected.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	None
+
+--*/
+
+{
+	BYTE Bytes[sizeof(SURFACE_BATTERY_SNAPSHOT) + 8];
+	SURFACE_BATTERY_SNAPSHOT Loaded;
+	SURFACE_BATTERY_SNAPSHOT Snapshot;
+
+	C_ASSERT(sizeof(SURFACE_BATTERY_SNAPSHOT) == 52);
+
+	ZeroMemory(&Snapshot, sizeof(Snapshot));
+	Snapshot.InformationTimestamp = 133000000000000000ULL;
+	Snapshot.StatusTimestamp = 133000000000000001ULL;
+	Snapshot.DesignedCapacity = 17415;
+	Snapshot.FullChargedCapacity = 16254;
+	Snapshot.CycleCount = 321;
+	Snapshot.PowerState = BATTERY_DISCHARGING;
+	Snapshot.Capacity = 7740;
+	Snapshot.Voltage = 3812;
+	Snapshot.Rate = -1548;
+	HotdogBatterySnapshotSeal(&Snapshot, 42);
+
+	CHECK(Snapshot.Version == SURFACE_BATTERY_SNAPSHOT_VERSION);
+	CHECK(Snapshot.Size == sizeof(SURFACE_BATTERY_SNAPSHOT));
+	CHECK(Snapshot.BatteryTag == 42);
+
+	ZeroMemory(Bytes, sizeof(Bytes));
+	CopyMemory(Bytes, &Snapshot, sizeof(Snapshot));
+	ZeroMemory(&Loaded, sizeof(Loaded));
+	CopyMemory(&Loaded, Bytes, sizeof(Loaded));
+	CHECK(HotdogBatterySnapshotIsValid(&Loaded, sizeof(Loaded)) != FALSE);
+	CHECK(memcmp(&Loaded, &Snapshot, sizeof(Snapshot)) == 0);
+
+	//
+	// A value of another length, size or version is ignored.
+	//
+
+	CHECK(HotdogBatterySnapshotIsValid(&Loaded, sizeof(Loaded) - 1) == FALSE);
+	CHECK(HotdogBatterySnapshotIsValid(&Loaded, sizeof(Loaded) + 8) == FALSE);
+
+	Loaded.Size = (USHORT)(sizeof(Loaded) - 4);
+	CHECK(HotdogBatterySnapshotIsValid(&Loaded, sizeof(Loaded)) == FALSE);
+
+	Loaded.Size = Snapshot.Size;
+	Loaded.Version = SURFACE_BATTERY_SNAPSHOT_VERSION + 1;
+	CHECK(HotdogBatterySnapshotIsValid(&Loaded, sizeof(Loaded)) == FALSE);
+}
+
+int
+__cdecl
+main(
+	VOID
+)
+
+/*++
+
+Routine Description:
+
+	This routine runs every test.
+
+Arguments:
+
+	None
+
+Return Value:
+
+	Number of failed checks.
+
+--*/
+
+{
+	HotdogBatteryTestChangedFields();
+	HotdogBatteryTestPowerFilter();
+	HotdogBatteryTestChargeOverInterval();
+	HotdogBatteryTestEnergyAccount();
+	HotdogBatteryTestSharedTelemetry();
+	HotdogBatteryTestSnapshotIsFresh();
+	HotdogBatteryTestSnapshotRoundTrip();
+
+	printf("%lu checks, %lu failed\n",
+		(unsigned long)HotdogBatteryTestChecks,
+		(unsigned long)HotdogBatteryTestFailures);
+
+	return (int)HotdogBatteryTestFailures;
+}